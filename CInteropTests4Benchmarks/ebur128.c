@@ -5,11 +5,12 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h> /* You may have to define _USE_MATH_DEFINES if you use MSVC */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-/* This can be replaced by any BSD-like queue implementation. */
-#include <sys/queue.h>
+#include <string.h>
 
 #define CHECK_ERROR(condition, errorcode, goto_point) \
   if ((condition)) {                                  \
@@ -30,41 +31,170 @@ static int safe_size_mul(size_t nmemb, size_t size, size_t* result) {
   return 0;
 }
 
-STAILQ_HEAD(ebur128_double_queue, ebur128_dq_entry);
-struct ebur128_dq_entry {
-  double z;
-  STAILQ_ENTRY(ebur128_dq_entry) entries;
+static void* ebur128_default_allocate(size_t size, void* user) {
+  (void)user;
+  return malloc(size);
+}
+
+static void* ebur128_default_reallocate(void* ptr, size_t size, void* user) {
+  (void)user;
+  return realloc(ptr, size);
+}
+
+static void ebur128_default_deallocate(void* ptr, void* user) {
+  (void)user;
+  free(ptr);
+}
+
+static const ebur128_allocator ebur128_default_allocator = {
+    ebur128_default_allocate, ebur128_default_reallocate,
+    ebur128_default_deallocate, NULL};
+
+/* All memory of a state is allocated through these, with the allocator of
+ * the state. */
+static void* ebur128_malloc(const ebur128_allocator* allocator, size_t size) {
+  return allocator->allocate(size, allocator->user);
+}
+
+static void* ebur128_calloc(const ebur128_allocator* allocator, size_t nmemb,
+                            size_t size) {
+  size_t bytes;
+  void* ptr;
+
+  if (safe_size_mul(nmemb, size, &bytes)) {
+    return NULL;
+  }
+  ptr = allocator->allocate(bytes, allocator->user);
+  if (ptr) {
+    memset(ptr, 0, bytes);
+  }
+  return ptr;
+}
+
+static void* ebur128_realloc(const ebur128_allocator* allocator, void* ptr,
+                             size_t size) {
+  return allocator->reallocate(ptr, size, allocator->user);
+}
+
+static void ebur128_free(const ebur128_allocator* allocator, void* ptr) {
+  if (ptr) {
+    allocator->deallocate(ptr, allocator->user);
+  }
+}
+
+/* Summaries group energies in bins of 1/32 octave from 2^-24, below the
+ * absolute gate, to 2^8; the bins at either end also take the energies
+ * beyond. */
+#define EBUR128_BIN_MIN_EXPONENT (-23)
+#define EBUR128_BINS_PER_OCTAVE 32
+#define EBUR128_BIN_COUNT (32 * EBUR128_BINS_PER_OCTAVE)
+#define EBUR128_NO_BLOCK ((size_t)-1)
+
+/** A block of a ring as node of a treap ordered by energy, then by serial
+ *  number. Links are serial numbers, so that nodes move with their entries
+ *  when the ring grows. */
+struct ebur128_block_node {
+  /** Serial numbers of the children, EBUR128_NO_BLOCK if there are none. */
+  size_t left;
+  size_t right;
+  /** Number and sum of the energies in the subtree. */
+  size_t count;
+  double sum;
+};
+
+/** Block energies in insertion order, kept in one array used as ring
+ *  buffer. The array grows as blocks are added, up to `max` entries; beyond
+ *  that the oldest entry is overwritten. */
+struct ebur128_block_ring {
+  double* z;
+  /** Node of every entry of z in the treap rooted at `root`. */
+  struct ebur128_block_node* nodes;
+  size_t root;
+  size_t capacity;
+  /** Index of the oldest energy. */
+  size_t head;
+  size_t size;
+  unsigned long max;
+  /** Serial number of the oldest energy. */
+  size_t first;
+  const ebur128_allocator* allocator;
+};
+
+/** Histogram bins of the blocks in insertion order, kept while the history
+ *  is limited so that the oldest blocks can be taken out of the histogram
+ *  again. Used as ring buffer like struct ebur128_block_ring. */
+struct ebur128_bin_ring {
+  unsigned int* bin;
+  size_t capacity;
+  /** Index of the oldest bin. */
+  size_t head;
+  size_t size;
+  /** Maximum number of blocks, 0 if the history is not limited. */
+  unsigned long max;
+  const ebur128_allocator* allocator;
 };
 
-#define ALMOST_ZERO 0.000001
+/* Initial capacity of a block ring, 100 s of gating blocks. */
+#define EBUR128_RING_MIN_CAPACITY 1000
+
+/* Bins of the default histogram, 0.1 LU from -70 to +30 LUFS. */
+#define EBUR128_HISTOGRAM_BINS 1000
+
 #define FILTER_STATE_SIZE 5
 
+/* Largest delay of the interpolators, ceil(49 taps / factor 2). */
+#define INTERP_MAX_DELAY 25
+
 typedef struct {
-  unsigned int count;  /* Number of coefficients in this subfilter */
-  unsigned int* index; /* Delay index of corresponding filter coeff */
-  double* coeff;       /* List of subfilter coefficients */
+  unsigned int dense_begin; /* Delays [dense_begin, dense_end) are used */
+  unsigned int dense_end;
+  /* Coefficient per delay, zero where there is none */
+  double dense[INTERP_MAX_DELAY];
 } interp_filter;
 
+/* Polyphase subfilters of a 49-tap Hann-windowed sinc, one per phase. */
+typedef struct {
+  unsigned int factor; /* Interpolation factor */
+  unsigned int delay;  /* Size of delay buffer */
+  /* Upper bound of |output| / max |input|, with margin for rounding. */
+  double peak_gain;
+  interp_filter filter[4];
+} interp_coefficients;
+
 typedef struct {         /* Data structure for polyphase FIR interpolator */
   unsigned int factor;   /* Interpolation factor of the interpolator */
-  unsigned int taps;     /* Taps (prefer odd to increase zero coeffs) */
   unsigned int channels; /* Number of channels */
   unsigned int delay;    /* Size of delay buffer */
-  interp_filter* filter; /* List of subfilters (one for each factor) */
+  const interp_filter* filter; /* List of subfilters (one for each factor) */
   float** z;             /* List of delay buffers (one for each channel) */
   unsigned int zi;       /* Current delay buffer index */
+  /* Linear delay lines (one for each channel): the last delay - 1 input
+   * samples followed by room for max_frames new ones. */
+  double** line;
+  size_t max_frames;
+  /* Upper bound of |output| / max |input|, with margin for rounding. */
+  double peak_gain;
 } interpolator;
 
 /** BS.1770 filter state. */
 typedef double filter_state[FILTER_STATE_SIZE];
 
+/* Values of ebur128_measurement, in the order of its fields. */
+#define EBUR128_PUBLISHED_VALUES 6
+
 struct ebur128_state_internal {
-  /** Filtered audio data (used as ring buffer). */
+  /** Filtered audio data (used as ring buffer). NULL in
+   *  EBUR128_MODE_LOW_MEMORY. */
   double* audio_data;
   /** Size of audio_data array. */
   size_t audio_data_frames;
   /** Current index for audio_data. */
   size_t audio_data_index;
+  /** Frames of audio_data written since it was allocated or reset, and
+   *  the first of the frames zeroed at its end. The frames in between are
+   *  uninitialized until ebur128_clear_audio_data(). */
+  size_t audio_data_fill;
+  size_t audio_data_zeroed;
   /** How many frames are needed for a gating block. Will correspond to 400ms
    *  of audio at initialization, and 100ms after the first block (75% overlap
    *  as specified in the 2011 revision of BS1770). */
@@ -73,23 +203,43 @@ struct ebur128_state_internal {
   int* channel_map;
   /** How many samples fit in 100ms (rounded). */
   unsigned long samples_in_100ms;
+  /** Channel-weighted energy of each 100ms sub-block, summed while
+   *  filtering (used as ring buffer). Holds one sub-block more than fits in
+   *  the window, so the one being filled never overlaps a complete window. */
+  double* sub_block_energy;
+  /** Size of sub_block_energy array. */
+  size_t sub_block_count;
+  /** Index of the sub-block being filled. */
+  size_t sub_block_index;
   /** BS.1770 filter coefficients (nominator). */
   double b[5];
   /** BS.1770 filter coefficients (denominator). */
   double a[5];
   /** one filter_state per channel. */
   filter_state* v;
-  /** Linked list of block energies. */
-  struct ebur128_double_queue block_list;
-  unsigned long block_list_max;
-  unsigned long block_list_size;
-  /** Linked list of 3s-block energies, used to calculate LRA. */
-  struct ebur128_double_queue short_term_block_list;
-  unsigned long st_block_list_max;
-  unsigned long st_block_list_size;
+  /** Block energies. */
+  struct ebur128_block_ring blocks;
+  /** 3s-block energies, used to calculate LRA. */
+  struct ebur128_block_ring short_term_blocks;
   int use_histogram;
-  unsigned long* block_energy_histogram;
-  unsigned long* short_term_block_energy_histogram;
+  /** Histogram bins are histogram_step LU wide, the first one starting at
+   *  histogram_min LUFS. */
+  double histogram_min;
+  double histogram_step;
+  size_t histogram_bins;
+  /** Block counts per bin. They are stored as doubles, which are exact up
+   *  to 2^53 blocks, so that the weighted sums can be vectorized.
+   *  block_energy_histogram owns the memory of all histogram arrays. */
+  double* block_energy_histogram;
+  double* short_term_block_energy_histogram;
+  /** Energy at the centre of every bin. */
+  double* histogram_energies;
+  /** Energy at the lower boundary of every bin, and at the upper boundary
+   *  of the last one. */
+  double* histogram_boundaries;
+  /** Bins of the blocks in the histograms while the history is limited. */
+  struct ebur128_bin_ring block_bins;
+  struct ebur128_bin_ring short_term_block_bins;
   /** Keeps track of when a new short term block is needed. */
   size_t short_term_frame_counter;
   /** Maximum sample peak, one per channel */
@@ -98,115 +248,183 @@ struct ebur128_state_internal {
   /** Maximum true peak, one per channel */
   double* true_peak;
   double* prev_true_peak;
+  /** Set at the start of every add_frames call. The previous peaks still
+   *  hold those of the call before and are replaced, rather than raised, by
+   *  the peaks of the first frames processed. */
+  int reset_prev_peaks;
+  /** Channels the channel map, peaks and filter states are allocated for,
+   *  and doubles allocated for audio_data and sub_block_energy. They may
+   *  exceed those in use, so that ebur128_change_parameters() can switch
+   *  within them without allocating. */
+  unsigned int channel_capacity;
+  size_t audio_data_capacity;
+  size_t sub_block_capacity;
+  /** The interpolator, in interp_memory of interp_capacity bytes, which is
+   *  kept while the rate needs no interpolator. */
   interpolator* interp;
+  void* interp_memory;
+  size_t interp_capacity;
+  /** Buffers of the reference interpolator and their sizes in floats. */
   float* resampler_buffer_input;
-  size_t resampler_buffer_input_frames;
+  size_t resampler_buffer_input_size;
   float* resampler_buffer_output;
-  size_t resampler_buffer_output_frames;
+  size_t resampler_buffer_output_size;
   /** The maximum window duration in ms. */
   unsigned long window;
   unsigned long history;
+  /** Serial numbers of the next blocks at the last snapshot. */
+  size_t snapshot_blocks;
+  size_t snapshot_short_term_blocks;
+  /** Frames of audio_data written since the last snapshot, counted up to
+   *  audio_data_frames; an incremental snapshot writes only these. */
+  size_t snapshot_frames;
+  /** Measurement published after every block in EBUR128_MODE_PUBLISH,
+   *  guarded by a sequence lock: the sequence is odd while the audio thread
+   *  writes the values, and readers retry if it changed while they read. */
+  atomic_ulong publish_sequence;
+  _Atomic double published[EBUR128_PUBLISHED_VALUES];
+  /** Loudness range last computed by ebur128_publish(), recomputed only
+   *  when published_range_stale says the short-term blocks changed. */
+  double published_range;
+  int published_range_stale;
+  /** Allocates all memory of the state, including the state itself. */
+  ebur128_allocator allocator;
+  /** Allocation holding the state and the parts sized at init, see
+   *  struct ebur128_layout. Parts replaced later are allocated apart. */
+  void* block;
+  size_t block_size;
 };
 
-static double relative_gate = -10.0;
+/* Gate energies, computed at compile time so that states can be created
+ * concurrently. Each is the correctly rounded value of the expression in its
+ * comment. */
+/* pow(10.0, -10.0 / 10.0), the relative gate of -10 LU */
+static const double relative_gate_factor = 0.1;
+/* pow(10.0, -20.0 / 10.0), the LRA gate of -20 LU */
+static const double minus_twenty_decibels = 0.01;
+/* pow(10.0, (-70.0 + 0.691) / 10.0), the absolute gate of -70 LUFS */
+static const double absolute_gate_energy = 1.1724653045822981e-07;
+
+/* Coefficients of the 49-tap interpolators, shared by all states so that
+ * creating one needs no trigonometry. Tap j is the double computed for the
+ * sinc sin(m * M_PI / factor) / (m * M_PI / factor), with m = j - 24, times
+ * the Hann window 0.5 * (1 - cos(2 * M_PI * j / 48)), and is found in
+ * subfilter j % factor at delay j / factor. Taps of magnitude 1e-6 or less
+ * are zero. peak_gain is the largest sum of the magnitudes of a subfilter,
+ * times 1 + 1e-9, far more than the relative error of summing `delay`
+ * products. */
+static const interp_coefficients interp_factor_2 = {
+    2,
+    25,
+    2.3068314266031544,
+    {{12,
+      13,
+      {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+       0, 0}},
+     {0,
+      24,
+      {-0.00011839935662560734, 0.0011538046353613931,
+       -0.0034619828806398663, 0.0073255944119378254,
+       -0.013099864425549106, 0.021289392984170954, -0.03271433305212354,
+       0.048902422887149417, -0.073154952480662616, 0.11416841952708477,
+       -0.20412995834166403, 0.63389658716519248, 0.63389658716519248,
+       -0.20412995834166406, 0.11416841952708479, -0.07315495248066263,
+       0.048902422887149417, -0.03271433305212354, 0.021289392984170964,
+       -0.013099864425549121, 0.0073255944119378393,
+       -0.0034619828806398702, 0.0011538046353613916,
+       -0.00011839935662560734, 0}}}};
+
+static const interp_coefficients interp_factor_4 = {
+    4,
+    13,
+    1.8641815738346939,
+    {{6, 7, {0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0}},
+     {0,
+      12,
+      {-0.00016744197591618296, 0.004895983142504382, -0.018526005935860405,
+       0.046265053486303574, -0.10345672595291239, 0.28868335557343622,
+       0.89646515071103394, -0.16145852728990459, 0.069158469679911128,
+       -0.030107748292905214, 0.010359954969807055, -0.0016317261636570237,
+       0}},
+     {0,
+      12,
+      {-0.00098601330506667092, 0.010358978571612684, -0.033703603627858555,
+       0.080138909394514291, -0.18112965507435574, 0.62577362601184794,
+       0.62577362601184794, -0.18112965507435577, 0.080138909394514291,
+       -0.033703603627858576, 0.010358978571612691, -0.00098601330506667721,
+       0}},
+     {0,
+      12,
+      {-0.0016317261636570261, 0.010359954969807034, -0.0301077482929052,
+       0.069158469679911128, -0.16145852728990456, 0.89646515071103394,
+       0.28868335557343622, -0.1034567259529124, 0.046265053486303574,
+       -0.018526005935860422, 0.0048959831425043872,
+       -0.00016744197591618296, 0}}}};
+
+/* Offset of the delay lines from the start of an interpolator. */
+static size_t interp_lines_offset(unsigned int channels) {
+  size_t offset =
+      sizeof(interpolator) + channels * (sizeof(float*) + sizeof(double*));
+  return (offset + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+}
 
-/* Those will be calculated when initializing the library */
-static double relative_gate_factor;
-static double minus_twenty_decibels;
-static double histogram_energies[1000];
-static double histogram_energy_boundaries[1001];
+/* Bytes of an interpolator with its delay buffers and lines, which
+ * interp_init() lays out in one piece of memory. Channels and max_frames
+ * are limited by VALIDATE_MAX_CHANNELS and VALIDATE_MAX_SAMPLERATE. */
+static size_t interp_size(const interp_coefficients* coefficients,
+                          unsigned int channels, size_t max_frames) {
+  return interp_lines_offset(channels) +
+         channels * ((coefficients->delay - 1 + max_frames) * sizeof(double) +
+                     coefficients->delay * sizeof(float));
+}
 
-static interpolator* interp_create(unsigned int taps, unsigned int factor,
-                                   unsigned int channels) {
-  int errcode; /* unused */
-  interpolator* interp;
+/* Clears the delay buffers and the history of the delay lines. The rest of
+ * a line is staging for new samples and always written before it is read. */
+static void interp_clear(interpolator* interp) {
   unsigned int j;
 
-  interp = (interpolator*)calloc(1, sizeof(interpolator));
-  CHECK_ERROR(!interp, 0, exit);
-
-  interp->taps = taps;
-  interp->factor = factor;
-  interp->channels = channels;
-  interp->delay = (interp->taps + interp->factor - 1) / interp->factor;
-
-  /* Initialize the filter memory
-   * One subfilter per interpolation factor. */
-  interp->filter =
-      (interp_filter*)calloc(interp->factor, sizeof(*interp->filter));
-  CHECK_ERROR(!interp->filter, 0, free_interp);
-
-  for (j = 0; j < interp->factor; j++) {
-    interp->filter[j].index =
-        (unsigned int*)calloc(interp->delay, sizeof(unsigned int));
-    interp->filter[j].coeff = (double*)calloc(interp->delay, sizeof(double));
-    CHECK_ERROR(!interp->filter[j].index || !interp->filter[j].coeff, 0,
-                free_filter_index_coeff);
-  }
-
-  /* One delay buffer per channel. */
-  interp->z = (float**)calloc(interp->channels, sizeof(float*));
-  CHECK_ERROR(!interp->z, 0, free_filter_index_coeff);
-  for (j = 0; j < interp->channels; j++) {
-    interp->z[j] = (float*)calloc(interp->delay, sizeof(float));
-    CHECK_ERROR(!interp->z[j], 0, free_filter_z);
-  }
-
-  /* Calculate the filter coefficients */
-  for (j = 0; j < interp->taps; j++) {
-    /* Calculate sinc */
-    double m = (double)j - (double)(interp->taps - 1) / 2.0;
-    double c = 1.0;
-    if (fabs(m) > ALMOST_ZERO) {
-      c = sin(m * M_PI / interp->factor) / (m * M_PI / interp->factor);
-    }
-    /* Apply Hanning window */
-    c *= 0.5 * (1 - cos(2 * M_PI * j / (interp->taps - 1)));
-
-    if (fabs(c) > ALMOST_ZERO) { /* Ignore any zero coeffs. */
-      /* Put the coefficient into the correct subfilter */
-      unsigned int f = j % interp->factor;
-      unsigned int t = interp->filter[f].count++;
-      interp->filter[f].coeff[t] = c;
-      interp->filter[f].index[t] = j / interp->factor;
-    }
-  }
-  return interp;
-
-free_filter_z:
+  interp->zi = 0;
   for (j = 0; j < interp->channels; j++) {
-    free(interp->z[j]);
-  }
-  free(interp->z);
-free_filter_index_coeff:
-  for (j = 0; j < interp->factor; j++) {
-    free(interp->filter[j].index);
-    free(interp->filter[j].coeff);
+    memset(interp->line[j], 0, (interp->delay - 1) * sizeof(double));
+    memset(interp->z[j], 0, interp->delay * sizeof(float));
   }
-  free(interp->filter);
-free_interp:
-  free(interp);
-exit:
-  return NULL;
 }
 
-static void interp_destroy(interpolator* interp) {
-  unsigned int j = 0;
-  if (!interp) {
-    return;
-  }
-  for (j = 0; j < interp->factor; j++) {
-    free(interp->filter[j].index);
-    free(interp->filter[j].coeff);
+/* Creates a cleared interpolator in `memory` of interp_size() bytes. */
+static interpolator* interp_init(void* memory,
+                                 const interp_coefficients* coefficients,
+                                 unsigned int channels, size_t max_frames) {
+  interpolator* interp = (interpolator*)memory;
+  char* p = (char*)memory;
+  size_t offset, j;
+
+  interp->factor = coefficients->factor;
+  interp->channels = channels;
+  interp->delay = coefficients->delay;
+  interp->filter = coefficients->filter;
+  interp->max_frames = max_frames;
+  interp->peak_gain = coefficients->peak_gain;
+
+  /* One delay buffer and one linear delay line per channel. */
+  interp->z = (float**)(p + sizeof(interpolator));
+  interp->line =
+      (double**)(p + sizeof(interpolator) + channels * sizeof(float*));
+  offset = interp_lines_offset(channels);
+  for (j = 0; j < channels; j++) {
+    interp->line[j] = (double*)(p + offset);
+    offset += (interp->delay - 1 + max_frames) * sizeof(double);
   }
-  free(interp->filter);
-  for (j = 0; j < interp->channels; j++) {
-    free(interp->z[j]);
+  for (j = 0; j < channels; j++) {
+    interp->z[j] = (float*)(p + offset);
+    offset += interp->delay * sizeof(float);
   }
-  free(interp->z);
-  free(interp);
+  interp_clear(interp);
+  return interp;
 }
 
+#ifdef EBUR128_REFERENCE_TRUE_PEAK
+/* Reference interpolator. The default build computes the same peaks with
+ * interp_peak(), without writing out the oversampled signal. */
 static size_t interp_process(interpolator* interp, size_t frames, float* in,
                              float* out) {
   size_t frame = 0;
@@ -225,13 +443,17 @@ static size_t interp_process(interpolator* interp, size_t frames, float* in,
       /* Apply coefficients */
       outp = out + chan;
       for (f = 0; f < interp->factor; f++) {
+        const interp_filter* filter = &interp->filter[f];
         acc = 0.0;
-        for (t = 0; t < interp->filter[f].count; t++) {
-          int i = (int)interp->zi - (int)interp->filter[f].index[t];
+        for (t = filter->dense_begin; t < filter->dense_end; t++) {
+          int i = (int)interp->zi - (int)t;
+          if (filter->dense[t] == 0.0) {
+            continue;
+          }
           if (i < 0) {
             i += (int)interp->delay;
           }
-          c = interp->filter[f].coeff[t];
+          c = filter->dense[t];
           acc += (double)interp->z[chan][i] * c;
         }
         *outp = (float)acc;
@@ -247,25 +469,109 @@ static size_t interp_process(interpolator* interp, size_t frames, float* in,
 
   return frames * interp->factor;
 }
+#endif
 
-static int ebur128_init_filter(ebur128_state* st) {
-  int errcode = EBUR128_SUCCESS;
-  int i, j;
-
-  double f0 = 1681.974450955533;
-  double G = 3.999843853973347;
-  double Q = 0.7071752369554196;
-
-  double K = tan(M_PI * f0 / (double)st->samplerate);
-  double Vh = pow(10.0, G / 20.0);
-  double Vb = pow(Vh, 0.4996667741545416);
-
+/* Filter coefficients computed by ebur128_init_filter() for common sample
+ * rates, so that creating a state at these rates needs no trigonometry. */
+static const struct {
+  unsigned long samplerate;
+  double b[5];
+  double a[5];
+} ebur128_filter_table[] = {
+    {8000,
+     {1.3216235689299776, -3.3695026291756465, 3.0722607975775604,
+      -1.3225079833480926, 0.29812624601620069},
+     {1, -2.2343941252441391, 1.6982154234109481, -0.63905782837805125,
+      0.17601472922399444}},
+    {11025,
+     {1.3865361929457163, -4.0845863058282941, 4.4733723412540964,
+      -2.2391305368061745, 0.46380830843465626},
+     {1, -2.6851272693433237, 2.6493335838891108, -1.2195415259447935,
+      0.2555843064076368}},
+    {16000,
+     {1.4432952234913587, -4.7181658282431771, 5.7881047434242472,
+      -3.194892896084399, 0.68165875741196991},
+     {1, -3.0718232971114281, 3.5357633093004717, -1.8471417832251071,
+      0.38326659671410201}},
+    {22050,
+     {1.4798253509777464, -5.1303793148123216, 6.6821250614179561,
+      -3.8924135823099322, 0.86084248472655156},
+     {1, -3.316702938656253, 4.1344590468236557, -2.3150608859229984,
+      0.49732462953102896}},
+    {24000,
+     {1.4879002209622763, -5.2220059100656897, 6.8852202804909881,
+      -4.056023714634013, 0.90490912324643802},
+     {1, -3.3703787314217526, 4.2699461866724358, -2.4257850522811264,
+      0.52623206560598679}},
+    {32000,
+     {1.5111778995687646, -5.4872452124976707, 7.4825899998113421,
+      -4.5481559604047321, 1.0416332735222955},
+     {1, -3.5241347652393289, 4.6672546973259585, -2.7607685034780491,
+      0.61765346438513347}},
+    {44100,
+     {1.5308412300503478, -5.7126624552554253, 8.0018803002813943,
+      -4.9891381549979039, 1.1690790799215871},
+     {1, -3.6528247868858164, 5.0110867625282838, -3.0631592490055355,
+      0.70489871035628704}},
+    {48000,
+     {1.5351248595869702, -5.7619459085803211, 8.1169100492525814,
+      -5.0884818111120804, 1.1983928108528501},
+     {1, -3.68070674801639, 5.0870452479711306, -3.1315463514467305,
+      0.72520888847787046}},
+    {88200,
+     {1.5575153755796538, -6.0206578310856527, 8.7301035129045559,
+      -5.6282950348707699, 1.3613339774722124},
+     {1, -3.8254975034126764, 5.4906389775441902, -3.5047125027774113,
+      0.83957112596748262}},
+    {96000,
+     {1.5597142289757966, -6.0461700362026756, 8.7914585877937803,
+      -5.6832639828827194, 1.3782612023158187},
+     {1, -3.8396270146148241, 5.5308953375676886, -3.5428526934746705,
+      0.85158444033252145}},
+    {176400,
+     {1.5711153177418462, -6.1787751378883451, 9.1130759345409142,
+      -5.9742877263841772, 1.4688716119897622},
+     {1, -3.9126162392568657, 5.7415227058316676, -3.7451871983059579,
+      0.91628073807418065}},
+    {192000,
+     {1.5722272150912791, -6.1917374817441093, 9.1447646591939904,
+      -6.0032257335207699, 1.4779713409796094},
+     {1, -3.9197094534481884, 5.7622393528712994, -3.765342956679401,
+      0.92281306179140099}}};
+
+/* Sets the filter coefficients for the sample rate and clears the filter
+ * state v, which must be allocated for the channels of st. */
+static void ebur128_init_filter(ebur128_state* st) {
+  double f0, G, Q, K, Vh, Vb, a0;
   double pb[3] = {0.0, 0.0, 0.0};
   double pa[3] = {1.0, 0.0, 0.0};
   double rb[3] = {1.0, -2.0, 1.0};
   double ra[3] = {1.0, 0.0, 0.0};
+  size_t i, j;
+
+  for (i = 0; i < st->channels; ++i) {
+    for (j = 0; j < FILTER_STATE_SIZE; ++j) {
+      st->d->v[i][j] = 0.0;
+    }
+  }
+  for (i = 0; i < sizeof(ebur128_filter_table) / sizeof(*ebur128_filter_table);
+       ++i) {
+    if (ebur128_filter_table[i].samplerate == st->samplerate) {
+      memcpy(st->d->b, ebur128_filter_table[i].b, sizeof(st->d->b));
+      memcpy(st->d->a, ebur128_filter_table[i].a, sizeof(st->d->a));
+      return;
+    }
+  }
+
+  f0 = 1681.974450955533;
+  G = 3.999843853973347;
+  Q = 0.7071752369554196;
+
+  K = tan(M_PI * f0 / (double)st->samplerate);
+  Vh = pow(10.0, G / 20.0);
+  Vb = pow(Vh, 0.4996667741545416);
 
-  double a0 = 1.0 + K / Q + K * K;
+  a0 = 1.0 + K / Q + K * K;
   pb[0] = (Vh + Vb * K / Q + K * K) / a0;
   pb[1] = 2.0 * (K * K - Vh) / a0;
   pb[2] = (Vh - Vb * K / Q + K * K) / a0;
@@ -295,25 +601,12 @@ static int ebur128_init_filter(ebur128_state* st) {
   st->d->a[2] = pa[0] * ra[2] + pa[1] * ra[1] + pa[2] * ra[0];
   st->d->a[3] = pa[1] * ra[2] + pa[2] * ra[1];
   st->d->a[4] = pa[2] * ra[2];
-
-  st->d->v = (filter_state*)malloc(st->channels * sizeof(filter_state));
-  CHECK_ERROR(!st->d->v, EBUR128_ERROR_NOMEM, exit);
-  for (i = 0; i < (int)st->channels; ++i) {
-    for (j = 0; j < FILTER_STATE_SIZE; ++j) {
-      st->d->v[i][j] = 0.0;
-    }
-  }
-
-exit:
-  return errcode;
 }
 
-static int ebur128_init_channel_map(ebur128_state* st) {
+/* Sets the default channel map, which must be allocated for the channels
+ * of st. */
+static void ebur128_init_channel_map(ebur128_state* st) {
   size_t i;
-  st->d->channel_map = (int*)malloc(st->channels * sizeof(int));
-  if (!st->d->channel_map) {
-    return EBUR128_ERROR_NOMEM;
-  }
   if (st->channels == 4) {
     st->d->channel_map[0] = EBUR128_LEFT;
     st->d->channel_map[1] = EBUR128_RIGHT;
@@ -352,57 +645,258 @@ static int ebur128_init_channel_map(ebur128_state* st) {
       }
     }
   }
-  return EBUR128_SUCCESS;
 }
 
-static int ebur128_init_resampler(ebur128_state* st) {
-  int errcode = EBUR128_SUCCESS;
+/* Weight of a channel in the channel sum, see ITU BS.1770. */
+static double ebur128_channel_weight(int channel) {
+  switch (channel) {
+    case EBUR128_UNUSED:
+      return 0.0;
+    case EBUR128_Mp110:
+    case EBUR128_Mm110:
+    case EBUR128_Mp060:
+    case EBUR128_Mm060:
+    case EBUR128_Mp090:
+    case EBUR128_Mm090:
+      return 1.41;
+    case EBUR128_DUAL_MONO:
+      return 2.0;
+    default:
+      return 1.0;
+  }
+}
 
-  if (st->samplerate < 96000) {
-    st->d->interp = interp_create(49, 4, st->channels);
-    CHECK_ERROR(!st->d->interp, EBUR128_ERROR_NOMEM, exit)
-  } else if (st->samplerate < 192000) {
-    st->d->interp = interp_create(49, 2, st->channels);
-    CHECK_ERROR(!st->d->interp, EBUR128_ERROR_NOMEM, exit)
-  } else {
-    st->d->resampler_buffer_input = NULL;
-    st->d->resampler_buffer_output = NULL;
-    st->d->interp = NULL;
-    goto exit;
+/* Frees a part of a state unless it lies in the block allocated by init. */
+static void ebur128_free_part(struct ebur128_state_internal* d, void* ptr) {
+  uintptr_t p = (uintptr_t)ptr;
+  uintptr_t block = (uintptr_t)d->block;
+
+  if (p < block || p >= block + d->block_size) {
+    ebur128_free(&d->allocator, ptr);
+  }
+}
+
+/* Returns the interpolator coefficients for true peaks in a mode and at a
+ * rate, or NULL if true peaks are not measured or need no oversampling. */
+static const interp_coefficients* ebur128_interp_coefficients(
+    int mode, unsigned long samplerate) {
+  if ((mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK ||
+      samplerate >= 192000) {
+    return NULL;
   }
+  return samplerate < 96000 ? &interp_factor_4 : &interp_factor_2;
+}
 
-  st->d->resampler_buffer_input_frames = st->d->samples_in_100ms * 4;
-  st->d->resampler_buffer_input = (float*)malloc(
-      st->d->resampler_buffer_input_frames * st->channels * sizeof(float));
-  CHECK_ERROR(!st->d->resampler_buffer_input, EBUR128_ERROR_NOMEM, free_interp)
+/* Grows the interpolator memory of st to interp_size() bytes for
+ * `coefficients`, `channels` and `samples_in_100ms`, keeping the current
+ * interpolator, and in the reference build the resampler buffers. */
+static int ebur128_grow_resampler(ebur128_state* st,
+                                  const interp_coefficients* coefficients,
+                                  unsigned int channels,
+                                  unsigned long samples_in_100ms) {
+  struct ebur128_state_internal* d = st->d;
+  size_t bytes = interp_size(coefficients, channels, samples_in_100ms);
+  unsigned int c;
+
+  if (bytes > d->interp_capacity) {
+    void* memory = ebur128_malloc(&d->allocator, bytes);
+    if (!memory) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    /* The current interpolator fits in interp_capacity bytes. */
+    if (d->interp) {
+      interpolator* interp = interp_init(
+          memory, ebur128_interp_coefficients(st->mode, st->samplerate),
+          st->channels, d->samples_in_100ms);
+      interp->zi = d->interp->zi;
+      for (c = 0; c < st->channels; ++c) {
+        memcpy(interp->z[c], d->interp->z[c],
+               interp->delay * sizeof(float));
+        memcpy(interp->line[c], d->interp->line[c],
+               (interp->delay - 1) * sizeof(double));
+      }
+      d->interp = interp;
+    }
+    ebur128_free_part(d, d->interp_memory);
+    d->interp_memory = memory;
+    d->interp_capacity = bytes;
+  }
 
-  st->d->resampler_buffer_output_frames =
-      st->d->resampler_buffer_input_frames * st->d->interp->factor;
-  st->d->resampler_buffer_output = (float*)malloc(
-      st->d->resampler_buffer_output_frames * st->channels * sizeof(float));
-  CHECK_ERROR(!st->d->resampler_buffer_output, EBUR128_ERROR_NOMEM, free_input)
+#ifdef EBUR128_REFERENCE_TRUE_PEAK
+  /* frames are filtered in chunks that never cross a 100ms boundary */
+  if (samples_in_100ms * channels > d->resampler_buffer_input_size) {
+    float* input = (float*)ebur128_malloc(
+        &d->allocator, samples_in_100ms * channels * sizeof(float));
+    if (!input) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    ebur128_free(&d->allocator, d->resampler_buffer_input);
+    d->resampler_buffer_input = input;
+    d->resampler_buffer_input_size = samples_in_100ms * channels;
+  }
+  if (samples_in_100ms * channels * coefficients->factor >
+      d->resampler_buffer_output_size) {
+    float* output = (float*)ebur128_malloc(
+        &d->allocator,
+        samples_in_100ms * channels * coefficients->factor * sizeof(float));
+    if (!output) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    ebur128_free(&d->allocator, d->resampler_buffer_output);
+    d->resampler_buffer_output = output;
+    d->resampler_buffer_output_size =
+        samples_in_100ms * channels * coefficients->factor;
+  }
+#endif
+  return EBUR128_SUCCESS;
+}
 
-  return errcode;
+/* Creates the interpolator in `memory` of `size` bytes, at least
+ * interp_size(), and in the reference build the resampler buffers. */
+static int ebur128_init_resampler(ebur128_state* st, void* memory,
+                                  size_t size) {
+  const interp_coefficients* coefficients =
+      ebur128_interp_coefficients(st->mode, st->samplerate);
 
-free_interp:
-  interp_destroy(st->d->interp);
+  st->d->interp_memory = memory;
+  st->d->interp_capacity = size;
   st->d->interp = NULL;
-free_input:
-  free(st->d->resampler_buffer_input);
   st->d->resampler_buffer_input = NULL;
-exit:
-  return errcode;
+  st->d->resampler_buffer_input_size = 0;
+  st->d->resampler_buffer_output = NULL;
+  st->d->resampler_buffer_output_size = 0;
+  if (!coefficients) {
+    return EBUR128_SUCCESS;
+  }
+  st->d->interp = interp_init(memory, coefficients, st->channels,
+                              st->d->samples_in_100ms);
+  return ebur128_grow_resampler(st, coefficients, st->channels,
+                                st->d->samples_in_100ms);
 }
 
 static void ebur128_destroy_resampler(ebur128_state* st) {
-  free(st->d->resampler_buffer_input);
+  ebur128_free(&st->d->allocator, st->d->resampler_buffer_input);
   st->d->resampler_buffer_input = NULL;
-  free(st->d->resampler_buffer_output);
+  ebur128_free(&st->d->allocator, st->d->resampler_buffer_output);
   st->d->resampler_buffer_output = NULL;
-  interp_destroy(st->d->interp);
+  ebur128_free_part(st->d, st->d->interp_memory);
+  st->d->interp_memory = NULL;
   st->d->interp = NULL;
 }
 
+/* Grows the channel map, peaks and filter states of st to `channels`
+ * channels, keeping those of its current channels. */
+static int ebur128_grow_channels(ebur128_state* st, unsigned int channels) {
+  struct ebur128_state_internal* d = st->d;
+  int* channel_map;
+  double* peaks;
+  filter_state* v;
+
+  if (channels <= d->channel_capacity) {
+    return EBUR128_SUCCESS;
+  }
+  channel_map = (int*)ebur128_malloc(&d->allocator, channels * sizeof(int));
+  peaks = (double*)ebur128_malloc(&d->allocator,
+                                  4 * channels * sizeof(double));
+  v = (filter_state*)ebur128_malloc(&d->allocator,
+                                    channels * sizeof(filter_state));
+  if (!channel_map || !peaks || !v) {
+    ebur128_free(&d->allocator, channel_map);
+    ebur128_free(&d->allocator, peaks);
+    ebur128_free(&d->allocator, v);
+    return EBUR128_ERROR_NOMEM;
+  }
+  memcpy(channel_map, d->channel_map, st->channels * sizeof(int));
+  memcpy(peaks, d->sample_peak, 4 * st->channels * sizeof(double));
+  memcpy(v, d->v, st->channels * sizeof(filter_state));
+  ebur128_free_part(d, d->channel_map);
+  ebur128_free_part(d, d->sample_peak);
+  ebur128_free_part(d, d->v);
+  d->channel_map = channel_map;
+  d->sample_peak = peaks;
+  d->prev_sample_peak = peaks + st->channels;
+  d->true_peak = peaks + 2 * st->channels;
+  d->prev_true_peak = peaks + 3 * st->channels;
+  d->v = v;
+  d->channel_capacity = channels;
+  return EBUR128_SUCCESS;
+}
+
+/* Grows audio_data to `audio_data_size` doubles and sub_block_energy to
+ * `sub_blocks` sub-blocks, keeping their contents. */
+static int ebur128_grow_window(ebur128_state* st, size_t audio_data_size,
+                               size_t sub_blocks) {
+  struct ebur128_state_internal* d = st->d;
+
+  if (audio_data_size > d->audio_data_capacity) {
+    double* audio_data;
+    size_t bytes;
+
+    if (safe_size_mul(audio_data_size, sizeof(double), &bytes)) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    audio_data = (double*)ebur128_malloc(&d->allocator, bytes);
+    if (!audio_data) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    memcpy(audio_data, d->audio_data,
+           d->audio_data_fill * st->channels * sizeof(double));
+    if (d->audio_data_zeroed < d->audio_data_frames) {
+      memcpy(audio_data + d->audio_data_zeroed * st->channels,
+             d->audio_data + d->audio_data_zeroed * st->channels,
+             (d->audio_data_frames - d->audio_data_zeroed) * st->channels *
+                 sizeof(double));
+    }
+    ebur128_free_part(d, d->audio_data);
+    d->audio_data = audio_data;
+    d->audio_data_capacity = audio_data_size;
+  }
+  if (sub_blocks > d->sub_block_capacity) {
+    double* sub_block_energy =
+        (double*)ebur128_calloc(&d->allocator, sub_blocks, sizeof(double));
+    if (!sub_block_energy) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    memcpy(sub_block_energy, d->sub_block_energy,
+           d->sub_block_count * sizeof(double));
+    ebur128_free_part(d, d->sub_block_energy);
+    d->sub_block_energy = sub_block_energy;
+    d->sub_block_capacity = sub_blocks;
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Allocates ring buffers for a window of `frames` frames: zeroed sub-block
+ * energies, and audio_data left uninitialized, or NULL in
+ * EBUR128_MODE_LOW_MEMORY. */
+static int ebur128_alloc_ring_buffers(ebur128_state* st, size_t frames,
+                                      double** audio_data,
+                                      double** sub_block_energy,
+                                      size_t* sub_block_count) {
+  size_t audio_data_size;
+
+  *audio_data = NULL;
+  if (!(st->mode & EBUR128_MODE_LOW_MEMORY)) {
+    if (safe_size_mul(frames, st->channels * sizeof(double),
+                      &audio_data_size) != 0) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    *audio_data = (double*)ebur128_malloc(&st->d->allocator, audio_data_size);
+    if (!*audio_data) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  *sub_block_count = frames / st->d->samples_in_100ms + 1;
+  *sub_block_energy = (double*)ebur128_calloc(
+      &st->d->allocator, *sub_block_count, sizeof(double));
+  if (!*sub_block_energy) {
+    ebur128_free(&st->d->allocator, *audio_data);
+    *audio_data = NULL;
+    return EBUR128_ERROR_NOMEM;
+  }
+  return EBUR128_SUCCESS;
+}
+
 void ebur128_get_version(int* major, int* minor, int* patch) {
   *major = EBUR128_VERSION_MAJOR;
   *minor = EBUR128_VERSION_MINOR;
@@ -423,205 +917,1036 @@ void ebur128_get_version(int* major, int* minor, int* patch) {
     }                                                              \
   } while (0);
 
-ebur128_state* ebur128_init(unsigned int channels, unsigned long samplerate,
-                            int mode) {
-  int result;
-  int errcode;
-  ebur128_state* st;
-  unsigned int i;
-  size_t j;
+static void ebur128_ring_init(struct ebur128_block_ring* ring,
+                              unsigned long max,
+                              const ebur128_allocator* allocator) {
+  ring->z = NULL;
+  ring->nodes = NULL;
+  ring->root = EBUR128_NO_BLOCK;
+  ring->capacity = 0;
+  ring->head = 0;
+  ring->size = 0;
+  ring->max = max;
+  ring->first = 0;
+  ring->allocator = allocator;
+}
 
-  VALIDATE_CHANNELS_AND_SAMPLERATE(NULL);
+static void ebur128_ring_destroy(struct ebur128_block_ring* ring) {
+  ebur128_free(ring->allocator, ring->z);
+  ebur128_free(ring->allocator, ring->nodes);
+}
 
-  st = (ebur128_state*)malloc(sizeof(ebur128_state));
-  CHECK_ERROR(!st, 0, exit)
-  st->d = (struct ebur128_state_internal*)malloc(
-      sizeof(struct ebur128_state_internal));
-  CHECK_ERROR(!st->d, 0, free_state)
-  st->channels = channels;
-  errcode = ebur128_init_channel_map(st);
-  CHECK_ERROR(errcode, 0, free_internal)
-
-  st->d->sample_peak = (double*)malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->sample_peak, 0, free_channel_map)
-  st->d->prev_sample_peak = (double*)malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->prev_sample_peak, 0, free_sample_peak)
-  st->d->true_peak = (double*)malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->true_peak, 0, free_prev_sample_peak)
-  st->d->prev_true_peak = (double*)malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->prev_true_peak, 0, free_true_peak)
-  for (i = 0; i < channels; ++i) {
-    st->d->sample_peak[i] = 0.0;
-    st->d->prev_sample_peak[i] = 0.0;
-    st->d->true_peak[i] = 0.0;
-    st->d->prev_true_peak[i] = 0.0;
-  }
+/* Returns the bin of a positive energy. Bins are monotonic in the energy. */
+static size_t ebur128_energy_bin(double z) {
+  int exponent;
+  /* z = mantissa * 2^exponent, 0.5 <= mantissa < 1 */
+  double mantissa = frexp(z, &exponent);
+  size_t bin;
 
-  st->d->use_histogram = mode & EBUR128_MODE_HISTOGRAM ? 1 : 0;
-  st->d->history = ULONG_MAX;
-  st->samplerate = samplerate;
-  st->d->samples_in_100ms = (st->samplerate + 5) / 10;
-  st->mode = mode;
-  if ((mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
-    st->d->window = 3000;
-  } else if ((mode & EBUR128_MODE_M) == EBUR128_MODE_M) {
-    st->d->window = 400;
-  } else {
-    goto free_prev_true_peak;
+  if (!(z > 0.0) || exponent < EBUR128_BIN_MIN_EXPONENT) {
+    return 0;
   }
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
-    /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames =
-        (st->d->audio_data_frames + st->d->samples_in_100ms) -
-        (st->d->audio_data_frames % st->d->samples_in_100ms);
+  bin = (size_t)(exponent - EBUR128_BIN_MIN_EXPONENT) *
+            EBUR128_BINS_PER_OCTAVE +
+        (size_t)((mantissa - 0.5) * (2 * EBUR128_BINS_PER_OCTAVE));
+  return bin < EBUR128_BIN_COUNT ? bin : EBUR128_BIN_COUNT - 1;
+}
+
+/* Returns the index in z of the block with serial number `serial`. */
+static size_t ebur128_ring_slot(const struct ebur128_block_ring* ring,
+                                size_t serial) {
+  size_t slot = ring->head + (serial - ring->first);
+  return slot >= ring->capacity ? slot - ring->capacity : slot;
+}
+
+static struct ebur128_block_node* ebur128_tree_node(
+    const struct ebur128_block_ring* ring, size_t serial) {
+  return &ring->nodes[ebur128_ring_slot(ring, serial)];
+}
+
+/* Returns the priority of a block in the treap. It is a fixed bijective
+ * hash of the serial number, so the shape of the tree, and with it every
+ * sum, depends only on the stored blocks and not on the order in which
+ * they were added and removed. */
+static uint64_t ebur128_tree_priority(size_t serial) {
+  uint64_t x = (uint64_t)serial + UINT64_C(0x9E3779B97F4A7C15);
+  x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return x ^ (x >> 31);
+}
+
+/* Returns whether block a precedes block b, by energy, then serial number. */
+static int ebur128_tree_less(const struct ebur128_block_ring* ring, size_t a,
+                             size_t b) {
+  double za = ring->z[ebur128_ring_slot(ring, a)];
+  double zb = ring->z[ebur128_ring_slot(ring, b)];
+  return za < zb || (za == zb && a < b);
+}
+
+/* Recomputes the count and sum of a node from its children. */
+static void ebur128_tree_update(struct ebur128_block_ring* ring,
+                                size_t serial) {
+  size_t slot = ebur128_ring_slot(ring, serial);
+  struct ebur128_block_node* node = &ring->nodes[slot];
+  size_t count = 1;
+  double sum = 0.0;
+
+  if (node->left != EBUR128_NO_BLOCK) {
+    const struct ebur128_block_node* left = ebur128_tree_node(ring, node->left);
+    count += left->count;
+    sum = left->sum;
   }
-  st->d->audio_data =
-      (double*)malloc(st->d->audio_data_frames * st->channels * sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, 0, free_prev_true_peak)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
+  sum += ring->z[slot];
+  if (node->right != EBUR128_NO_BLOCK) {
+    const struct ebur128_block_node* right =
+        ebur128_tree_node(ring, node->right);
+    count += right->count;
+    sum += right->sum;
   }
+  node->count = count;
+  node->sum = sum;
+}
 
-  errcode = ebur128_init_filter(st);
-  CHECK_ERROR(errcode, 0, free_audio_data)
+/* Splits the subtree t into the blocks preceding block `serial`, stored in
+ * *left, and those following it, stored in *right. */
+static void ebur128_tree_split(struct ebur128_block_ring* ring, size_t t,
+                               size_t serial, size_t* left, size_t* right) {
+  struct ebur128_block_node* node;
 
-  if (st->d->use_histogram) {
-    st->d->block_energy_histogram =
-        (unsigned long*)malloc(1000 * sizeof(unsigned long));
-    CHECK_ERROR(!st->d->block_energy_histogram, 0, free_filter)
-    for (i = 0; i < 1000; ++i) {
-      st->d->block_energy_histogram[i] = 0;
-    }
-  } else {
-    st->d->block_energy_histogram = NULL;
+  if (t == EBUR128_NO_BLOCK) {
+    *left = EBUR128_NO_BLOCK;
+    *right = EBUR128_NO_BLOCK;
+    return;
   }
-  if (st->d->use_histogram) {
-    st->d->short_term_block_energy_histogram =
-        (unsigned long*)malloc(1000 * sizeof(unsigned long));
-    CHECK_ERROR(!st->d->short_term_block_energy_histogram, 0,
-                free_block_energy_histogram)
-    for (i = 0; i < 1000; ++i) {
-      st->d->short_term_block_energy_histogram[i] = 0;
-    }
+  node = ebur128_tree_node(ring, t);
+  if (ebur128_tree_less(ring, t, serial)) {
+    ebur128_tree_split(ring, node->right, serial, &node->right, right);
+    *left = t;
   } else {
-    st->d->short_term_block_energy_histogram = NULL;
-  }
-  STAILQ_INIT(&st->d->block_list);
-  st->d->block_list_size = 0;
-  st->d->block_list_max = st->d->history / 100;
-  STAILQ_INIT(&st->d->short_term_block_list);
-  st->d->st_block_list_size = 0;
-  st->d->st_block_list_max = st->d->history / 3000;
-  st->d->short_term_frame_counter = 0;
+    ebur128_tree_split(ring, node->left, serial, left, &node->left);
+    *right = t;
+  }
+  ebur128_tree_update(ring, t);
+}
 
-  result = ebur128_init_resampler(st);
-  CHECK_ERROR(result, 0, free_short_term_block_energy_histogram)
+/* Joins the subtrees a and b, all blocks of a preceding those of b, and
+ * returns the root. */
+static size_t ebur128_tree_merge(struct ebur128_block_ring* ring, size_t a,
+                                 size_t b) {
+  struct ebur128_block_node* node;
 
-  /* the first block needs 400ms of audio data */
-  st->d->needed_frames = st->d->samples_in_100ms * 4;
-  /* start at the beginning of the buffer */
-  st->d->audio_data_index = 0;
+  if (a == EBUR128_NO_BLOCK) {
+    return b;
+  }
+  if (b == EBUR128_NO_BLOCK) {
+    return a;
+  }
+  if (ebur128_tree_priority(a) > ebur128_tree_priority(b)) {
+    node = ebur128_tree_node(ring, a);
+    node->right = ebur128_tree_merge(ring, node->right, b);
+    ebur128_tree_update(ring, a);
+    return a;
+  }
+  node = ebur128_tree_node(ring, b);
+  node->left = ebur128_tree_merge(ring, a, node->left);
+  ebur128_tree_update(ring, b);
+  return b;
+}
 
-  /* initialize static constants */
-  relative_gate_factor = pow(10.0, relative_gate / 10.0);
-  minus_twenty_decibels = pow(10.0, -20.0 / 10.0);
-  histogram_energy_boundaries[0] = pow(10.0, (-70.0 + 0.691) / 10.0);
-  if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
-      histogram_energies[i] =
-          pow(10.0, ((double)i / 10.0 - 69.95 + 0.691) / 10.0);
-    }
-    for (i = 1; i < 1001; ++i) {
-      histogram_energy_boundaries[i] =
-          pow(10.0, ((double)i / 10.0 - 70.0 + 0.691) / 10.0);
-    }
+/* Inserts block `serial` into the subtree t and returns the new root. */
+static size_t ebur128_tree_insert(struct ebur128_block_ring* ring, size_t t,
+                                  size_t serial) {
+  struct ebur128_block_node* node;
+
+  if (t == EBUR128_NO_BLOCK ||
+      ebur128_tree_priority(serial) > ebur128_tree_priority(t)) {
+    node = ebur128_tree_node(ring, serial);
+    ebur128_tree_split(ring, t, serial, &node->left, &node->right);
+    ebur128_tree_update(ring, serial);
+    return serial;
   }
+  node = ebur128_tree_node(ring, t);
+  if (ebur128_tree_less(ring, serial, t)) {
+    node->left = ebur128_tree_insert(ring, node->left, serial);
+  } else {
+    node->right = ebur128_tree_insert(ring, node->right, serial);
+  }
+  ebur128_tree_update(ring, t);
+  return t;
+}
 
-  return st;
+/* Removes block `serial` from the subtree t, which holds it, and returns the
+ * new root. */
+static size_t ebur128_tree_erase(struct ebur128_block_ring* ring, size_t t,
+                                 size_t serial) {
+  struct ebur128_block_node* node = ebur128_tree_node(ring, t);
 
-free_short_term_block_energy_histogram:
-  free(st->d->short_term_block_energy_histogram);
-free_block_energy_histogram:
-  free(st->d->block_energy_histogram);
-free_filter:
-  free(st->d->v);
-free_audio_data:
-  free(st->d->audio_data);
-free_prev_true_peak:
-  free(st->d->prev_true_peak);
-free_true_peak:
-  free(st->d->true_peak);
-free_prev_sample_peak:
-  free(st->d->prev_sample_peak);
-free_sample_peak:
-  free(st->d->sample_peak);
-free_channel_map:
-  free(st->d->channel_map);
-free_internal:
-  free(st->d);
-free_state:
-  free(st);
-exit:
-  return NULL;
+  if (t == serial) {
+    return ebur128_tree_merge(ring, node->left, node->right);
+  }
+  if (ebur128_tree_less(ring, serial, t)) {
+    node->left = ebur128_tree_erase(ring, node->left, serial);
+  } else {
+    node->right = ebur128_tree_erase(ring, node->right, serial);
+  }
+  ebur128_tree_update(ring, t);
+  return t;
 }
 
-void ebur128_destroy(ebur128_state** st) {
-  struct ebur128_dq_entry* entry;
-  free((*st)->d->short_term_block_energy_histogram);
-  free((*st)->d->block_energy_histogram);
-  free((*st)->d->v);
-  free((*st)->d->audio_data);
-  free((*st)->d->channel_map);
-  free((*st)->d->sample_peak);
-  free((*st)->d->prev_sample_peak);
-  free((*st)->d->true_peak);
-  free((*st)->d->prev_true_peak);
-  while (!STAILQ_EMPTY(&(*st)->d->block_list)) {
-    entry = STAILQ_FIRST(&(*st)->d->block_list);
-    STAILQ_REMOVE_HEAD(&(*st)->d->block_list, entries);
-    free(entry);
-  }
-  while (!STAILQ_EMPTY(&(*st)->d->short_term_block_list)) {
-    entry = STAILQ_FIRST(&(*st)->d->short_term_block_list);
-    STAILQ_REMOVE_HEAD(&(*st)->d->short_term_block_list, entries);
-    free(entry);
+/* Removes the oldest energy. */
+static void ebur128_ring_pop(struct ebur128_block_ring* ring) {
+  ring->root = ebur128_tree_erase(ring, ring->root, ring->first);
+  if (++ring->head == ring->capacity) {
+    ring->head = 0;
   }
-  ebur128_destroy_resampler(*st);
-  free((*st)->d);
-  free(*st);
-  *st = NULL;
+  --ring->size;
+  ++ring->first;
 }
 
-static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
-  size_t c, i, frames_out;
+/* Capacity of a full ring after growing it. */
+static size_t ebur128_grown_capacity(size_t capacity) {
+  return capacity ? capacity * 2 : EBUR128_RING_MIN_CAPACITY;
+}
 
-  frames_out =
-      interp_process(st->d->interp, frames, st->d->resampler_buffer_input,
-                     st->d->resampler_buffer_output);
+/* Grows a ring to `capacity` entries, at most `max`. A ring may wrap at
+ * head: after growing, the entries before head are moved behind the old end
+ * if they fit, otherwise the entries from head on are moved to the new end. */
+static int ebur128_ring_reserve(struct ebur128_block_ring* ring,
+                                size_t capacity) {
+  size_t bytes;
+  double* z;
+  struct ebur128_block_node* nodes;
+
+  if (capacity > ring->max) {
+    capacity = ring->max;
+  }
+  if (capacity <= ring->capacity) {
+    return EBUR128_SUCCESS;
+  }
+  if (safe_size_mul(capacity, sizeof(double), &bytes)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  z = (double*)ebur128_realloc(ring->allocator, ring->z, bytes);
+  if (!z) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ring->z = z;
+  nodes = (struct ebur128_block_node*)ebur128_realloc(
+      ring->allocator, ring->nodes,
+      capacity * sizeof(struct ebur128_block_node));
+  if (!nodes) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ring->nodes = nodes;
+  if (ring->head <= capacity - ring->capacity) {
+    memcpy(ring->z + ring->capacity, ring->z, ring->head * sizeof(double));
+    memcpy(ring->nodes + ring->capacity, ring->nodes,
+           ring->head * sizeof(struct ebur128_block_node));
+  } else {
+    size_t moved = ring->capacity - ring->head;
+    memmove(ring->z + capacity - moved, ring->z + ring->head,
+            moved * sizeof(double));
+    memmove(ring->nodes + capacity - moved, ring->nodes + ring->head,
+            moved * sizeof(struct ebur128_block_node));
+    ring->head = capacity - moved;
+  }
+  ring->capacity = capacity;
+  return EBUR128_SUCCESS;
+}
 
-  for (i = 0; i < frames_out; ++i) {
-    for (c = 0; c < st->channels; ++c) {
-      double val = (double)st->d->resampler_buffer_output[i * st->channels + c];
+/* Removes all energies, keeping the memory and `max`. */
+static void ebur128_ring_clear(struct ebur128_block_ring* ring) {
+  ring->head = 0;
+  ring->size = 0;
+  ring->first = 0;
+  ring->root = EBUR128_NO_BLOCK;
+}
 
-      if (EBUR128_MAX(val, -val) > st->d->prev_true_peak[c]) {
-        st->d->prev_true_peak[c] = EBUR128_MAX(val, -val);
-      }
-    }
+/* Appends z, overwriting the oldest energy once `max` are stored. */
+static int ebur128_ring_push(struct ebur128_block_ring* ring, double z) {
+  size_t tail, serial;
+
+  if (ring->max == 0) {
+    return EBUR128_SUCCESS;
+  }
+  if (ring->size == ring->max) {
+    ebur128_ring_pop(ring);
+  } else if (ring->size == ring->capacity &&
+             ebur128_ring_reserve(ring,
+                                  ebur128_grown_capacity(ring->capacity))) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  serial = ring->first + ring->size;
+  tail = ring->head + ring->size;
+  if (tail >= ring->capacity) {
+    tail -= ring->capacity;
   }
+  ring->z[tail] = z;
+  ring->root = ebur128_tree_insert(ring, ring->root, serial);
+  ++ring->size;
+  return EBUR128_SUCCESS;
 }
 
-#if defined(__SSE2_MATH__) || defined(_M_X64) || _M_IX86_FP >= 2
-#include <xmmintrin.h>
-#define TURN_ON_FTZ                  \
-  unsigned int mxcsr = _mm_getcsr(); \
-  _mm_setcsr(mxcsr | _MM_FLUSH_ZERO_ON);
-#define TURN_OFF_FTZ _mm_setcsr(mxcsr);
-#define FLUSH_MANUALLY
-#else
-#warning "manual FTZ is being used, please enable SSE2 (-msse2 -mfpmath=sse)"
-#define TURN_ON_FTZ
-#define TURN_OFF_FTZ
+/* Drops the oldest energies beyond `max`. */
+static void ebur128_ring_set_max(struct ebur128_block_ring* ring,
+                                 unsigned long max) {
+  ring->max = max;
+  while (ring->size > max) {
+    ebur128_ring_pop(ring);
+  }
+}
+
+static void ebur128_bin_ring_init(struct ebur128_bin_ring* ring,
+                                  const ebur128_allocator* allocator) {
+  ring->bin = NULL;
+  ring->capacity = 0;
+  ring->head = 0;
+  ring->size = 0;
+  ring->max = 0;
+  ring->allocator = allocator;
+}
+
+/* Takes the oldest block out of its histogram bin. */
+static void ebur128_bin_ring_pop(struct ebur128_bin_ring* ring,
+                                 double* histogram) {
+  --histogram[ring->bin[ring->head]];
+  if (++ring->head == ring->capacity) {
+    ring->head = 0;
+  }
+  --ring->size;
+}
+
+/* Grows a ring like ebur128_ring_reserve(). */
+static int ebur128_bin_ring_reserve(struct ebur128_bin_ring* ring,
+                                    size_t capacity) {
+  size_t bytes;
+  unsigned int* bin;
+
+  if (capacity > ring->max) {
+    capacity = ring->max;
+  }
+  if (capacity <= ring->capacity) {
+    return EBUR128_SUCCESS;
+  }
+  if (safe_size_mul(capacity, sizeof(unsigned int), &bytes)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  bin = (unsigned int*)ebur128_realloc(ring->allocator, ring->bin, bytes);
+  if (!bin) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ring->bin = bin;
+  if (ring->head <= capacity - ring->capacity) {
+    memcpy(ring->bin + ring->capacity, ring->bin,
+           ring->head * sizeof(unsigned int));
+  } else {
+    size_t moved = ring->capacity - ring->head;
+    memmove(ring->bin + capacity - moved, ring->bin + ring->head,
+            moved * sizeof(unsigned int));
+    ring->head = capacity - moved;
+  }
+  ring->capacity = capacity;
+  return EBUR128_SUCCESS;
+}
+
+/* Counts a block in bin b of a histogram. Once `max` blocks are counted,
+ * the oldest one is taken out again. */
+static int ebur128_bin_ring_push(struct ebur128_bin_ring* ring,
+                                 double* histogram, size_t b) {
+  size_t tail;
+
+  if (ring->max != 0) {
+    if (ring->size == ring->max) {
+      ebur128_bin_ring_pop(ring, histogram);
+    } else if (ring->size == ring->capacity &&
+               ebur128_bin_ring_reserve(
+                   ring, ebur128_grown_capacity(ring->capacity))) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    tail = ring->head + ring->size;
+    if (tail >= ring->capacity) {
+      tail -= ring->capacity;
+    }
+    ring->bin[tail] = (unsigned int)b;
+    ++ring->size;
+  }
+  ++histogram[b];
+  return EBUR128_SUCCESS;
+}
+
+/* Limits a histogram of `bins` bins to its newest `max` blocks, or stops
+ * tracking its blocks if `max` is 0. Blocks counted while no limit was set
+ * have no known age, so they are dropped when a limit is set. */
+static void ebur128_bin_ring_set_max(struct ebur128_bin_ring* ring,
+                                     double* histogram, size_t bins,
+                                     unsigned long max) {
+  size_t i;
+
+  if (max == 0) {
+    ebur128_free(ring->allocator, ring->bin);
+    ebur128_bin_ring_init(ring, ring->allocator);
+    return;
+  }
+  if (ring->max == 0) {
+    for (i = 0; i < bins; ++i) {
+      histogram[i] = 0.0;
+    }
+  }
+  ring->max = max;
+  while (ring->size > max) {
+    ebur128_bin_ring_pop(ring, histogram);
+  }
+}
+
+/* Adds the number and sum of the energies of a ring that are at
+ * least `threshold` to *count and *sum, descending the treap once. */
+static void ebur128_ring_sum_above(const struct ebur128_block_ring* ring,
+                                   double threshold, size_t* count,
+                                   double* sum) {
+  size_t t = ring->root;
+
+  while (t != EBUR128_NO_BLOCK) {
+    size_t slot = ebur128_ring_slot(ring, t);
+    const struct ebur128_block_node* node = &ring->nodes[slot];
+    if (ring->z[slot] >= threshold) {
+      ++*count;
+      *sum += ring->z[slot];
+      if (node->right != EBUR128_NO_BLOCK) {
+        const struct ebur128_block_node* right =
+            ebur128_tree_node(ring, node->right);
+        *count += right->count;
+        *sum += right->sum;
+      }
+      t = node->left;
+    } else {
+      t = node->right;
+    }
+  }
+}
+
+/* Returns the energy of rank k, counting from 0, of a ring holding more
+ * than k energies. */
+static double ebur128_ring_nth(const struct ebur128_block_ring* ring,
+                               size_t k) {
+  size_t t = ring->root;
+
+  for (;;) {
+    size_t slot = ebur128_ring_slot(ring, t);
+    const struct ebur128_block_node* node = &ring->nodes[slot];
+    size_t left = node->left == EBUR128_NO_BLOCK
+                      ? 0
+                      : ebur128_tree_node(ring, node->left)->count;
+    if (k < left) {
+      t = node->left;
+    } else if (k == left) {
+      return ring->z[slot];
+    } else {
+      k -= left + 1;
+      t = node->right;
+    }
+  }
+}
+
+/* Returns the number of energies of a ring that are at most z. */
+static size_t ebur128_ring_count_at_most(const struct ebur128_block_ring* ring,
+                                         double z) {
+  size_t t = ring->root, count = 0;
+
+  while (t != EBUR128_NO_BLOCK) {
+    size_t slot = ebur128_ring_slot(ring, t);
+    const struct ebur128_block_node* node = &ring->nodes[slot];
+    if (ring->z[slot] <= z) {
+      count += 1 + (node->left == EBUR128_NO_BLOCK
+                        ? 0
+                        : ebur128_tree_node(ring, node->left)->count);
+      t = node->right;
+    } else {
+      t = node->left;
+    }
+  }
+  return count;
+}
+
+/* Returns the k-th smallest energy, counting from 0, of the short-term block
+ * rings of `sts`. A single ring is descended once. For several, the energy is
+ * found by bisecting the bit patterns of the positive doubles between the
+ * smallest and largest energy, which order like their values, counting the
+ * energies at most the midpoint in every ring. That takes at most 64 rounds
+ * of one descent per ring, and nothing is sorted or allocated. */
+static double ebur128_select_short_term(ebur128_state** sts, size_t size,
+                                        size_t k) {
+  const struct ebur128_block_ring* ring = NULL;
+  double min = HUGE_VAL, max = 0.0, z;
+  uint64_t lo, hi, mid;
+  size_t i, rings = 0, count;
+
+  for (i = 0; i < size; ++i) {
+    if (sts[i] && sts[i]->d->short_term_blocks.size > 0) {
+      ring = &sts[i]->d->short_term_blocks;
+      z = ebur128_ring_nth(ring, 0);
+      min = z < min ? z : min;
+      z = ebur128_ring_nth(ring, ring->size - 1);
+      max = z > max ? z : max;
+      ++rings;
+    }
+  }
+  if (rings == 1) {
+    return ebur128_ring_nth(ring, k);
+  }
+
+  /* No energy is at most lo, more than k are at most hi. */
+  memcpy(&lo, &min, sizeof(double));
+  --lo;
+  memcpy(&hi, &max, sizeof(double));
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    memcpy(&z, &mid, sizeof(double));
+    count = 0;
+    for (i = 0; i < size; ++i) {
+      if (sts[i]) {
+        count += ebur128_ring_count_at_most(&sts[i]->d->short_term_blocks, z);
+      }
+    }
+    if (count > k) {
+      hi = mid;
+    } else {
+      lo = mid;
+    }
+  }
+  memcpy(&z, &hi, sizeof(double));
+  return z;
+}
+
+static size_t ebur128_histogram_index(const struct ebur128_state_internal* d,
+                                      double energy);
+
+/* Moves the bins of a ring to the new histogram layout of d, given the
+ * centre energies of the old bins. */
+static void ebur128_bin_ring_rebin(struct ebur128_bin_ring* ring,
+                                   const struct ebur128_state_internal* d,
+                                   const double* old_energies) {
+  size_t i, slot;
+
+  for (i = 0, slot = ring->head; i < ring->size; ++i) {
+    ring->bin[slot] = (unsigned int)ebur128_histogram_index(
+        d, old_energies[ring->bin[slot]]);
+    if (++slot == ring->capacity) {
+      slot = 0;
+    }
+  }
+}
+
+/* Allocates histograms of `bins` bins of `step` LU, the first one starting at
+ * `min` LUFS, in `memory` of (4 * bins + 1) doubles if it is not NULL.
+ * Blocks counted in the previous histograms, if any, are moved to the bin
+ * holding the centre of their old bin. */
+static int ebur128_alloc_histogram(ebur128_state* st, double min, double step,
+                                   size_t bins, double* memory) {
+  struct ebur128_state_internal* d = st->d;
+  double* old_blocks = d->block_energy_histogram;
+  double* old_short_term_blocks = d->short_term_block_energy_histogram;
+  double* old_energies = d->histogram_energies;
+  size_t old_bins = d->histogram_bins;
+  double* histogram;
+  size_t bytes, i;
+
+  if (bins > ((size_t)-1 - 1) / 4 ||
+      safe_size_mul(4 * bins + 1, sizeof(double), &bytes)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  histogram = memory ? memory : (double*)ebur128_malloc(&d->allocator, bytes);
+  if (!histogram) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  d->histogram_min = min;
+  d->histogram_step = step;
+  d->histogram_bins = bins;
+  d->block_energy_histogram = histogram;
+  d->short_term_block_energy_histogram = histogram + bins;
+  d->histogram_energies = histogram + 2 * bins;
+  d->histogram_boundaries = histogram + 3 * bins;
+  for (i = 0; i < bins; ++i) {
+    d->block_energy_histogram[i] = 0.0;
+    d->short_term_block_energy_histogram[i] = 0.0;
+    d->histogram_energies[i] =
+        pow(10.0, (min + ((double)i + 0.5) * step + 0.691) / 10.0);
+  }
+  for (i = 0; i <= bins; ++i) {
+    d->histogram_boundaries[i] =
+        pow(10.0, (min + (double)i * step + 0.691) / 10.0);
+  }
+
+  if (old_blocks) {
+    ebur128_bin_ring_rebin(&d->block_bins, d, old_energies);
+    ebur128_bin_ring_rebin(&d->short_term_block_bins, d, old_energies);
+    for (i = 0; i < old_bins; ++i) {
+      d->block_energy_histogram[ebur128_histogram_index(d, old_energies[i])] +=
+          old_blocks[i];
+      d->short_term_block_energy_histogram[ebur128_histogram_index(
+          d, old_energies[i])] += old_short_term_blocks[i];
+    }
+    ebur128_free_part(d, old_blocks);
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Size of a cache line, the alignment of the parts of a state. */
+#define EBUR128_CACHE_LINE 64
+
+/** Offsets of the parts of a state in the block allocated by init, each on
+ *  cache lines of its own after the ebur128_state at offset 0. Parts a mode
+ *  does not use take no space; the block histories are allocated as they
+ *  grow. */
+struct ebur128_layout {
+  size_t internal;
+  size_t channel_map;
+  /** sample_peak, prev_sample_peak, true_peak and prev_true_peak. */
+  size_t peaks;
+  size_t filter;
+  size_t sub_block_energy;
+  size_t audio_data;
+  size_t histogram;
+  size_t interp;
+  size_t size;
+};
+
+/* Places `count` elements of `size` bytes on the next cache line after
+ * layout->size. */
+static int ebur128_layout_part(struct ebur128_layout* layout, size_t count,
+                               size_t size, size_t* offset) {
+  size_t bytes;
+  size_t start = (layout->size + EBUR128_CACHE_LINE - 1) /
+                 EBUR128_CACHE_LINE * EBUR128_CACHE_LINE;
+
+  if (safe_size_mul(count, size, &bytes) || start < layout->size ||
+      bytes > ((size_t)-1) - start) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  *offset = start;
+  layout->size = start + bytes;
+  return EBUR128_SUCCESS;
+}
+
+/* Lays out a state of `channels` channels with `frames` frames of
+ * audio_data in `mode`. */
+static int ebur128_init_layout(struct ebur128_layout* layout,
+                               unsigned int channels, int mode,
+                               size_t frames, size_t sub_blocks,
+                               const interp_coefficients* coefficients,
+                               size_t samples_in_100ms) {
+  layout->size = sizeof(ebur128_state);
+  layout->audio_data = 0;
+  layout->histogram = 0;
+  layout->interp = 0;
+  if (ebur128_layout_part(layout, 1, sizeof(struct ebur128_state_internal),
+                          &layout->internal) ||
+      ebur128_layout_part(layout, channels, sizeof(int),
+                          &layout->channel_map) ||
+      ebur128_layout_part(layout, 4 * channels, sizeof(double),
+                          &layout->peaks) ||
+      ebur128_layout_part(layout, channels, sizeof(filter_state),
+                          &layout->filter) ||
+      ebur128_layout_part(layout, sub_blocks, sizeof(double),
+                          &layout->sub_block_energy)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if (!(mode & EBUR128_MODE_LOW_MEMORY) &&
+      ebur128_layout_part(layout, frames, channels * sizeof(double),
+                          &layout->audio_data)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if ((mode & EBUR128_MODE_HISTOGRAM) &&
+      ebur128_layout_part(layout, 4 * EBUR128_HISTOGRAM_BINS + 1,
+                          sizeof(double), &layout->histogram)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if (coefficients &&
+      ebur128_layout_part(
+          layout, 1, interp_size(coefficients, channels, samples_in_100ms),
+          &layout->interp)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  return EBUR128_SUCCESS;
+}
+
+ebur128_state* ebur128_init(unsigned int channels, unsigned long samplerate,
+                            int mode) {
+  return ebur128_init_with_allocator(channels, samplerate, mode, NULL);
+}
+
+ebur128_state* ebur128_init_with_allocator(unsigned int channels,
+                                           unsigned long samplerate, int mode,
+                                           const ebur128_allocator* allocator) {
+  int errcode;
+  ebur128_state* st;
+  struct ebur128_layout layout;
+  const interp_coefficients* coefficients;
+  unsigned long window, samples_in_100ms;
+  size_t frames, sub_blocks;
+  void* block;
+  char* base;
+  unsigned int i;
+
+  VALIDATE_CHANNELS_AND_SAMPLERATE(NULL);
+
+  if (!allocator) {
+    allocator = &ebur128_default_allocator;
+  }
+  if ((mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
+    window = 3000;
+  } else if ((mode & EBUR128_MODE_M) == EBUR128_MODE_M) {
+    window = 400;
+  } else {
+    goto exit;
+  }
+  samples_in_100ms = (samplerate + 5) / 10;
+  frames = samplerate * window / 1000;
+  if (frames % samples_in_100ms) {
+    /* round up to multiple of samples_in_100ms */
+    frames = (frames + samples_in_100ms) - (frames % samples_in_100ms);
+  }
+  sub_blocks = frames / samples_in_100ms + 1;
+  coefficients = ebur128_interp_coefficients(mode, samplerate);
+  errcode = ebur128_init_layout(&layout, channels, mode, frames, sub_blocks,
+                                coefficients, samples_in_100ms);
+  CHECK_ERROR(errcode || layout.size > ((size_t)-1) - EBUR128_CACHE_LINE, 0,
+              exit)
+
+  /* One block for the state and all parts sized here, from the first cache
+   * line in it on. */
+  block = ebur128_malloc(allocator, layout.size + EBUR128_CACHE_LINE - 1);
+  CHECK_ERROR(!block, 0, exit)
+  base = (char*)block + (EBUR128_CACHE_LINE -
+                         (uintptr_t)block % EBUR128_CACHE_LINE) %
+                            EBUR128_CACHE_LINE;
+  st = (ebur128_state*)base;
+  st->d = (struct ebur128_state_internal*)(base + layout.internal);
+  st->d->allocator = *allocator;
+  st->d->block = block;
+  st->d->block_size = layout.size + EBUR128_CACHE_LINE - 1;
+  st->channels = channels;
+  st->samplerate = samplerate;
+  st->mode = mode;
+
+  st->d->channel_map = (int*)(base + layout.channel_map);
+  ebur128_init_channel_map(st);
+  st->d->sample_peak = (double*)(base + layout.peaks);
+  st->d->prev_sample_peak = st->d->sample_peak + channels;
+  st->d->true_peak = st->d->sample_peak + 2 * channels;
+  st->d->prev_true_peak = st->d->sample_peak + 3 * channels;
+  for (i = 0; i < channels; ++i) {
+    st->d->sample_peak[i] = 0.0;
+    st->d->prev_sample_peak[i] = 0.0;
+    st->d->true_peak[i] = 0.0;
+    st->d->prev_true_peak[i] = 0.0;
+  }
+  st->d->reset_prev_peaks = 0;
+  st->d->channel_capacity = channels;
+
+  st->d->use_histogram = mode & EBUR128_MODE_HISTOGRAM ? 1 : 0;
+  st->d->history = ULONG_MAX;
+  st->d->samples_in_100ms = samples_in_100ms;
+  st->d->window = window;
+  st->d->audio_data_frames = frames;
+  st->d->audio_data = layout.audio_data
+                          ? (double*)(base + layout.audio_data)
+                          : NULL;
+  st->d->audio_data_capacity = layout.audio_data ? frames * channels : 0;
+  st->d->sub_block_energy = (double*)(base + layout.sub_block_energy);
+  st->d->sub_block_count = sub_blocks;
+  st->d->sub_block_capacity = sub_blocks;
+  memset(st->d->sub_block_energy, 0, sub_blocks * sizeof(double));
+  st->d->sub_block_index = 0;
+
+  st->d->v = (filter_state*)(base + layout.filter);
+  ebur128_init_filter(st);
+
+  st->d->block_energy_histogram = NULL;
+  if (st->d->use_histogram) {
+    errcode = ebur128_alloc_histogram(st, -70.0, 0.1, EBUR128_HISTOGRAM_BINS,
+                                      (double*)(base + layout.histogram));
+    CHECK_ERROR(errcode, 0, free_block)
+  }
+  ebur128_ring_init(&st->d->blocks, st->d->history / 100, &st->d->allocator);
+  ebur128_ring_init(&st->d->short_term_blocks, st->d->history / 3000,
+                    &st->d->allocator);
+  ebur128_bin_ring_init(&st->d->block_bins, &st->d->allocator);
+  ebur128_bin_ring_init(&st->d->short_term_block_bins, &st->d->allocator);
+  st->d->short_term_frame_counter = 0;
+  st->d->snapshot_blocks = 0;
+  st->d->snapshot_short_term_blocks = 0;
+  st->d->snapshot_frames = frames;
+  atomic_init(&st->d->publish_sequence, 0);
+  st->d->published_range = 0.0;
+  st->d->published_range_stale = 1;
+  for (i = 0; i < EBUR128_PUBLISHED_VALUES; ++i) {
+    atomic_init(&st->d->published[i], i < 4 ? -HUGE_VAL : 0.0);
+  }
+
+  errcode = ebur128_init_resampler(
+      st, layout.interp ? base + layout.interp : NULL,
+      layout.interp ? interp_size(coefficients, channels, samples_in_100ms)
+                    : 0);
+  CHECK_ERROR(errcode, 0, destroy_resampler)
+
+  /* the first block needs 400ms of audio data */
+  st->d->needed_frames = st->d->samples_in_100ms * 4;
+  /* start at the beginning of the buffer */
+  st->d->audio_data_index = 0;
+  st->d->audio_data_fill = 0;
+  st->d->audio_data_zeroed = st->d->audio_data_frames;
+
+  return st;
+
+destroy_resampler:
+  ebur128_destroy_resampler(st);
+free_block:
+  ebur128_free(allocator, block);
+exit:
+  return NULL;
+}
+
+void ebur128_reset(ebur128_state* st) {
+  struct ebur128_state_internal* d = st->d;
+  unsigned int i;
+
+  memset(d->v, 0, st->channels * sizeof(filter_state));
+  memset(d->sub_block_energy, 0, d->sub_block_count * sizeof(double));
+  d->sub_block_index = 0;
+  for (i = 0; i < 4 * st->channels; ++i) {
+    d->sample_peak[i] = 0.0;
+  }
+  d->reset_prev_peaks = 0;
+  if (d->interp) {
+    interp_clear(d->interp);
+  }
+
+  ebur128_ring_clear(&d->blocks);
+  ebur128_ring_clear(&d->short_term_blocks);
+  d->block_bins.head = d->block_bins.size = 0;
+  d->short_term_block_bins.head = d->short_term_block_bins.size = 0;
+  if (d->use_histogram) {
+    memset(d->block_energy_histogram, 0,
+           d->histogram_bins * sizeof(double));
+    memset(d->short_term_block_energy_histogram, 0,
+           d->histogram_bins * sizeof(double));
+  }
+  d->short_term_frame_counter = 0;
+  d->snapshot_blocks = 0;
+  d->snapshot_short_term_blocks = 0;
+  d->snapshot_frames = d->audio_data_frames;
+  atomic_store(&d->publish_sequence, 0);
+  d->published_range_stale = 1;
+  for (i = 0; i < EBUR128_PUBLISHED_VALUES; ++i) {
+    atomic_store(&d->published[i], i < 4 ? -HUGE_VAL : 0.0);
+  }
+
+  /* the first block needs 400ms of audio data */
+  d->needed_frames = d->samples_in_100ms * 4;
+  d->audio_data_index = 0;
+  d->audio_data_fill = 0;
+  d->audio_data_zeroed = d->audio_data_frames;
+}
+
+void ebur128_destroy(ebur128_state** st) {
+  struct ebur128_state_internal* d = (*st)->d;
+  ebur128_allocator allocator = d->allocator;
+  void* block = d->block;
+
+  ebur128_free_part(d, d->block_energy_histogram);
+  ebur128_free_part(d, d->v);
+  ebur128_free_part(d, d->audio_data);
+  ebur128_free_part(d, d->sub_block_energy);
+  ebur128_free_part(d, d->channel_map);
+  ebur128_free_part(d, d->sample_peak);
+  ebur128_ring_destroy(&d->blocks);
+  ebur128_ring_destroy(&d->short_term_blocks);
+  ebur128_free(&allocator, d->block_bins.bin);
+  ebur128_free(&allocator, d->short_term_block_bins.bin);
+  ebur128_destroy_resampler(*st);
+  ebur128_free(&allocator, block);
+  *st = NULL;
+}
+
+/** Idle meters, the most recently returned last. Guarded by a mutex, so
+ *  that workers waiting for it sleep rather than spin if its holder is
+ *  preempted. It is only held to search and update the list, never while a
+ *  meter is created, changed or reset. */
+struct ebur128_pool {
+  ebur128_allocator allocator;
+  pthread_mutex_t lock;
+  size_t capacity;
+  size_t size;
+  ebur128_state** idle;
+};
+
+static void ebur128_pool_lock(ebur128_pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+}
+
+static void ebur128_pool_unlock(ebur128_pool* pool) {
+  pthread_mutex_unlock(&pool->lock);
+}
+
+ebur128_pool* ebur128_pool_create(size_t capacity,
+                                  const ebur128_allocator* allocator) {
+  ebur128_pool* pool;
+  size_t bytes;
+
+  if (!allocator) {
+    allocator = &ebur128_default_allocator;
+  }
+  /* The list of idle meters follows the pool in one allocation. */
+  if (safe_size_mul(capacity, sizeof(ebur128_state*), &bytes) ||
+      bytes > ((size_t)-1) - sizeof(ebur128_pool)) {
+    return NULL;
+  }
+  pool = (ebur128_pool*)ebur128_malloc(allocator,
+                                       sizeof(ebur128_pool) + bytes);
+  if (!pool) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&pool->lock, NULL)) {
+    ebur128_free(allocator, pool);
+    return NULL;
+  }
+  pool->allocator = *allocator;
+  pool->capacity = capacity;
+  pool->size = 0;
+  pool->idle = (ebur128_state**)(pool + 1);
+  return pool;
+}
+
+void ebur128_pool_destroy(ebur128_pool** pool) {
+  ebur128_allocator allocator = (*pool)->allocator;
+  size_t i;
+
+  for (i = 0; i < (*pool)->size; ++i) {
+    ebur128_destroy(&(*pool)->idle[i]);
+  }
+  pthread_mutex_destroy(&(*pool)->lock);
+  ebur128_free(&allocator, *pool);
+  *pool = NULL;
+}
+
+int ebur128_pool_prepare(ebur128_pool* pool, unsigned int channels,
+                         unsigned long samplerate, int mode, size_t count) {
+  ebur128_state* st;
+  size_t i, ready = 0;
+
+  ebur128_pool_lock(pool);
+  for (i = 0; i < pool->size; ++i) {
+    st = pool->idle[i];
+    if (st->channels == channels && st->samplerate == samplerate &&
+        st->mode == mode) {
+      ++ready;
+    }
+  }
+  ebur128_pool_unlock(pool);
+
+  for (; ready < count; ++ready) {
+    st = ebur128_init_with_allocator(channels, samplerate, mode,
+                                     &pool->allocator);
+    if (!st) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    ebur128_pool_lock(pool);
+    if (pool->size == pool->capacity) {
+      ebur128_pool_unlock(pool);
+      ebur128_destroy(&st);
+      return EBUR128_ERROR_NOMEM;
+    }
+    pool->idle[pool->size++] = st;
+    ebur128_pool_unlock(pool);
+  }
+  return EBUR128_SUCCESS;
+}
+
+ebur128_state* ebur128_pool_acquire(ebur128_pool* pool, unsigned int channels,
+                                    unsigned long samplerate, int mode) {
+  ebur128_state* st = NULL;
+  size_t i, found;
+  int errcode;
+
+  VALIDATE_CHANNELS_AND_SAMPLERATE(NULL);
+
+  /* The newest meter of the same configuration, or else of the same mode. */
+  ebur128_pool_lock(pool);
+  found = pool->size;
+  for (i = pool->size; i-- > 0;) {
+    if (pool->idle[i]->mode != mode) {
+      continue;
+    }
+    if (pool->idle[i]->channels == channels &&
+        pool->idle[i]->samplerate == samplerate) {
+      found = i;
+      break;
+    }
+    if (found == pool->size) {
+      found = i;
+    }
+  }
+  if (found < pool->size) {
+    st = pool->idle[found];
+    memmove(pool->idle + found, pool->idle + found + 1,
+            (pool->size - found - 1) * sizeof(ebur128_state*));
+    --pool->size;
+  }
+  ebur128_pool_unlock(pool);
+
+  if (st) {
+    errcode = ebur128_change_parameters(st, channels, samplerate);
+    if (errcode != EBUR128_SUCCESS && errcode != EBUR128_ERROR_NO_CHANGE) {
+      ebur128_destroy(&st);
+    }
+  }
+  if (!st) {
+    st = ebur128_init_with_allocator(channels, samplerate, mode,
+                                     &pool->allocator);
+  }
+  return st;
+}
+
+void ebur128_pool_release(ebur128_pool* pool, ebur128_state* st) {
+  if (!st) {
+    return;
+  }
+  ebur128_init_channel_map(st);
+  ebur128_set_max_history(st, ULONG_MAX);
+  /* The window is clamped to the default of the mode. */
+  if (ebur128_set_max_window(st, 0) == EBUR128_ERROR_NOMEM ||
+      (st->d->use_histogram &&
+       (st->d->histogram_min != -70.0 || st->d->histogram_step != 0.1 ||
+        st->d->histogram_bins != EBUR128_HISTOGRAM_BINS) &&
+       ebur128_alloc_histogram(st, -70.0, 0.1, EBUR128_HISTOGRAM_BINS,
+                               NULL))) {
+    ebur128_destroy(&st);
+    return;
+  }
+  ebur128_reset(st);
+
+  ebur128_pool_lock(pool);
+  if (pool->size < pool->capacity) {
+    pool->idle[pool->size++] = st;
+    st = NULL;
+  }
+  ebur128_pool_unlock(pool);
+  if (st) {
+    ebur128_destroy(&st);
+  }
+}
+
+#if defined(__SSE2_MATH__) || defined(_M_X64) || _M_IX86_FP >= 2
+#include <xmmintrin.h>
+#define TURN_ON_FTZ                  \
+  unsigned int mxcsr = _mm_getcsr(); \
+  _mm_setcsr(mxcsr | _MM_FLUSH_ZERO_ON);
+#define TURN_OFF_FTZ _mm_setcsr(mxcsr);
+#define FLUSH_MANUALLY
+#else
+#warning "manual FTZ is being used, please enable SSE2 (-msse2 -mfpmath=sse)"
+#define TURN_ON_FTZ
+#define TURN_OFF_FTZ
 #define FLUSH_MANUALLY                                                    \
   st->d->v[c][4] = fabs(st->d->v[c][4]) < DBL_MIN ? 0.0 : st->d->v[c][4]; \
   st->d->v[c][3] = fabs(st->d->v[c][3]) < DBL_MIN ? 0.0 : st->d->v[c][3]; \
@@ -629,376 +1954,2229 @@ static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
   st->d->v[c][1] = fabs(st->d->v[c][1]) < DBL_MIN ? 0.0 : st->d->v[c][1];
 #endif
 
-#define EBUR128_FILTER(type, min_scale, max_scale)                           \
-  static void ebur128_filter_##type(ebur128_state* st, const type* src,      \
-                                    size_t frames) {                         \
-    static double scaling_factor =                                           \
-        EBUR128_MAX(-((double)(min_scale)), (double)(max_scale));            \
-                                                                             \
-    double* audio_data = st->d->audio_data + st->d->audio_data_index;        \
-    size_t i, c;                                                             \
-                                                                             \
-    TURN_ON_FTZ                                                              \
-                                                                             \
-    if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) { \
-      for (c = 0; c < st->channels; ++c) {                                   \
-        double max = 0.0;                                                    \
-        for (i = 0; i < frames; ++i) {                                       \
-          double cur = (double)src[i * st->channels + c];                    \
-          if (EBUR128_MAX(cur, -cur) > max) {                                \
-            max = EBUR128_MAX(cur, -cur);                                    \
-          }                                                                  \
-        }                                                                    \
-        max /= scaling_factor;                                               \
-        if (max > st->d->prev_sample_peak[c]) {                              \
-          st->d->prev_sample_peak[c] = max;                                  \
-        }                                                                    \
-      }                                                                      \
-    }                                                                        \
-    if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&     \
-        st->d->interp) {                                                     \
-      for (i = 0; i < frames; ++i) {                                         \
-        for (c = 0; c < st->channels; ++c) {                                 \
-          st->d->resampler_buffer_input[i * st->channels + c] =              \
-              (float)((double)src[i * st->channels + c] / scaling_factor);   \
-        }                                                                    \
-      }                                                                      \
-      ebur128_check_true_peak(st, frames);                                   \
-    }                                                                        \
-    for (c = 0; c < st->channels; ++c) {                                     \
-      if (st->d->channel_map[c] == EBUR128_UNUSED) {                         \
-        continue;                                                            \
-      }                                                                      \
-      for (i = 0; i < frames; ++i) {                                         \
-        st->d->v[c][0] =                                                     \
-            (double)((double)src[i * st->channels + c] / scaling_factor) -   \
-            st->d->a[1] * st->d->v[c][1] - /**/                              \
-            st->d->a[2] * st->d->v[c][2] - /**/                              \
-            st->d->a[3] * st->d->v[c][3] - /**/                              \
-            st->d->a[4] * st->d->v[c][4];                                    \
-        audio_data[i * st->channels + c] = /**/                              \
-            st->d->b[0] * st->d->v[c][0] + /**/                              \
-            st->d->b[1] * st->d->v[c][1] + /**/                              \
-            st->d->b[2] * st->d->v[c][2] + /**/                              \
-            st->d->b[3] * st->d->v[c][3] + /**/                              \
-            st->d->b[4] * st->d->v[c][4];                                    \
-        st->d->v[c][4] = st->d->v[c][3];                                     \
-        st->d->v[c][3] = st->d->v[c][2];                                     \
-        st->d->v[c][2] = st->d->v[c][1];                                     \
-        st->d->v[c][1] = st->d->v[c][0];                                     \
-      }                                                                      \
-      FLUSH_MANUALLY                                                         \
-    }                                                                        \
-    TURN_OFF_FTZ                                                             \
+/* Channel-parallel filter engine. Each vector lane holds the filter state of
+ * one channel, so a group of adjacent interleaved channels is filtered with
+ * one load/store per frame. The operations are issued in the same order as
+ * in the scalar code, which keeps the results bit-identical wherever the
+ * compiler does not contract the scalar code into fused multiply-adds. */
+#if defined(EBUR128_NO_SIMD)
+/* scalar filter only */
+#elif defined(__AVX512F__)
+#include <immintrin.h>
+#define EBUR128_VEC_LANES 8
+typedef __m512d ebur128_vec;
+#define EBUR128_VEC_SET1(x) _mm512_set1_pd(x)
+#define EBUR128_VEC_LOADU(p) _mm512_loadu_pd(p)
+#define EBUR128_VEC_STOREU(p, x) _mm512_storeu_pd((p), (x))
+#define EBUR128_VEC_ADD(x, y) _mm512_add_pd((x), (y))
+#define EBUR128_VEC_SUB(x, y) _mm512_sub_pd((x), (y))
+#define EBUR128_VEC_MUL(x, y) _mm512_mul_pd((x), (y))
+#define EBUR128_VEC_DIV(x, y) _mm512_div_pd((x), (y))
+#define EBUR128_VEC_MAX(x, y) _mm512_max_pd((x), (y))
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define EBUR128_VEC_LANES 4
+typedef __m256d ebur128_vec;
+#define EBUR128_VEC_SET1(x) _mm256_set1_pd(x)
+#define EBUR128_VEC_LOADU(p) _mm256_loadu_pd(p)
+#define EBUR128_VEC_STOREU(p, x) _mm256_storeu_pd((p), (x))
+#define EBUR128_VEC_ADD(x, y) _mm256_add_pd((x), (y))
+#define EBUR128_VEC_SUB(x, y) _mm256_sub_pd((x), (y))
+#define EBUR128_VEC_MUL(x, y) _mm256_mul_pd((x), (y))
+#define EBUR128_VEC_DIV(x, y) _mm256_div_pd((x), (y))
+#define EBUR128_VEC_MAX(x, y) _mm256_max_pd((x), (y))
+#elif defined(__SSE2__) || defined(_M_X64) || _M_IX86_FP >= 2
+#include <emmintrin.h>
+#define EBUR128_VEC_LANES 2
+typedef __m128d ebur128_vec;
+#define EBUR128_VEC_SET1(x) _mm_set1_pd(x)
+#define EBUR128_VEC_LOADU(p) _mm_loadu_pd(p)
+#define EBUR128_VEC_STOREU(p, x) _mm_storeu_pd((p), (x))
+#define EBUR128_VEC_ADD(x, y) _mm_add_pd((x), (y))
+#define EBUR128_VEC_SUB(x, y) _mm_sub_pd((x), (y))
+#define EBUR128_VEC_MUL(x, y) _mm_mul_pd((x), (y))
+#define EBUR128_VEC_DIV(x, y) _mm_div_pd((x), (y))
+#define EBUR128_VEC_MAX(x, y) _mm_max_pd((x), (y))
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define EBUR128_VEC_LANES 2
+typedef float64x2_t ebur128_vec;
+#define EBUR128_VEC_SET1(x) vdupq_n_f64(x)
+#define EBUR128_VEC_LOADU(p) vld1q_f64(p)
+#define EBUR128_VEC_STOREU(p, x) vst1q_f64((p), (x))
+#define EBUR128_VEC_ADD(x, y) vaddq_f64((x), (y))
+#define EBUR128_VEC_SUB(x, y) vsubq_f64((x), (y))
+#define EBUR128_VEC_MUL(x, y) vmulq_f64((x), (y))
+#define EBUR128_VEC_DIV(x, y) vdivq_f64((x), (y))
+#define EBUR128_VEC_MAX(x, y) vmaxq_f64((x), (y))
+#endif
+
+#ifdef EBUR128_VEC_LANES
+/* Returns 1 if none of the channels in [c, c + EBUR128_VEC_LANES) is used. */
+static int ebur128_lanes_unused(ebur128_state* st, size_t c) {
+  size_t l;
+  for (l = 0; l < EBUR128_VEC_LANES; ++l) {
+    if (st->d->channel_map[c + l] != EBUR128_UNUSED) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Reads channels [c, c + EBUR128_VEC_LANES) of frames [begin, end) once,
+ * raising their sample peaks unless sample_peak is NULL, staging them for
+ * the true peak if requested and running the K-weighting filter, whose
+ * squared output is added to channel_sum. Unused channels inside a group are
+ * filtered along with the others; their output is ignored by the gating
+ * code and they add no energy. The samples are not scaled, see
+ * EBUR128_FILTER_CHANNEL. */
+#define EBUR128_FILTER_LANES(name, type, load)                                 \
+  static void ebur128_filter_lanes_##name(                                     \
+      ebur128_state* st, size_t c, const type* const* src, size_t stride,      \
+      size_t begin, size_t end, double gain, int true_peak,                    \
+      double* audio_data, double* sample_peak, double* channel_sum) {          \
+    ebur128_vec v1, v2, v3, v4, v0, x;                                         \
+    const ebur128_vec a1 = EBUR128_VEC_SET1(st->d->a[1]);                      \
+    const ebur128_vec a2 = EBUR128_VEC_SET1(st->d->a[2]);                      \
+    const ebur128_vec a3 = EBUR128_VEC_SET1(st->d->a[3]);                      \
+    const ebur128_vec a4 = EBUR128_VEC_SET1(st->d->a[4]);                      \
+    const ebur128_vec b0 = EBUR128_VEC_SET1(st->d->b[0] * gain);               \
+    const ebur128_vec b1 = EBUR128_VEC_SET1(st->d->b[1] * gain);               \
+    const ebur128_vec b2 = EBUR128_VEC_SET1(st->d->b[2] * gain);               \
+    const ebur128_vec b3 = EBUR128_VEC_SET1(st->d->b[3] * gain);               \
+    const ebur128_vec b4 = EBUR128_VEC_SET1(st->d->b[4] * gain);               \
+    const ebur128_vec scale = EBUR128_VEC_SET1(gain);                          \
+    const double inverse = 1.0 / gain;                                         \
+    const ebur128_vec zero = EBUR128_VEC_SET1(0.0);                            \
+    ebur128_vec energy = EBUR128_VEC_LOADU(channel_sum + c);                   \
+    ebur128_vec peak = zero;                                                   \
+    double lane[EBUR128_VEC_LANES];                                            \
+    size_t i, l;                                                               \
+                                                                               \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      lane[l] = st->d->v[c + l][1] * inverse;                                  \
+    }                                                                          \
+    v1 = EBUR128_VEC_LOADU(lane);                                              \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      lane[l] = st->d->v[c + l][2] * inverse;                                  \
+    }                                                                          \
+    v2 = EBUR128_VEC_LOADU(lane);                                              \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      lane[l] = st->d->v[c + l][3] * inverse;                                  \
+    }                                                                          \
+    v3 = EBUR128_VEC_LOADU(lane);                                              \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      lane[l] = st->d->v[c + l][4] * inverse;                                  \
+    }                                                                          \
+    v4 = EBUR128_VEC_LOADU(lane);                                              \
+                                                                               \
+    for (i = begin; i < end; ++i) {                                            \
+      for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                \
+        lane[l] = (double)load(src[c + l] + i * stride);                       \
+      }                                                                        \
+      x = EBUR128_VEC_LOADU(lane);                                             \
+      if (sample_peak) {                                                       \
+        peak = EBUR128_VEC_MAX(peak, x);                                       \
+        peak = EBUR128_VEC_MAX(peak, EBUR128_VEC_SUB(zero, x));                \
+      }                                                                        \
+      if (true_peak) {                                                         \
+        EBUR128_VEC_STOREU(lane, EBUR128_VEC_MUL(x, scale));                   \
+        for (l = 0; l < EBUR128_VEC_LANES; ++l) {                              \
+          EBUR128_TRUE_PEAK_INPUT(c + l, i) = (float)lane[l];                  \
+        }                                                                      \
+      }                                                                        \
+      v0 = EBUR128_VEC_SUB(x, EBUR128_VEC_MUL(a1, v1));                        \
+      v0 = EBUR128_VEC_SUB(v0, EBUR128_VEC_MUL(a2, v2));                       \
+      v0 = EBUR128_VEC_SUB(v0, EBUR128_VEC_MUL(a3, v3));                       \
+      v0 = EBUR128_VEC_SUB(v0, EBUR128_VEC_MUL(a4, v4));                       \
+      x = EBUR128_VEC_MUL(b0, v0);                                             \
+      x = EBUR128_VEC_ADD(x, EBUR128_VEC_MUL(b1, v1));                         \
+      x = EBUR128_VEC_ADD(x, EBUR128_VEC_MUL(b2, v2));                         \
+      x = EBUR128_VEC_ADD(x, EBUR128_VEC_MUL(b3, v3));                         \
+      x = EBUR128_VEC_ADD(x, EBUR128_VEC_MUL(b4, v4));                         \
+      if (audio_data) {                                                        \
+        EBUR128_VEC_STOREU(audio_data + i * st->channels + c, x);              \
+      }                                                                        \
+      energy = EBUR128_VEC_ADD(energy, EBUR128_VEC_MUL(x, x));                 \
+      v4 = v3;                                                                 \
+      v3 = v2;                                                                 \
+      v2 = v1;                                                                 \
+      v1 = v0;                                                                 \
+    }                                                                          \
+                                                                               \
+    EBUR128_VEC_STOREU(lane, EBUR128_VEC_MUL(v1, scale));                      \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      st->d->v[c + l][1] = lane[l];                                            \
+      st->d->v[c + l][0] = lane[l];                                            \
+    }                                                                          \
+    EBUR128_VEC_STOREU(lane, EBUR128_VEC_MUL(v2, scale));                      \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      st->d->v[c + l][2] = lane[l];                                            \
+    }                                                                          \
+    EBUR128_VEC_STOREU(lane, EBUR128_VEC_MUL(v3, scale));                      \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      st->d->v[c + l][3] = lane[l];                                            \
+    }                                                                          \
+    EBUR128_VEC_STOREU(lane, EBUR128_VEC_MUL(v4, scale));                      \
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                  \
+      st->d->v[c + l][4] = lane[l];                                            \
+    }                                                                          \
+    EBUR128_VEC_STOREU(channel_sum + c, energy);                               \
+    if (sample_peak) {                                                         \
+      EBUR128_VEC_STOREU(lane, EBUR128_VEC_MUL(peak, scale));                  \
+      for (l = 0; l < EBUR128_VEC_LANES; ++l) {                                \
+        sample_peak[c + l] = EBUR128_MAX(sample_peak[c + l], lane[l]);         \
+      }                                                                        \
+    }                                                                          \
+  }
+#else
+#define EBUR128_FILTER_LANES(name, type, load)
+#endif
+
+#ifdef EBUR128_REFERENCE_TRUE_PEAK
+#define EBUR128_TRUE_PEAK_INPUT(c, i) \
+  st->d->resampler_buffer_input[(i)*st->channels + (c)]
+
+static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
+  size_t c, i, frames_out;
+
+  frames_out =
+      interp_process(st->d->interp, frames, st->d->resampler_buffer_input,
+                     st->d->resampler_buffer_output);
+
+  for (c = 0; st->d->reset_prev_peaks && c < st->channels; ++c) {
+    st->d->prev_true_peak[c] = 0.0;
+  }
+  for (i = 0; i < frames_out; ++i) {
+    for (c = 0; c < st->channels; ++c) {
+      double val = (double)st->d->resampler_buffer_output[i * st->channels + c];
+
+      if (EBUR128_MAX(val, -val) > st->d->prev_true_peak[c]) {
+        st->d->prev_true_peak[c] = EBUR128_MAX(val, -val);
+      }
+    }
+  }
+  for (c = 0; c < st->channels; ++c) {
+    if (st->d->prev_true_peak[c] > st->d->true_peak[c]) {
+      st->d->true_peak[c] = st->d->prev_true_peak[c];
+    }
+  }
+}
+#else
+/* Returns the largest absolute value of the oversampled signal for input
+ * frames [begin, end) of the delay line starting at x. Each output is summed
+ * in the order interp_process() uses, so SIMD lanes run over consecutive
+ * frames rather than over taps. */
+static double interp_peak_frames(const interpolator* interp, const double* x,
+                                 size_t begin, size_t end) {
+  double max = 0.0;
+  size_t i = begin;
+  unsigned int f, k;
+
+#ifdef EBUR128_VEC_LANES
+  if (end - begin >= EBUR128_VEC_LANES) {
+    const ebur128_vec zero = EBUR128_VEC_SET1(0.0);
+    ebur128_vec vmax = zero;
+    double lane[EBUR128_VEC_LANES];
+    size_t l;
+    for (; i + EBUR128_VEC_LANES <= end; i += EBUR128_VEC_LANES) {
+      const double* in = x + i;
+      for (f = 0; f < interp->factor; f++) {
+        const interp_filter* filter = &interp->filter[f];
+        ebur128_vec acc = zero;
+        for (k = filter->dense_begin; k < filter->dense_end; k++) {
+          const ebur128_vec c = EBUR128_VEC_SET1(filter->dense[k]);
+          const ebur128_vec z = EBUR128_VEC_LOADU(in - k);
+          acc = EBUR128_VEC_ADD(acc, EBUR128_VEC_MUL(z, c));
+        }
+        vmax = EBUR128_VEC_MAX(vmax, acc);
+        vmax = EBUR128_VEC_MAX(vmax, EBUR128_VEC_SUB(zero, acc));
+      }
+    }
+    EBUR128_VEC_STOREU(lane, vmax);
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {
+      max = EBUR128_MAX(max, lane[l]);
+    }
+  }
+#endif
+  for (; i < end; ++i) {
+    const double* in = x + i;
+    for (f = 0; f < interp->factor; f++) {
+      const interp_filter* filter = &interp->filter[f];
+      double acc = 0.0;
+      for (k = filter->dense_begin; k < filter->dense_end; k++) {
+        acc += *(in - k) * filter->dense[k];
+      }
+      max = EBUR128_MAX(max, EBUR128_MAX(acc, -acc));
+    }
+  }
+  return max;
+}
+
+static double interp_max_abs(const double* x, size_t begin, size_t end) {
+  double max = 0.0;
+  size_t i;
+  for (i = begin; i < end; ++i) {
+    max = EBUR128_MAX(max, EBUR128_MAX(x[i], -x[i]));
+  }
+  return max;
+}
+
+/* Frames per early exit check. */
+#define INTERP_TILE_FRAMES 16
+
+/* Returns the largest absolute value of the oversampled signal for the
+ * `frames` samples staged after the history in the delay line of `chan`, as
+ * interp_process() would write it, then keeps the last delay - 1 samples as
+ * the new history. Rounding to float is monotonic, so it is applied once to
+ * the maximum.
+ *
+ * The outputs of a tile are bounded by peak_gain times the largest input
+ * they depend on. Tiles are skipped when that bound, rounded to float, does
+ * not exceed `limit` or the maximum so far. The result may then be lower
+ * than the true maximum, but only when both are at most `limit`. */
+static double interp_peak(interpolator* interp, unsigned int chan,
+                          size_t frames, double limit) {
+  const double* x = interp->line[chan] + interp->delay - 1;
+  double max = 0.0;
+  size_t begin, end;
+
+  for (begin = 0; begin < frames; begin = end) {
+    double bound;
+    end = begin + INTERP_TILE_FRAMES < frames ? begin + INTERP_TILE_FRAMES
+                                              : frames;
+    bound = interp->peak_gain *
+            interp_max_abs(interp->line[chan], begin, end + interp->delay - 1);
+    if ((double)(float)bound > EBUR128_MAX(limit, max)) {
+      max = EBUR128_MAX(max, interp_peak_frames(interp, x, begin, end));
+    }
+  }
+
+  memmove(interp->line[chan], interp->line[chan] + frames,
+          (interp->delay - 1) * sizeof(double));
+  return (double)(float)max;
+}
+
+#define EBUR128_TRUE_PEAK_INPUT(c, i) \
+  st->d->interp->line[c][st->d->interp->delay - 1 + (i)]
+
+static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
+  unsigned int c;
+
+  for (c = 0; c < st->channels; ++c) {
+    double prev = st->d->reset_prev_peaks ? 0.0 : st->d->prev_true_peak[c];
+    /* Only the maximum with the sample peak is reported. */
+    double peak = interp_peak(st->d->interp, c, frames,
+                              EBUR128_MAX(prev, st->d->prev_sample_peak[c]));
+    st->d->prev_true_peak[c] = EBUR128_MAX(prev, peak);
+    if (peak > st->d->true_peak[c]) {
+      st->d->true_peak[c] = peak;
+    }
+  }
+}
+#endif
+
+/* Reads channel c of frames [begin, end) once, raising its sample peak
+ * unless sample_peak is NULL, staging it for the true peak if requested
+ * and, if `filter` is set, running the K-weighting filter, whose squared
+ * output is added to channel_sum[c].
+ *
+ * The filter runs on the unscaled samples: its state is divided by gain on
+ * entry and multiplied back on exit, and gain is folded into the b
+ * coefficients, so only the peaks and the true-peak input are scaled. Every
+ * gain is a power of two, so each of these products is exact and the
+ * output is bit-identical to filtering the scaled samples, unless a value
+ * falls below DBL_MIN in one of the two scales and is flushed to zero. */
+#define EBUR128_FILTER_CHANNEL(name, type, value_type, load, integer)         \
+  static void ebur128_filter_channel_##name(                                   \
+      ebur128_state* st, size_t c, const type* const* src, size_t stride,      \
+      size_t begin, size_t end, double gain, int true_peak, int filter,        \
+      double* audio_data, double* sample_peak, double* channel_sum) {          \
+    const double a1 = st->d->a[1], a2 = st->d->a[2];                           \
+    const double a3 = st->d->a[3], a4 = st->d->a[4];                           \
+    const double b0 = st->d->b[0] * gain, b1 = st->d->b[1] * gain;             \
+    const double b2 = st->d->b[2] * gain, b3 = st->d->b[3] * gain;             \
+    const double b4 = st->d->b[4] * gain;                                      \
+    const double inverse = 1.0 / gain;                                         \
+    double v1 = st->d->v[c][1] * inverse, v2 = st->d->v[c][2] * inverse;       \
+    double v3 = st->d->v[c][3] * inverse, v4 = st->d->v[c][4] * inverse;       \
+    double peak = 0.0;                                                         \
+    double sum = channel_sum[c];                                               \
+    value_type max = 0, min = 0;                                               \
+    size_t i;                                                                  \
+    for (i = begin; i < end; ++i) {                                            \
+      value_type s = load(src[c] + i * stride);                                \
+      double x = (double)s;                                                    \
+      double v0, y;                                                            \
+      if (integer) {                                                           \
+        max = s > max ? s : max;                                               \
+        min = s < min ? s : min;                                               \
+      } else if (sample_peak && EBUR128_MAX(x, -x) > peak) {                   \
+        peak = EBUR128_MAX(x, -x);                                             \
+      }                                                                        \
+      if (true_peak) {                                                         \
+        EBUR128_TRUE_PEAK_INPUT(c, i) = (float)(x * gain);                     \
+      }                                                                        \
+      if (!filter) {                                                           \
+        continue;                                                              \
+      }                                                                        \
+      v0 = x - a1 * v1 - a2 * v2 - a3 * v3 - a4 * v4;                          \
+      y = b0 * v0 + b1 * v1 + b2 * v2 + b3 * v3 + b4 * v4;                     \
+      if (audio_data) {                                                        \
+        audio_data[i * st->channels + c] = y;                                  \
+      }                                                                        \
+      sum += y * y;                                                            \
+      v4 = v3;                                                                 \
+      v3 = v2;                                                                 \
+      v2 = v1;                                                                 \
+      v1 = v0;                                                                 \
+    }                                                                          \
+    if (filter) {                                                              \
+      st->d->v[c][0] = st->d->v[c][1] = v1 * gain;                             \
+      st->d->v[c][2] = v2 * gain;                                              \
+      st->d->v[c][3] = v3 * gain;                                              \
+      st->d->v[c][4] = v4 * gain;                                              \
+    }                                                                          \
+    if (integer) {                                                             \
+      peak = EBUR128_MAX((double)max, -(double)min);                           \
+    }                                                                          \
+    peak *= gain;                                                              \
+    if (sample_peak && peak > sample_peak[c]) {                                \
+      sample_peak[c] = peak;                                                   \
+    }                                                                          \
+    channel_sum[c] = sum;                                                      \
+  }
+
+#ifdef EBUR128_VEC_LANES
+#define EBUR128_FILTER_GROUPS(name)                                          \
+  for (; c + EBUR128_VEC_LANES <= st->channels; c += EBUR128_VEC_LANES) {   \
+    size_t first = c;                                                        \
+    if (ebur128_lanes_unused(st, c)) {                                       \
+      continue;                                                              \
+    }                                                                        \
+    ebur128_filter_lanes_##name(st, c, src, stride, begin, end, gain,        \
+                                true_peak, audio_data, peaks, channel_sum);  \
+    for (; c < first + EBUR128_VEC_LANES; ++c) {                             \
+      done[c] = 1;                                                           \
+      FLUSH_MANUALLY                                                         \
+    }                                                                        \
+    c = first;                                                               \
+  }
+#else
+#define EBUR128_FILTER_GROUPS(name)
+#endif
+
+/* Bytes of interleaved source per tile, sized so that a tile is still in L1
+ * cache when the next group of channels reads it. */
+#define EBUR128_TILE_BYTES 16384
+
+/* Reads every source sample once. The frames are processed in tiles, and
+ * within a tile groups of adjacent channels are decoded, scanned for the
+ * sample peak, staged for the true peak and filtered in one pass. The
+ * per-channel energies are summed over the whole call, so tiling does not
+ * change the result.
+ *
+ * Samples are `width` elements of `type` wide and decoded by `load` into
+ * `value_type`. All scaling factors are powers of two, so multiplying by
+ * their inverse gives the same result as dividing. */
+#define EBUR128_FILTER(name, type, value_type, load, integer, width,         \
+                       min_scale, max_scale)                                 \
+  EBUR128_FILTER_LANES(name, type, load)                                     \
+  EBUR128_FILTER_CHANNEL(name, type, value_type, load, integer)              \
+  static void ebur128_filter_##name(ebur128_state* st,                       \
+                                    const type* const* src, size_t stride,   \
+                                    size_t frames) {                         \
+    static const double gain =                                               \
+        1.0 / EBUR128_MAX(-((double)(min_scale)), (double)(max_scale));      \
+                                                                             \
+    double* audio_data =                                                     \
+        st->d->audio_data ? st->d->audio_data + st->d->audio_data_index      \
+                          : NULL;                                            \
+    double* sub_block_energy =                                               \
+        st->d->sub_block_energy + st->d->sub_block_index;                    \
+    double sample_peak[VALIDATE_MAX_CHANNELS];                               \
+    double channel_sum[VALIDATE_MAX_CHANNELS];                               \
+    char done[VALIDATE_MAX_CHANNELS];                                        \
+    size_t tile_frames =                                                     \
+        EBUR128_MAX(EBUR128_TILE_BYTES /                                     \
+                        (st->channels * (width) * sizeof(type)),             \
+                    1);                                                      \
+    int sample_peak_mode =                                                   \
+        (st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK;   \
+    double* peaks = sample_peak_mode ? sample_peak : NULL;                   \
+    int true_peak =                                                          \
+        (st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&     \
+        st->d->interp;                                                       \
+    size_t begin, end, c, i;                                                 \
+                                                                             \
+    TURN_ON_FTZ                                                              \
+                                                                             \
+    for (c = 0; c < st->channels; ++c) {                                     \
+      sample_peak[c] = 0.0;                                                  \
+      channel_sum[c] = 0.0;                                                  \
+    }                                                                        \
+    for (begin = 0; begin < frames; begin = end) {                           \
+      end = frames - begin < tile_frames ? frames : begin + tile_frames;     \
+      memset(done, 0, st->channels);                                         \
+      c = 0;                                                                 \
+      EBUR128_FILTER_GROUPS(name)                                            \
+      for (c = 0; c < st->channels; ++c) {                                   \
+        int filter = st->d->channel_map[c] != EBUR128_UNUSED;                \
+        if (done[c]) {                                                       \
+          continue;                                                          \
+        }                                                                    \
+        if (!filter && audio_data) {                                         \
+          /* The window is not zeroed up front, so keep unused channels    \
+           * silent in case they are used later. */                          \
+          for (i = begin; i < end; ++i) {                                    \
+            audio_data[i * st->channels + c] = 0.0;                          \
+          }                                                                  \
+        }                                                                    \
+        if (!filter && !sample_peak_mode) {                                  \
+          continue;                                                          \
+        }                                                                    \
+        ebur128_filter_channel_##name(st, c, src, stride, begin, end, gain,  \
+                                      true_peak, filter, audio_data, peaks,  \
+                                      channel_sum);                          \
+        FLUSH_MANUALLY                                                       \
+      }                                                                      \
+    }                                                                        \
+    for (c = 0; c < st->channels; ++c) {                                     \
+      double weight = ebur128_channel_weight(st->d->channel_map[c]);        \
+      if (sample_peak_mode) {                                                \
+        if (st->d->reset_prev_peaks ||                                       \
+            sample_peak[c] > st->d->prev_sample_peak[c]) {                   \
+          st->d->prev_sample_peak[c] = sample_peak[c];                       \
+        }                                                                    \
+        if (sample_peak[c] > st->d->sample_peak[c]) {                        \
+          st->d->sample_peak[c] = sample_peak[c];                            \
+        }                                                                    \
+      }                                                                      \
+      if (weight != 0.0) {                                                   \
+        *sub_block_energy += channel_sum[c] * weight;                        \
+      }                                                                      \
+    }                                                                        \
+    if (true_peak) {                                                         \
+      ebur128_check_true_peak(st, frames);                                   \
+    }                                                                        \
+    st->d->reset_prev_peaks = 0;                                             \
+    TURN_OFF_FTZ                                                             \
+  }
+
+/* Decoders for the packed and byte-swapped formats. Signed values are
+ * recovered by flipping the sign bit of the unsigned value and subtracting
+ * the offset, which is well defined for every input. */
+#define EBUR128_LOAD_NATIVE(p) (*(p))
+#define EBUR128_LOAD_U8(p) ((int)(p)[0] - 128)
+#define EBUR128_LOAD_S16BE(p) \
+  ((int)((((unsigned int)(p)[0] << 8) | (p)[1]) ^ 0x8000u) - 0x8000)
+#define EBUR128_LOAD_S24LE(p)                                        \
+  ((int)((((unsigned int)(p)[2] << 16) | ((unsigned int)(p)[1] << 8) | \
+          (p)[0]) ^                                                  \
+         0x800000u) -                                                \
+   0x800000)
+#define EBUR128_LOAD_S24BE(p)                                        \
+  ((int)((((unsigned int)(p)[0] << 16) | ((unsigned int)(p)[1] << 8) | \
+          (p)[2]) ^                                                  \
+         0x800000u) -                                                \
+   0x800000)
+#define EBUR128_LOAD_S24IN32(p) \
+  ((int)(((unsigned int)*(p) & 0xFFFFFFu) ^ 0x800000u) - 0x800000)
+#define EBUR128_LOAD_S32BE(p) ebur128_load_s32be(p)
+
+static int ebur128_load_s32be(const unsigned char* p) {
+  unsigned long u = ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+                    ((unsigned long)p[2] << 8) | p[3];
+  if (u <= INT_MAX) {
+    return (int)u;
+  }
+  return -(int)(0xFFFFFFFFul - u) - 1;
+}
+
+EBUR128_FILTER(short, short, short, EBUR128_LOAD_NATIVE, 1, 1, SHRT_MIN,
+               SHRT_MAX)
+EBUR128_FILTER(int, int, int, EBUR128_LOAD_NATIVE, 1, 1, INT_MIN, INT_MAX)
+EBUR128_FILTER(float, float, float, EBUR128_LOAD_NATIVE, 0, 1, -1.0f, 1.0f)
+EBUR128_FILTER(double, double, double, EBUR128_LOAD_NATIVE, 0, 1, -1.0, 1.0)
+EBUR128_FILTER(u8, unsigned char, int, EBUR128_LOAD_U8, 1, 1, -128, 127)
+EBUR128_FILTER(s16be, unsigned char, int, EBUR128_LOAD_S16BE, 1, 2, SHRT_MIN,
+               SHRT_MAX)
+EBUR128_FILTER(s24le, unsigned char, int, EBUR128_LOAD_S24LE, 1, 3, -8388608,
+               8388607)
+EBUR128_FILTER(s24be, unsigned char, int, EBUR128_LOAD_S24BE, 1, 3, -8388608,
+               8388607)
+EBUR128_FILTER(s24in32, int, int, EBUR128_LOAD_S24IN32, 1, 1, -8388608,
+               8388607)
+EBUR128_FILTER(s32be, unsigned char, int, EBUR128_LOAD_S32BE, 1, 4, INT_MIN,
+               INT_MAX)
+
+static double ebur128_energy_to_loudness(double energy) {
+  return 10 * (log(energy) / log(10.0)) - 0.691;
+}
+
+/* Returns the histogram bin of an energy. The estimate from the loudness is
+ * corrected against the boundaries, so that an energy on a boundary falls in
+ * the bin above it. Energies outside the range fall in the first or last
+ * bin. */
+static size_t ebur128_histogram_index(const struct ebur128_state_internal* d,
+                                      double energy) {
+  double position =
+      (ebur128_energy_to_loudness(energy) - d->histogram_min) /
+      d->histogram_step;
+  size_t index;
+
+  if (!(position > 0.0)) {
+    index = 0;
+  } else if (position >= (double)d->histogram_bins) {
+    index = d->histogram_bins - 1;
+  } else {
+    index = (size_t)position;
+  }
+  while (index > 0 && energy < d->histogram_boundaries[index]) {
+    --index;
+  }
+  while (index + 1 < d->histogram_bins &&
+         energy >= d->histogram_boundaries[index + 1]) {
+    ++index;
+  }
+  return index;
+}
+
+/* Returns the first bin whose centre energy is at least `threshold`. */
+static size_t ebur128_histogram_gate_index(
+    const struct ebur128_state_internal* d, double threshold) {
+  size_t index;
+
+  if (threshold < d->histogram_boundaries[0]) {
+    return 0;
+  }
+  index = ebur128_histogram_index(d, threshold);
+  if (threshold > d->histogram_energies[index]) {
+    ++index;
+  }
+  return index;
+}
+
+/* Adds the number of blocks in bins [begin, histogram_bins) of `histogram`
+ * to *count and their energy to *sum. */
+static void ebur128_histogram_sum(const struct ebur128_state_internal* d,
+                                  const double* histogram, size_t begin,
+                                  double* count, double* sum) {
+  size_t i = begin;
+
+#ifdef EBUR128_VEC_LANES
+  if (d->histogram_bins - i >= EBUR128_VEC_LANES) {
+    ebur128_vec vcount = EBUR128_VEC_SET1(0.0);
+    ebur128_vec vsum = EBUR128_VEC_SET1(0.0);
+    double lane[EBUR128_VEC_LANES];
+    size_t l;
+    for (; i + EBUR128_VEC_LANES <= d->histogram_bins;
+         i += EBUR128_VEC_LANES) {
+      ebur128_vec h = EBUR128_VEC_LOADU(histogram + i);
+      vcount = EBUR128_VEC_ADD(vcount, h);
+      vsum = EBUR128_VEC_ADD(
+          vsum,
+          EBUR128_VEC_MUL(h, EBUR128_VEC_LOADU(d->histogram_energies + i)));
+    }
+    EBUR128_VEC_STOREU(lane, vcount);
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {
+      *count += lane[l];
+    }
+    EBUR128_VEC_STOREU(lane, vsum);
+    for (l = 0; l < EBUR128_VEC_LANES; ++l) {
+      *sum += lane[l];
+    }
+  }
+#endif
+  for (; i < d->histogram_bins; ++i) {
+    *count += histogram[i];
+    *sum += histogram[i] * d->histogram_energies[i];
+  }
+}
+
+/* Sums the energies of the last `sub_blocks` complete 100ms sub-blocks. */
+static double ebur128_sum_sub_blocks(ebur128_state* st, size_t sub_blocks) {
+  size_t end = st->d->sub_block_index;
+  size_t i;
+  double sum = 0.0;
+
+  if (end < sub_blocks) {
+    for (i = st->d->sub_block_count - (sub_blocks - end);
+         i < st->d->sub_block_count; ++i) {
+      sum += st->d->sub_block_energy[i];
+    }
+    sub_blocks = end;
+  }
+  for (i = end - sub_blocks; i < end; ++i) {
+    sum += st->d->sub_block_energy[i];
+  }
+  return sum;
+}
+
+/* Zeroes the frames of audio_data never written from frame `begin` to the
+ * end, before reading them. Init and reset leave them uninitialized, so
+ * that a state does not clear its whole window before measuring a short
+ * file, and a query reading across the end clears only what it reads. */
+static void ebur128_clear_audio_data(ebur128_state* st, size_t begin) {
+  struct ebur128_state_internal* d = st->d;
+
+  if (begin < d->audio_data_fill) {
+    begin = d->audio_data_fill;
+  }
+  if (d->audio_data && begin < d->audio_data_zeroed) {
+    memset(d->audio_data + begin * st->channels, 0,
+           (d->audio_data_zeroed - begin) * st->channels * sizeof(double));
+    d->audio_data_zeroed = begin;
+  }
+}
+
+/* Sums the channel-weighted energy of the last `frames_per_block` frames of
+ * audio_data. */
+static double ebur128_sum_audio_data(ebur128_state* st,
+                                     size_t frames_per_block) {
+  size_t i, c;
+  double sum = 0.0;
+  double channel_sum;
+
+  if (st->d->audio_data_index < frames_per_block * st->channels) {
+    ebur128_clear_audio_data(
+        st, st->d->audio_data_frames -
+                (frames_per_block - st->d->audio_data_index / st->channels));
+  }
+  for (c = 0; c < st->channels; ++c) {
+    if (st->d->channel_map[c] == EBUR128_UNUSED) {
+      continue;
+    }
+    channel_sum = 0.0;
+    if (st->d->audio_data_index < frames_per_block * st->channels) {
+      for (i = 0; i < st->d->audio_data_index / st->channels; ++i) {
+        channel_sum += st->d->audio_data[i * st->channels + c] *
+                       st->d->audio_data[i * st->channels + c];
+      }
+      for (i = st->d->audio_data_frames -
+               (frames_per_block - st->d->audio_data_index / st->channels);
+           i < st->d->audio_data_frames; ++i) {
+        channel_sum += st->d->audio_data[i * st->channels + c] *
+                       st->d->audio_data[i * st->channels + c];
+      }
+    } else {
+      for (i = st->d->audio_data_index / st->channels - frames_per_block;
+           i < st->d->audio_data_index / st->channels; ++i) {
+        channel_sum += st->d->audio_data[i * st->channels + c] *
+                       st->d->audio_data[i * st->channels + c];
+      }
+    }
+    sum += channel_sum * ebur128_channel_weight(st->d->channel_map[c]);
+  }
+  return sum;
+}
+
+static int ebur128_calc_gating_block(ebur128_state* st, size_t frames_per_block,
+                                     double* optional_output) {
+  double sum;
+
+  /* Blocks ending on a 100ms boundary are made of whole sub-blocks, whose
+   * energies were summed while filtering. Without audio_data, every block
+   * is rounded to whole sub-blocks and ends at the last 100ms boundary. */
+  if (!st->d->audio_data ||
+      (st->d->audio_data_index % (st->d->samples_in_100ms * st->channels) ==
+           0 &&
+       frames_per_block % st->d->samples_in_100ms == 0)) {
+    size_t sub_blocks = (frames_per_block + st->d->samples_in_100ms / 2) /
+                        st->d->samples_in_100ms;
+    if (sub_blocks == 0) {
+      sub_blocks = 1;
+    }
+    sum = ebur128_sum_sub_blocks(st, sub_blocks) /
+          (double)(sub_blocks * st->d->samples_in_100ms);
+  } else {
+    sum = ebur128_sum_audio_data(st, frames_per_block) /
+          (double)frames_per_block;
+  }
+
+  if (optional_output) {
+    *optional_output = sum;
+    return EBUR128_SUCCESS;
+  }
+
+  if (sum >= absolute_gate_energy) {
+    if (st->d->use_histogram) {
+      if (ebur128_bin_ring_push(&st->d->block_bins,
+                                st->d->block_energy_histogram,
+                                ebur128_histogram_index(st->d, sum))) {
+        return EBUR128_ERROR_NOMEM;
+      }
+    } else if (ebur128_ring_push(&st->d->blocks, sum)) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_set_channel(ebur128_state* st, unsigned int channel_number,
+                        int value) {
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+  if (value == EBUR128_DUAL_MONO &&
+      (st->channels != 1 || channel_number != 0)) {
+    fprintf(stderr, "EBUR128_DUAL_MONO only works with mono files!\n");
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+  st->d->channel_map[channel_number] = value;
+  return EBUR128_SUCCESS;
+}
+
+/* Computes the frames of audio_data for a window of `window` ms at
+ * `samplerate`, a whole number of sub-blocks. */
+static int ebur128_frames_in_window(unsigned long samplerate,
+                                    unsigned long window, size_t* frames) {
+  unsigned long samples_in_100ms = (samplerate + 5) / 10;
+
+  if (safe_size_mul(samplerate, window, frames) != 0) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  /* window is in ms */
+  *frames /= 1000;
+  if (*frames % samples_in_100ms) {
+    /* round up to multiple of samples_in_100ms */
+    *frames = (*frames + samples_in_100ms) - (*frames % samples_in_100ms);
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Raises *window to the shortest one of the mode and computes the frames
+ * of audio_data for it. */
+static int ebur128_window_frames(ebur128_state* st, unsigned long* window,
+                                 size_t* frames) {
+  if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S && *window < 3000) {
+    *window = 3000;
+  } else if ((st->mode & EBUR128_MODE_M) == EBUR128_MODE_M && *window < 400) {
+    *window = 400;
+  }
+  return ebur128_frames_in_window(st->samplerate, *window, frames);
+}
+
+/* Maps a duration of `frames` frames at `from` samples per 100ms to `to`
+ * samples per 100ms. Whole sub-blocks stay whole, and the frames of a
+ * partial one are rounded to the nearest of 1 to to - 1, so that it stays
+ * partial. */
+static size_t ebur128_map_frames(size_t frames, unsigned long from,
+                                 unsigned long to) {
+  size_t partial = frames % from;
+
+  if (partial > 0) {
+    partial = (size_t)((double)partial * (double)to / (double)from + 0.5);
+    if (partial < 1) {
+      partial = 1;
+    } else if (partial > to - 1) {
+      partial = to - 1;
+    }
+  }
+  return frames / from * to + partial;
+}
+
+static void ebur128_reverse(double* x, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n / 2; ++i) {
+    double t = x[i];
+    x[i] = x[n - 1 - i];
+    x[n - 1 - i] = t;
+  }
+}
+
+/* Resizes the sub-block ring to `sub_blocks`, keeping the newest ones and
+ * the one being filled, which becomes the last. */
+static void ebur128_resize_sub_blocks(ebur128_state* st, size_t sub_blocks) {
+  struct ebur128_state_internal* d = st->d;
+  double* e = d->sub_block_energy;
+  size_t count = d->sub_block_count;
+  size_t first = d->sub_block_index + 1;
+
+  /* Rotate the oldest sub-block to the front. */
+  ebur128_reverse(e, first);
+  ebur128_reverse(e + first, count - first);
+  ebur128_reverse(e, count);
+  if (sub_blocks < count) {
+    memmove(e, e + count - sub_blocks, sub_blocks * sizeof(double));
+  } else {
+    memmove(e + sub_blocks - count, e, count * sizeof(double));
+    memset(e, 0, (sub_blocks - count) * sizeof(double));
+  }
+  d->sub_block_count = sub_blocks;
+  d->sub_block_index = sub_blocks - 1;
+}
+
+int ebur128_change_parameters(ebur128_state* st, unsigned int channels,
+                              unsigned long samplerate) {
+  struct ebur128_state_internal* d = st->d;
+  const interp_coefficients* coefficients;
+  unsigned int old_channels = st->channels;
+  unsigned long old_samples_in_100ms = d->samples_in_100ms;
+  unsigned long samples_in_100ms;
+  size_t frames, sub_blocks, partial, mapped, i, k;
+  size_t audio_data_size = 0;
+  double scale;
+
+  /* This is needed to suppress a clang-tidy warning. */
+#ifndef __has_builtin
+#define __has_builtin(x) 0
+#endif
+#if __has_builtin(__builtin_unreachable)
+  if (st->channels == 0) {
+    __builtin_unreachable();
+  }
+#endif
+
+  VALIDATE_CHANNELS_AND_SAMPLERATE(EBUR128_ERROR_NOMEM);
+
+  if (channels == st->channels && samplerate == st->samplerate) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+
+  /* Grow the parts that are too small for the new parameters. A failure
+   * leaves the state as it was, only with more capacity. */
+  samples_in_100ms = (samplerate + 5) / 10;
+  if (ebur128_frames_in_window(samplerate, d->window, &frames) ||
+      (!(st->mode & EBUR128_MODE_LOW_MEMORY) &&
+       safe_size_mul(frames, channels, &audio_data_size))) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  sub_blocks = frames / samples_in_100ms + 1;
+  coefficients = ebur128_interp_coefficients(st->mode, samplerate);
+  if (ebur128_grow_channels(st, channels) ||
+      ebur128_grow_window(st, audio_data_size, sub_blocks) ||
+      (coefficients && ebur128_grow_resampler(st, coefficients, channels,
+                                              samples_in_100ms))) {
+    return EBUR128_ERROR_NOMEM;
+  }
+
+  /* Keep the peaks of the channels in both layouts, moving the four
+   * arrays to the new number of channels. */
+  if (channels > old_channels) {
+    for (k = 3; k > 0; --k) {
+      memmove(d->sample_peak + k * channels, d->sample_peak + k * old_channels,
+              old_channels * sizeof(double));
+    }
+    for (k = 0; k < 4; ++k) {
+      for (i = old_channels; i < channels; ++i) {
+        d->sample_peak[k * channels + i] = 0.0;
+      }
+    }
+  } else if (channels < old_channels) {
+    for (k = 1; k < 4; ++k) {
+      memmove(d->sample_peak + k * channels, d->sample_peak + k * old_channels,
+              channels * sizeof(double));
+    }
+  }
+  d->prev_sample_peak = d->sample_peak + channels;
+  d->true_peak = d->sample_peak + 2 * channels;
+  d->prev_true_peak = d->sample_peak + 3 * channels;
+
+  /* At the same rate the filters of the channels kept run on. */
+  st->channels = channels;
+  if (samplerate != st->samplerate) {
+    st->samplerate = samplerate;
+    d->samples_in_100ms = samples_in_100ms;
+    ebur128_init_filter(st);
+  } else if (channels > old_channels) {
+    memset(d->v + old_channels, 0,
+           (channels - old_channels) * sizeof(filter_state));
+  }
+  if (channels != old_channels) {
+    ebur128_init_channel_map(st);
+  }
+
+  /* The sub-blocks of the window are kept with their mean square, so a
+   * switch at a 100ms boundary loses nothing. The frames of a partial
+   * sub-block are mapped to the nearest number of frames at the new rate,
+   * and the block in flight, the next short-term block and the window
+   * continue from there. */
+  partial = d->audio_data_index / old_channels % old_samples_in_100ms;
+  mapped = ebur128_map_frames(partial, old_samples_in_100ms, samples_in_100ms);
+  if (sub_blocks != d->sub_block_count) {
+    ebur128_resize_sub_blocks(st, sub_blocks);
+  }
+  scale = (double)samples_in_100ms / (double)old_samples_in_100ms;
+  for (i = 0; i < sub_blocks; ++i) {
+    d->sub_block_energy[i] *= scale;
+  }
+  d->needed_frames = (unsigned long)(ebur128_map_frames(
+                         d->needed_frames + partial, old_samples_in_100ms,
+                         samples_in_100ms) -
+                     mapped);
+  d->short_term_frame_counter =
+      ebur128_map_frames(d->short_term_frame_counter, old_samples_in_100ms,
+                         samples_in_100ms);
+
+  /* The filtered audio of the old layout is dropped: queries that do not
+   * end on a 100ms boundary read silence before the switch. */
+  d->audio_data_frames = frames;
+  d->audio_data_index = mapped * channels;
+  d->audio_data_fill = mapped;
+  d->audio_data_zeroed = frames;
+  d->snapshot_frames = frames;
+  if (d->audio_data) {
+    memset(d->audio_data, 0, mapped * channels * sizeof(double));
+  }
+
+  d->interp = coefficients ? interp_init(d->interp_memory, coefficients,
+                                         channels, samples_in_100ms)
+                           : NULL;
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_reserve_parameters(ebur128_state* st, unsigned int channels,
+                               unsigned long samplerate) {
+  struct ebur128_state_internal* d = st->d;
+  const interp_coefficients* coefficients;
+  size_t frames, audio_data_size = 0;
+  unsigned long rate;
+
+  VALIDATE_CHANNELS_AND_SAMPLERATE(EBUR128_ERROR_NOMEM);
+
+  channels = EBUR128_MAX(channels, st->channels);
+  samplerate = EBUR128_MAX(samplerate, st->samplerate);
+  /* No lower rate takes more frames than the window at `samplerate` plus
+   * the rounding up to a whole sub-block there. */
+  if (safe_size_mul(samplerate, d->window, &frames) != 0) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  frames = frames / 1000 + (samplerate + 5) / 10;
+  if (!(st->mode & EBUR128_MODE_LOW_MEMORY) &&
+      safe_size_mul(frames, channels, &audio_data_size)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if (ebur128_grow_channels(st, channels) ||
+      /* A rate has at most 12 times as many samples as fit in 100ms
+       * (24 Hz with 2), and any rate may be switched to. */
+      ebur128_grow_window(st, audio_data_size, d->window * 12 / 1000 + 2)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  /* The largest interpolator below 96 kHz and the largest below 192 kHz. */
+  rate = samplerate < 96000 ? samplerate : 95999;
+  coefficients = ebur128_interp_coefficients(st->mode, rate);
+  if (coefficients && ebur128_grow_resampler(st, coefficients, channels,
+                                             (rate + 5) / 10)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  rate = samplerate < 192000 ? samplerate : 191999;
+  coefficients = ebur128_interp_coefficients(st->mode, rate);
+  if (coefficients && ebur128_grow_resampler(st, coefficients, channels,
+                                             (rate + 5) / 10)) {
+    return EBUR128_ERROR_NOMEM;
   }
+  return EBUR128_SUCCESS;
+}
 
-EBUR128_FILTER(short, SHRT_MIN, SHRT_MAX)
-EBUR128_FILTER(int, INT_MIN, INT_MAX)
-EBUR128_FILTER(float, -1.0f, 1.0f)
-EBUR128_FILTER(double, -1.0, 1.0)
+int ebur128_set_max_window(ebur128_state* st, unsigned long window) {
+  int errcode = EBUR128_SUCCESS;
+  double* new_audio_data;
+  double* new_sub_block_energy;
+  size_t new_sub_block_count;
+  size_t new_audio_data_frames;
 
-static double ebur128_energy_to_loudness(double energy) {
-  return 10 * (log(energy) / log(10.0)) - 0.691;
+  if (ebur128_window_frames(st, &window, &new_audio_data_frames)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if (window == st->d->window) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+
+  errcode = ebur128_alloc_ring_buffers(st, new_audio_data_frames,
+                                       &new_audio_data, &new_sub_block_energy,
+                                       &new_sub_block_count);
+  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+
+  st->d->window = window;
+  ebur128_free_part(st->d, st->d->audio_data);
+  st->d->audio_data = new_audio_data;
+  ebur128_free_part(st->d, st->d->sub_block_energy);
+  st->d->sub_block_energy = new_sub_block_energy;
+  st->d->sub_block_count = new_sub_block_count;
+  st->d->sub_block_capacity = new_sub_block_count;
+  st->d->sub_block_index = 0;
+  st->d->audio_data_frames = new_audio_data_frames;
+  st->d->audio_data_capacity =
+      new_audio_data ? new_audio_data_frames * st->channels : 0;
+
+  /* the first block needs 400ms of audio data */
+  st->d->needed_frames = st->d->samples_in_100ms * 4;
+  /* start at the beginning of the buffer */
+  st->d->audio_data_index = 0;
+  st->d->audio_data_fill = 0;
+  st->d->audio_data_zeroed = st->d->audio_data_frames;
+  st->d->snapshot_frames = st->d->audio_data_frames;
+  /* reset short term frame counter */
+  st->d->short_term_frame_counter = 0;
+
+exit:
+  return errcode;
 }
 
-static size_t find_histogram_index(double energy) {
-  size_t index_min = 0;
-  size_t index_max = 1000;
-  size_t index_mid;
+int ebur128_set_max_history(ebur128_state* st, unsigned long history) {
+  if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA && history < 3000) {
+    history = 3000;
+  } else if ((st->mode & EBUR128_MODE_M) == EBUR128_MODE_M && history < 400) {
+    history = 400;
+  }
+  if (history == st->d->history) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  st->d->history = history;
+  ebur128_ring_set_max(&st->d->blocks, st->d->history / 100);
+  ebur128_ring_set_max(&st->d->short_term_blocks, st->d->history / 3000);
+  st->d->published_range_stale = 1;
+  if (st->d->use_histogram) {
+    int limited = st->d->history != ULONG_MAX;
+    ebur128_bin_ring_set_max(&st->d->block_bins,
+                             st->d->block_energy_histogram,
+                             st->d->histogram_bins,
+                             limited ? st->d->history / 100 : 0);
+    ebur128_bin_ring_set_max(&st->d->short_term_block_bins,
+                             st->d->short_term_block_energy_histogram,
+                             st->d->histogram_bins,
+                             limited ? st->d->history / 3000 : 0);
+  }
+  return EBUR128_SUCCESS;
+}
 
-  do {
-    index_mid = (index_min + index_max) / 2;
-    if (energy >= histogram_energy_boundaries[index_mid]) {
-      index_min = index_mid;
-    } else {
-      index_max = index_mid;
+int ebur128_reserve(ebur128_state* st, unsigned long duration) {
+  struct ebur128_state_internal* d = st->d;
+  /* A gating block every 100ms after the first 400ms, and a short-term
+   * block every second after the first 3s. */
+  size_t blocks = duration / 100 + 1;
+  size_t short_term_blocks = duration / 1000 + 1;
+
+  if (d->use_histogram) {
+    if (ebur128_bin_ring_reserve(&d->block_bins, blocks) ||
+        ebur128_bin_ring_reserve(&d->short_term_block_bins,
+                                 short_term_blocks)) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    return EBUR128_SUCCESS;
+  }
+  if (ebur128_ring_reserve(&d->blocks, blocks)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+    if (ebur128_ring_reserve(&d->short_term_blocks, short_term_blocks)) {
+      return EBUR128_ERROR_NOMEM;
     }
-  } while (index_max - index_min != 1);
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Drops all gating and short-term blocks, keeping the allocations. */
+static void ebur128_clear_blocks(ebur128_state* st) {
+  size_t i;
 
-  return index_min;
+  while (st->d->blocks.size > 0) {
+    ebur128_ring_pop(&st->d->blocks);
+  }
+  while (st->d->short_term_blocks.size > 0) {
+    ebur128_ring_pop(&st->d->short_term_blocks);
+  }
+  st->d->published_range_stale = 1;
+  if (st->d->use_histogram) {
+    for (i = 0; i < st->d->histogram_bins; ++i) {
+      st->d->block_energy_histogram[i] = 0.0;
+      st->d->short_term_block_energy_histogram[i] = 0.0;
+    }
+    st->d->block_bins.head = 0;
+    st->d->block_bins.size = 0;
+    st->d->short_term_block_bins.head = 0;
+    st->d->short_term_block_bins.size = 0;
+  }
 }
 
-static int ebur128_calc_gating_block(ebur128_state* st, size_t frames_per_block,
-                                     double* optional_output) {
-  size_t i, c;
-  double sum = 0.0;
-  double channel_sum;
+int ebur128_start_segment(ebur128_state* st, size_t position) {
+  size_t blocks_100ms;
+  unsigned int c;
+
+  if (position % st->d->samples_in_100ms != 0) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  ebur128_clear_blocks(st);
   for (c = 0; c < st->channels; ++c) {
-    if (st->d->channel_map[c] == EBUR128_UNUSED) {
-      continue;
+    st->d->sample_peak[c] = 0.0;
+    st->d->prev_sample_peak[c] = 0.0;
+    st->d->true_peak[c] = 0.0;
+    st->d->prev_true_peak[c] = 0.0;
+  }
+  /* Short-term blocks are taken 3s into the stream and every second after
+   * that; continue the counter as a state fed from the stream start would. */
+  blocks_100ms = position / st->d->samples_in_100ms;
+  if (blocks_100ms >= 30) {
+    blocks_100ms = 20 + (blocks_100ms - 30) % 10;
+  }
+  st->d->short_term_frame_counter = blocks_100ms * st->d->samples_in_100ms;
+  return EBUR128_SUCCESS;
+}
+
+/* Counts `count` blocks in bin b of a histogram, one at a time if its
+ * history is limited. */
+static int ebur128_bin_ring_push_count(struct ebur128_bin_ring* ring,
+                                       double* histogram, size_t b,
+                                       double count) {
+  if (ring->max == 0) {
+    histogram[b] += count;
+    return EBUR128_SUCCESS;
+  }
+  for (; count > 0.0; count -= 1.0) {
+    if (ebur128_bin_ring_push(ring, histogram, b)) {
+      return EBUR128_ERROR_NOMEM;
     }
-    channel_sum = 0.0;
-    if (st->d->audio_data_index < frames_per_block * st->channels) {
-      for (i = 0; i < st->d->audio_data_index / st->channels; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Appends the blocks of src to those of dst, oldest first. src must be in
+ * histogram mode only if dst is. */
+static int ebur128_merge_blocks(ebur128_state* dst,
+                                struct ebur128_block_ring* dst_ring,
+                                struct ebur128_bin_ring* dst_bins,
+                                double* dst_histogram,
+                                const ebur128_state* src,
+                                const struct ebur128_block_ring* src_ring,
+                                const struct ebur128_bin_ring* src_bins,
+                                const double* src_histogram) {
+  struct ebur128_state_internal* d = dst->d;
+  const struct ebur128_state_internal* s = src->d;
+  size_t i, slot;
+
+  if (!s->use_histogram) {
+    for (i = 0; i < src_ring->size; ++i) {
+      slot = ebur128_ring_slot(src_ring, src_ring->first + i);
+      if (d->use_histogram
+              ? ebur128_bin_ring_push(
+                    dst_bins, dst_histogram,
+                    ebur128_histogram_index(d, src_ring->z[slot]))
+              : ebur128_ring_push(dst_ring, src_ring->z[slot])) {
+        return EBUR128_ERROR_NOMEM;
       }
-      for (i = st->d->audio_data_frames -
-               (frames_per_block - st->d->audio_data_index / st->channels);
-           i < st->d->audio_data_frames; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
+    }
+  } else if (src_bins->max != 0) {
+    /* A limited history keeps every block of the histogram in order. */
+    for (i = 0, slot = src_bins->head; i < src_bins->size; ++i) {
+      double z = s->histogram_energies[src_bins->bin[slot]];
+      if (ebur128_bin_ring_push(dst_bins, dst_histogram,
+                                ebur128_histogram_index(d, z))) {
+        return EBUR128_ERROR_NOMEM;
       }
-    } else {
-      for (i = st->d->audio_data_index / st->channels - frames_per_block;
-           i < st->d->audio_data_index / st->channels; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
+      if (++slot == src_bins->capacity) {
+        slot = 0;
+      }
+    }
+  } else {
+    for (i = 0; i < s->histogram_bins; ++i) {
+      if (src_histogram[i] > 0.0 &&
+          ebur128_bin_ring_push_count(
+              dst_bins, dst_histogram,
+              ebur128_histogram_index(d, s->histogram_energies[i]),
+              src_histogram[i])) {
+        return EBUR128_ERROR_NOMEM;
       }
     }
-    if (st->d->channel_map[c] == EBUR128_Mp110 ||
-        st->d->channel_map[c] == EBUR128_Mm110 ||
-        st->d->channel_map[c] == EBUR128_Mp060 ||
-        st->d->channel_map[c] == EBUR128_Mm060 ||
-        st->d->channel_map[c] == EBUR128_Mp090 ||
-        st->d->channel_map[c] == EBUR128_Mm090) {
-      channel_sum *= 1.41;
-    } else if (st->d->channel_map[c] == EBUR128_DUAL_MONO) {
-      channel_sum *= 2.0;
+  }
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_merge(ebur128_state* dst, const ebur128_state* src) {
+  int peaks = (dst->mode & EBUR128_MODE_SAMPLE_PEAK) ==
+                  EBUR128_MODE_SAMPLE_PEAK &&
+              (src->mode & EBUR128_MODE_SAMPLE_PEAK) ==
+                  EBUR128_MODE_SAMPLE_PEAK;
+  int true_peaks = (dst->mode & EBUR128_MODE_TRUE_PEAK) ==
+                       EBUR128_MODE_TRUE_PEAK &&
+                   (src->mode & EBUR128_MODE_TRUE_PEAK) ==
+                       EBUR128_MODE_TRUE_PEAK;
+  unsigned int c;
+
+  if (dst == src || (src->d->use_histogram && !dst->d->use_histogram) ||
+      (peaks && dst->channels != src->channels)) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if ((dst->mode & EBUR128_MODE_I) == EBUR128_MODE_I &&
+      ebur128_merge_blocks(dst, &dst->d->blocks, &dst->d->block_bins,
+                           dst->d->block_energy_histogram, src,
+                           &src->d->blocks, &src->d->block_bins,
+                           src->d->block_energy_histogram)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if ((dst->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA &&
+      ebur128_merge_blocks(dst, &dst->d->short_term_blocks,
+                           &dst->d->short_term_block_bins,
+                           dst->d->short_term_block_energy_histogram, src,
+                           &src->d->short_term_blocks,
+                           &src->d->short_term_block_bins,
+                           src->d->short_term_block_energy_histogram)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  dst->d->published_range_stale = 1;
+  for (c = 0; peaks && c < dst->channels; ++c) {
+    dst->d->sample_peak[c] =
+        EBUR128_MAX(dst->d->sample_peak[c], src->d->sample_peak[c]);
+    if (true_peaks) {
+      dst->d->true_peak[c] =
+          EBUR128_MAX(dst->d->true_peak[c], src->d->true_peak[c]);
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Largest number of histogram bins, 0.0001 LU over 100 LU. */
+#define EBUR128_HISTOGRAM_MAX_BINS 1000000
+
+int ebur128_set_histogram_resolution(ebur128_state* st, double resolution,
+                                     double min_loudness,
+                                     double max_loudness) {
+  double bins;
+
+  if (!st->d->use_histogram || !(resolution > 0.0) ||
+      !(max_loudness > min_loudness)) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  /* Round up to whole bins, allowing for rounding in the division. */
+  bins = ceil((max_loudness - min_loudness) / resolution - 1e-9);
+  if (bins > EBUR128_HISTOGRAM_MAX_BINS) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (min_loudness == st->d->histogram_min &&
+      resolution == st->d->histogram_step &&
+      (size_t)bins == st->d->histogram_bins) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  st->d->published_range_stale = 1;
+  return ebur128_alloc_histogram(st, min_loudness, resolution, (size_t)bins,
+                                 NULL);
+}
+
+#define EBUR128_SNAPSHOT_VERSION 3
+
+/* Appends to a snapshot, or only counts its size if p is NULL. */
+struct ebur128_writer {
+  unsigned char* p;
+  size_t size;
+};
+
+/* Reads a snapshot, or only checks it if `apply` is 0. */
+struct ebur128_reader {
+  const unsigned char* p;
+  size_t left;
+  int apply;
+  int error;
+};
+
+static void ebur128_put_bytes(struct ebur128_writer* w, const void* src,
+                              size_t bytes) {
+  if (w->p) {
+    memcpy(w->p + w->size, src, bytes);
+  }
+  w->size += bytes;
+}
+
+/* Writes an unsigned integer of `bytes` bytes, little endian. */
+static void ebur128_put_uint(struct ebur128_writer* w, size_t value,
+                             size_t bytes) {
+  size_t i;
+
+  for (i = 0; i < bytes; ++i) {
+    if (w->p) {
+      w->p[w->size] = (unsigned char)(value & 0xff);
+    }
+    ++w->size;
+    value >>= 8;
+  }
+}
+
+/* Doubles are written in native byte order; the header holds 1.0 to detect
+ * a different one. */
+static void ebur128_put_doubles(struct ebur128_writer* w, const double* src,
+                                size_t count) {
+  ebur128_put_bytes(w, src, count * sizeof(double));
+}
+
+/* Consumes `bytes` bytes, copying them to dst unless it is NULL. */
+static void ebur128_get_bytes(struct ebur128_reader* r, void* dst,
+                              size_t bytes) {
+  if (r->error || bytes > r->left) {
+    r->error = 1;
+    return;
+  }
+  if (dst) {
+    memcpy(dst, r->p, bytes);
+  }
+  r->p += bytes;
+  r->left -= bytes;
+}
+
+static size_t ebur128_get_uint(struct ebur128_reader* r, size_t bytes) {
+  unsigned char buffer[8];
+  size_t value = 0;
+  size_t i;
+
+  ebur128_get_bytes(r, buffer, bytes);
+  if (r->error) {
+    return 0;
+  }
+  for (i = bytes; i-- > 0;) {
+    if (value >> (sizeof(size_t) * 8 - 8)) {
+      r->error = 1;
+      return 0;
+    }
+    value = value << 8 | buffer[i];
+  }
+  return value;
+}
+
+/* Reads `count` doubles into dst, if the snapshot is being applied. */
+static void ebur128_get_doubles(struct ebur128_reader* r, double* dst,
+                                size_t count) {
+  if (count > r->left / sizeof(double)) {
+    r->error = 1;
+    return;
+  }
+  ebur128_get_bytes(r, r->apply ? dst : NULL, count * sizeof(double));
+}
+
+/* Writes the energies of a ring from serial number `base` on. The treap
+ * and its sums depend only on the stored energies, so they are rebuilt
+ * rather than written. */
+static void ebur128_write_ring(struct ebur128_writer* w,
+                               const struct ebur128_block_ring* ring,
+                               size_t base) {
+  size_t total = ring->first + ring->size;
+  size_t start = EBUR128_MAX(base, ring->first);
+  size_t serial;
+
+  ebur128_put_uint(w, base, 8);
+  ebur128_put_uint(w, ring->first, 8);
+  ebur128_put_uint(w, total - start, 8);
+  for (serial = start; serial < total; ++serial) {
+    ebur128_put_doubles(w, &ring->z[ebur128_ring_slot(ring, serial)], 1);
+  }
+}
+
+/* Reads a ring written by ebur128_write_ring(). An incremental snapshot
+ * must continue where the ring ends. */
+static int ebur128_read_ring(struct ebur128_reader* r,
+                             struct ebur128_block_ring* ring,
+                             int incremental) {
+  size_t base = ebur128_get_uint(r, 8);
+  size_t first = ebur128_get_uint(r, 8);
+  size_t count = ebur128_get_uint(r, 8);
+  size_t start = EBUR128_MAX(base, first);
+  size_t i;
+  double z;
+
+  if (r->error || (incremental && base != ring->first + ring->size) ||
+      count > r->left / sizeof(double) || first > start + count) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (r->apply && (!incremental || start > base)) {
+    while (ring->size > 0) {
+      ebur128_ring_pop(ring);
+    }
+    ring->first = start;
+  }
+  for (i = 0; i < count; ++i) {
+    ebur128_get_doubles(r, &z, 1);
+    if (r->apply && ebur128_ring_push(ring, z)) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  if (r->apply) {
+    while (ring->size > 0 && ring->first < first) {
+      ebur128_ring_pop(ring);
+    }
+    if (ring->size == 0) {
+      ring->first = first;
+    }
+  }
+  return r->error ? EBUR128_ERROR_INVALID_MODE : EBUR128_SUCCESS;
+}
+
+/* Writes the bins of a ring, oldest first. */
+static void ebur128_write_bin_ring(struct ebur128_writer* w,
+                                   const struct ebur128_bin_ring* ring) {
+  size_t i, slot;
+
+  ebur128_put_uint(w, ring->size, 8);
+  for (i = 0, slot = ring->head; i < ring->size; ++i) {
+    ebur128_put_uint(w, ring->bin[slot], 4);
+    if (++slot == ring->capacity) {
+      slot = 0;
+    }
+  }
+}
+
+/* Reads the bins of a ring of at most `max` blocks into an emptied ring,
+ * counting them in histogram. */
+static int ebur128_read_bin_ring(struct ebur128_reader* r,
+                                 struct ebur128_bin_ring* ring,
+                                 double* histogram, size_t bins,
+                                 unsigned long max) {
+  size_t size = ebur128_get_uint(r, 8);
+  size_t i, b;
+
+  if (r->error || size > max || size > r->left / 4) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (r->apply) {
+    ring->head = 0;
+    ring->size = 0;
+  }
+  for (i = 0; i < size; ++i) {
+    b = ebur128_get_uint(r, 4);
+    if (b >= bins) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
+    if (r->apply && ebur128_bin_ring_push(ring, histogram, b)) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  return r->error ? EBUR128_ERROR_INVALID_MODE : EBUR128_SUCCESS;
+}
+
+/* Writes the last `frames` frames of audio_data before audio_data_index,
+ * oldest first: those written since the previous snapshot if incremental,
+ * else the whole window. */
+static void ebur128_write_audio_data(struct ebur128_writer* w,
+                                     ebur128_state* st, int incremental) {
+  struct ebur128_state_internal* d = st->d;
+  size_t frames = d->audio_data_frames;
+  size_t written = frames;
+  size_t start, part;
+
+  if (incremental && d->snapshot_frames < frames) {
+    written = d->snapshot_frames;
+  } else {
+    ebur128_clear_audio_data(st, 0);
+  }
+  start = (d->audio_data_index / st->channels + frames - written) % frames;
+  part = EBUR128_MAX(start + written, frames) - frames;
+  ebur128_put_uint(w, written, 8);
+  ebur128_put_doubles(w, d->audio_data + start * st->channels,
+                      (written - part) * st->channels);
+  ebur128_put_doubles(w, d->audio_data, part * st->channels);
+}
+
+static void ebur128_write_snapshot(ebur128_state* st,
+                                   struct ebur128_writer* w,
+                                   int incremental) {
+  struct ebur128_state_internal* d = st->d;
+  const double one = 1.0;
+  unsigned int c;
+
+  ebur128_put_bytes(w, "EBUR128S", 8);
+  ebur128_put_uint(w, EBUR128_SNAPSHOT_VERSION, 4);
+  ebur128_put_uint(w, incremental != 0, 1);
+  ebur128_put_uint(w, st->channels, 4);
+  ebur128_put_uint(w, st->samplerate, 4);
+  ebur128_put_uint(w, (size_t)st->mode, 4);
+  ebur128_put_doubles(w, &one, 1);
+
+  ebur128_put_uint(w, d->window, 8);
+  ebur128_put_uint(w, d->history, 8);
+  ebur128_put_uint(w, d->audio_data_frames, 8);
+  ebur128_put_uint(w, d->audio_data_index, 8);
+  ebur128_put_uint(w, d->needed_frames, 8);
+  ebur128_put_uint(w, d->short_term_frame_counter, 8);
+  ebur128_put_uint(w, d->sub_block_count, 8);
+  ebur128_put_uint(w, d->sub_block_index, 8);
+  for (c = 0; c < st->channels; ++c) {
+    ebur128_put_uint(w, (size_t)d->channel_map[c], 4);
+    ebur128_put_doubles(w, d->v[c], FILTER_STATE_SIZE);
+  }
+  if (d->audio_data) {
+    ebur128_write_audio_data(w, st, incremental);
+  }
+  ebur128_put_doubles(w, d->sub_block_energy, d->sub_block_count);
+  ebur128_put_doubles(w, d->sample_peak, st->channels);
+  ebur128_put_doubles(w, d->prev_sample_peak, st->channels);
+  ebur128_put_doubles(w, d->true_peak, st->channels);
+  ebur128_put_doubles(w, d->prev_true_peak, st->channels);
+  ebur128_put_uint(w, (size_t)d->reset_prev_peaks, 1);
+  if (d->interp) {
+    ebur128_put_uint(w, d->interp->zi, 4);
+    for (c = 0; c < st->channels; ++c) {
+      ebur128_put_bytes(w, d->interp->z[c],
+                        d->interp->delay * sizeof(float));
+      ebur128_put_doubles(w, d->interp->line[c], d->interp->delay - 1);
+    }
+  }
+
+  if (d->use_histogram) {
+    ebur128_put_doubles(w, &d->histogram_min, 1);
+    ebur128_put_doubles(w, &d->histogram_step, 1);
+    ebur128_put_uint(w, d->histogram_bins, 8);
+    ebur128_write_bin_ring(w, &d->block_bins);
+    ebur128_write_bin_ring(w, &d->short_term_block_bins);
+    ebur128_put_doubles(w, d->block_energy_histogram, d->histogram_bins);
+    ebur128_put_doubles(w, d->short_term_block_energy_histogram,
+                        d->histogram_bins);
+  }
+  ebur128_write_ring(w, &d->blocks, incremental ? d->snapshot_blocks : 0);
+  ebur128_write_ring(w, &d->short_term_blocks,
+                     incremental ? d->snapshot_short_term_blocks : 0);
+}
+
+int ebur128_snapshot(ebur128_state* st, int incremental,
+                     unsigned char* buffer, size_t* size) {
+  struct ebur128_writer w;
+
+  w.p = NULL;
+  w.size = 0;
+  ebur128_write_snapshot(st, &w, incremental);
+  if (!buffer || *size < w.size) {
+    *size = w.size;
+    return EBUR128_ERROR_NOMEM;
+  }
+  w.p = buffer;
+  w.size = 0;
+  ebur128_write_snapshot(st, &w, incremental);
+  *size = w.size;
+  st->d->snapshot_blocks = st->d->blocks.first + st->d->blocks.size;
+  st->d->snapshot_short_term_blocks =
+      st->d->short_term_blocks.first + st->d->short_term_blocks.size;
+  st->d->snapshot_frames = 0;
+  return EBUR128_SUCCESS;
+}
+
+/* Reads the frames written by ebur128_write_audio_data() into a window of
+ * `frames` frames ending at `index`. Fewer frames than the window must
+ * continue the window of st, as restored from the previous snapshot. */
+static int ebur128_read_audio_data(struct ebur128_reader* r,
+                                   ebur128_state* st, size_t frames,
+                                   size_t index, int incremental) {
+  struct ebur128_state_internal* d = st->d;
+  size_t written = ebur128_get_uint(r, 8);
+  size_t start, part;
+
+  if (r->error || written > frames) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  /* The state is only checked before it is changed. */
+  if (written < frames &&
+      (!incremental ||
+       (!r->apply && (d->audio_data_frames != frames ||
+                      d->audio_data_fill != frames ||
+                      (d->audio_data_index / st->channels + written) %
+                              frames !=
+                          index / st->channels % frames)))) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  start = (index / st->channels + frames - written) % frames;
+  part = EBUR128_MAX(start + written, frames) - frames;
+  ebur128_get_doubles(r, r->apply ? d->audio_data + start * st->channels
+                                  : NULL,
+                      (written - part) * st->channels);
+  ebur128_get_doubles(r, d->audio_data, part * st->channels);
+  return r->error ? EBUR128_ERROR_INVALID_MODE : EBUR128_SUCCESS;
+}
+
+/* Reads a snapshot into st. Every value is checked with r->apply == 0
+ * before the same snapshot is read again to change st. */
+static int ebur128_read_snapshot(ebur128_state* st,
+                                 struct ebur128_reader* r) {
+  struct ebur128_state_internal* d = st->d;
+  char magic[8];
+  double one = 0.0;
+  size_t window, history, frames, index, needed, counter, sub_blocks;
+  size_t sub_block_index, channel, window_frames, reset_prev_peaks;
+  size_t bins = 0;
+  unsigned long max_window;
+  double histogram_min = 0.0, histogram_step = 0.0;
+  int incremental, errcode;
+  unsigned int c;
+
+  ebur128_get_bytes(r, magic, 8);
+  if (r->error || memcmp(magic, "EBUR128S", 8) != 0 ||
+      ebur128_get_uint(r, 4) != EBUR128_SNAPSHOT_VERSION) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  incremental = (int)ebur128_get_uint(r, 1);
+  if (ebur128_get_uint(r, 4) != st->channels ||
+      ebur128_get_uint(r, 4) != st->samplerate ||
+      ebur128_get_uint(r, 4) != (size_t)st->mode) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  ebur128_get_bytes(r, &one, sizeof(double));
+  if (r->error || one != 1.0) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  window = ebur128_get_uint(r, 8);
+  history = ebur128_get_uint(r, 8);
+  frames = ebur128_get_uint(r, 8);
+  index = ebur128_get_uint(r, 8);
+  needed = ebur128_get_uint(r, 8);
+  counter = ebur128_get_uint(r, 8);
+  sub_blocks = ebur128_get_uint(r, 8);
+  sub_block_index = ebur128_get_uint(r, 8);
+  max_window = (unsigned long)window;
+  if (r->error || (unsigned long)window != window ||
+      (unsigned long)history != history ||
+      ebur128_window_frames(st, &max_window, &window_frames) ||
+      max_window != window || window_frames != frames ||
+      frames > ((size_t)-1) / sizeof(double) / st->channels ||
+      index > frames * st->channels || index % st->channels != 0 ||
+      needed > 4 * d->samples_in_100ms ||
+      counter > 30 * d->samples_in_100ms ||
+      sub_blocks != frames / d->samples_in_100ms + 1 ||
+      sub_block_index >= sub_blocks) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (r->apply) {
+    if (ebur128_set_max_window(st, max_window) == EBUR128_ERROR_NOMEM) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    ebur128_set_max_history(st, (unsigned long)history);
+    d->audio_data_index = index;
+    /* audio_data is read in full below, or continues the window restored
+     * before. */
+    d->audio_data_fill = frames;
+    d->audio_data_zeroed = frames;
+    d->needed_frames = (unsigned long)needed;
+    d->short_term_frame_counter = counter;
+    d->sub_block_index = sub_block_index;
+  }
+  for (c = 0; c < st->channels; ++c) {
+    channel = ebur128_get_uint(r, 4);
+    if (r->error || channel > EBUR128_Bm045) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
+    if (r->apply) {
+      d->channel_map[c] = (int)channel;
     }
-    sum += channel_sum;
+    ebur128_get_doubles(r, d->v[c], FILTER_STATE_SIZE);
   }
-
-  sum /= (double)frames_per_block;
-
-  if (optional_output) {
-    *optional_output = sum;
-    return EBUR128_SUCCESS;
+  if (!(st->mode & EBUR128_MODE_LOW_MEMORY)) {
+    errcode = ebur128_read_audio_data(r, st, frames, index, incremental);
+    if (errcode) {
+      return errcode;
+    }
+  }
+  ebur128_get_doubles(r, d->sub_block_energy, sub_blocks);
+  ebur128_get_doubles(r, d->sample_peak, st->channels);
+  ebur128_get_doubles(r, d->prev_sample_peak, st->channels);
+  ebur128_get_doubles(r, d->true_peak, st->channels);
+  ebur128_get_doubles(r, d->prev_true_peak, st->channels);
+  reset_prev_peaks = ebur128_get_uint(r, 1);
+  if (reset_prev_peaks > 1) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (r->apply) {
+    d->reset_prev_peaks = (int)reset_prev_peaks;
+  }
+  if (d->interp) {
+    index = ebur128_get_uint(r, 4);
+    if (index >= d->interp->delay) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
+    if (r->apply) {
+      d->interp->zi = (unsigned int)index;
+    }
+    for (c = 0; c < st->channels; ++c) {
+      ebur128_get_bytes(r, r->apply ? d->interp->z[c] : NULL,
+                        d->interp->delay * sizeof(float));
+      ebur128_get_doubles(r, d->interp->line[c], d->interp->delay - 1);
+    }
+  }
+  if (r->error) {
+    return EBUR128_ERROR_INVALID_MODE;
   }
 
-  if (sum >= histogram_energy_boundaries[0]) {
-    if (st->d->use_histogram) {
-      ++st->d->block_energy_histogram[find_histogram_index(sum)];
-    } else {
-      struct ebur128_dq_entry* block;
-      if (st->d->block_list_size == st->d->block_list_max) {
-        block = STAILQ_FIRST(&st->d->block_list);
-        STAILQ_REMOVE_HEAD(&st->d->block_list, entries);
-      } else {
-        block =
-            (struct ebur128_dq_entry*)malloc(sizeof(struct ebur128_dq_entry));
-        if (!block) {
-          return EBUR128_ERROR_NOMEM;
-        }
-        st->d->block_list_size++;
+  if (d->use_histogram) {
+    unsigned long max = history != ULONG_MAX ? (unsigned long)history : 0;
+
+    ebur128_get_bytes(r, &histogram_min, sizeof(double));
+    ebur128_get_bytes(r, &histogram_step, sizeof(double));
+    bins = ebur128_get_uint(r, 8);
+    if (r->error || bins == 0 || bins > EBUR128_HISTOGRAM_MAX_BINS ||
+        !(histogram_step > 0.0)) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
+    if (r->apply && (histogram_min != d->histogram_min ||
+                     histogram_step != d->histogram_step ||
+                     bins != d->histogram_bins)) {
+      ebur128_free_part(d, d->block_energy_histogram);
+      d->block_energy_histogram = NULL;
+      errcode = ebur128_alloc_histogram(st, histogram_min, histogram_step,
+                                        bins, NULL);
+      if (errcode) {
+        return errcode;
       }
-      block->z = sum;
-      STAILQ_INSERT_TAIL(&st->d->block_list, block, entries);
     }
+    /* Pushing the bins counts them again; the histograms read afterwards
+     * replace those counts. */
+    errcode = ebur128_read_bin_ring(r, &d->block_bins,
+                                    d->block_energy_histogram, bins,
+                                    max / 100);
+    if (!errcode) {
+      errcode = ebur128_read_bin_ring(r, &d->short_term_block_bins,
+                                      d->short_term_block_energy_histogram,
+                                      bins, max / 3000);
+    }
+    if (errcode) {
+      return errcode;
+    }
+    ebur128_get_doubles(r, d->block_energy_histogram, bins);
+    ebur128_get_doubles(r, d->short_term_block_energy_histogram, bins);
   }
-
-  return EBUR128_SUCCESS;
+  errcode = ebur128_read_ring(r, &d->blocks, incremental);
+  if (!errcode) {
+    errcode = ebur128_read_ring(r, &d->short_term_blocks, incremental);
+  }
+  if (!errcode && r->left != 0) {
+    errcode = EBUR128_ERROR_INVALID_MODE;
+  }
+  return errcode;
 }
 
-int ebur128_set_channel(ebur128_state* st, unsigned int channel_number,
-                        int value) {
-  if (channel_number >= st->channels) {
-    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+int ebur128_restore(ebur128_state* st, const unsigned char* buffer,
+                    size_t size) {
+  struct ebur128_reader r;
+  int errcode;
+
+  r.p = buffer;
+  r.left = size;
+  r.apply = 0;
+  r.error = 0;
+  errcode = ebur128_read_snapshot(st, &r);
+  if (errcode) {
+    return errcode;
   }
-  if (value == EBUR128_DUAL_MONO &&
-      (st->channels != 1 || channel_number != 0)) {
-    fprintf(stderr, "EBUR128_DUAL_MONO only works with mono files!\n");
-    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  r.p = buffer;
+  r.left = size;
+  r.apply = 1;
+  errcode = ebur128_read_snapshot(st, &r);
+  if (errcode) {
+    return errcode;
   }
-  st->d->channel_map[channel_number] = value;
+  st->d->published_range_stale = 1;
+  st->d->snapshot_blocks = st->d->blocks.first + st->d->blocks.size;
+  st->d->snapshot_short_term_blocks =
+      st->d->short_term_blocks.first + st->d->short_term_blocks.size;
+  st->d->snapshot_frames = 0;
   return EBUR128_SUCCESS;
 }
 
-int ebur128_change_parameters(ebur128_state* st, unsigned int channels,
-                              unsigned long samplerate) {
-  int errcode = EBUR128_SUCCESS;
-  size_t j;
+#define EBUR128_SUMMARY_VERSION 1
+#define EBUR128_SUMMARY_MODES                                          \
+  (EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK | \
+   EBUR128_MODE_TRUE_PEAK)
 
-  /* This is needed to suppress a clang-tidy warning. */
-#ifndef __has_builtin
-#define __has_builtin(x) 0
-#endif
-#if __has_builtin(__builtin_unreachable)
-  if (st->channels == 0) {
-    __builtin_unreachable();
+/** Number and sum of block energies per bin of ebur128_energy_bin(). */
+struct ebur128_distribution {
+  double count[EBUR128_BIN_COUNT];
+  double sum[EBUR128_BIN_COUNT];
+};
+
+/* Adds the blocks of a ring, or of a histogram in histogram mode, to dist. */
+static void ebur128_distribution_add_blocks(
+    struct ebur128_distribution* dist, const struct ebur128_state_internal* d,
+    const struct ebur128_block_ring* ring, const double* histogram) {
+  size_t b, serial;
+
+  if (d->use_histogram) {
+    for (b = 0; b < d->histogram_bins; ++b) {
+      if (histogram[b] > 0.0) {
+        size_t bin = ebur128_energy_bin(d->histogram_energies[b]);
+        dist->count[bin] += histogram[b];
+        dist->sum[bin] += histogram[b] * d->histogram_energies[b];
+      }
+    }
+    return;
   }
-#endif
+  for (serial = ring->first; serial < ring->first + ring->size; ++serial) {
+    double z = ring->z[ebur128_ring_slot(ring, serial)];
+    b = ebur128_energy_bin(z);
+    dist->count[b] += 1.0;
+    dist->sum[b] += z;
+  }
+}
 
-  VALIDATE_CHANNELS_AND_SAMPLERATE(EBUR128_ERROR_NOMEM);
+/* Writes the bins of dist that hold blocks: index, count and energy sum. */
+static void ebur128_write_distribution(
+    struct ebur128_writer* w, const struct ebur128_distribution* dist) {
+  size_t b, used = 0;
 
-  if (channels == st->channels && samplerate == st->samplerate) {
-    return EBUR128_ERROR_NO_CHANGE;
+  for (b = 0; b < EBUR128_BIN_COUNT; ++b) {
+    used += dist->count[b] > 0.0;
+  }
+  ebur128_put_uint(w, used, 2);
+  for (b = 0; b < EBUR128_BIN_COUNT; ++b) {
+    if (dist->count[b] > 0.0) {
+      ebur128_put_uint(w, b, 2);
+      ebur128_put_uint(w, (size_t)dist->count[b], 4);
+      ebur128_put_doubles(w, &dist->sum[b], 1);
+    }
   }
+}
 
-  free(st->d->audio_data);
-  st->d->audio_data = NULL;
-
-  if (channels != st->channels) {
-    unsigned int i;
-
-    free(st->d->channel_map);
-    st->d->channel_map = NULL;
-    free(st->d->sample_peak);
-    st->d->sample_peak = NULL;
-    free(st->d->prev_sample_peak);
-    st->d->prev_sample_peak = NULL;
-    free(st->d->true_peak);
-    st->d->true_peak = NULL;
-    free(st->d->prev_true_peak);
-    st->d->prev_true_peak = NULL;
-    st->channels = channels;
-
-    errcode = ebur128_init_channel_map(st);
-    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
-
-    st->d->sample_peak = (double*)malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->sample_peak, EBUR128_ERROR_NOMEM, exit)
-    st->d->prev_sample_peak = (double*)malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->prev_sample_peak, EBUR128_ERROR_NOMEM, exit)
-    st->d->true_peak = (double*)malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->true_peak, EBUR128_ERROR_NOMEM, exit)
-    st->d->prev_true_peak = (double*)malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->prev_true_peak, EBUR128_ERROR_NOMEM, exit)
-    for (i = 0; i < channels; ++i) {
-      st->d->sample_peak[i] = 0.0;
-      st->d->prev_sample_peak[i] = 0.0;
-      st->d->true_peak[i] = 0.0;
-      st->d->prev_true_peak[i] = 0.0;
+/* Adds a distribution written by ebur128_write_distribution() to dist, if
+ * it is not NULL. */
+static void ebur128_read_distribution(struct ebur128_reader* r,
+                                      struct ebur128_distribution* dist) {
+  size_t used = ebur128_get_uint(r, 2);
+  size_t i, b, count;
+  double sum;
+
+  for (i = 0; i < used && !r->error; ++i) {
+    b = ebur128_get_uint(r, 2);
+    count = ebur128_get_uint(r, 4);
+    ebur128_get_bytes(r, &sum, sizeof(double));
+    if (b >= EBUR128_BIN_COUNT) {
+      r->error = 1;
+    } else if (dist && !r->error) {
+      dist->count[b] += (double)count;
+      dist->sum[b] += sum;
     }
   }
-  if (samplerate != st->samplerate) {
-    st->samplerate = samplerate;
-    st->d->samples_in_100ms = (st->samplerate + 5) / 10;
+}
+
+static void ebur128_write_summary_data(ebur128_state* st,
+                                       struct ebur128_writer* w,
+                                       struct ebur128_distribution* dist) {
+  struct ebur128_state_internal* d = st->d;
+  const double one = 1.0;
+  double sample_peak = 0.0, true_peak = 0.0;
+  unsigned int c;
+
+  for (c = 0; c < st->channels; ++c) {
+    sample_peak = EBUR128_MAX(sample_peak, d->sample_peak[c]);
+    true_peak = EBUR128_MAX(true_peak,
+                            EBUR128_MAX(d->true_peak[c], d->sample_peak[c]));
   }
+  ebur128_put_bytes(w, "EBUR128P", 8);
+  ebur128_put_uint(w, EBUR128_SUMMARY_VERSION, 4);
+  ebur128_put_uint(w, (size_t)(st->mode & EBUR128_SUMMARY_MODES), 4);
+  ebur128_put_doubles(w, &one, 1);
+  ebur128_put_doubles(w, &sample_peak, 1);
+  ebur128_put_doubles(w, &true_peak, 1);
+
+  memset(dist, 0, sizeof(*dist));
+  ebur128_distribution_add_blocks(dist, d, &d->blocks,
+                                  d->block_energy_histogram);
+  ebur128_write_distribution(w, dist);
+  memset(dist, 0, sizeof(*dist));
+  ebur128_distribution_add_blocks(dist, d, &d->short_term_blocks,
+                                  d->short_term_block_energy_histogram);
+  ebur128_write_distribution(w, dist);
+}
 
-  /* If we're here, either samplerate or channels
-   * have changed. Re-init filter. */
-  free(st->d->v);
-  st->d->v = NULL;
-  errcode = ebur128_init_filter(st);
-  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+int ebur128_summary(ebur128_state* st, unsigned char* buffer, size_t* size) {
+  struct ebur128_distribution dist;
+  struct ebur128_writer w;
 
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
-    /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames =
-        (st->d->audio_data_frames + st->d->samples_in_100ms) -
-        (st->d->audio_data_frames % st->d->samples_in_100ms);
+  w.p = NULL;
+  w.size = 0;
+  ebur128_write_summary_data(st, &w, &dist);
+  if (!buffer || *size < w.size) {
+    *size = w.size;
+    return EBUR128_ERROR_NOMEM;
+  }
+  w.p = buffer;
+  w.size = 0;
+  ebur128_write_summary_data(st, &w, &dist);
+  *size = w.size;
+  return EBUR128_SUCCESS;
+}
+
+/* Reads the header of a summary and adds its peaks to *sample_peak and
+ * *true_peak and its gating or short-term blocks to dist, as `short_term`
+ * selects. The summary must have been measured with `mode`. */
+static int ebur128_read_summary(const unsigned char* summary, size_t size,
+                                int mode, double* sample_peak,
+                                double* true_peak, int short_term,
+                                struct ebur128_distribution* dist) {
+  struct ebur128_reader r;
+  char magic[8];
+  double one = 0.0, peak = 0.0, true_peak_value = 0.0;
+
+  r.p = summary;
+  r.left = size;
+  r.apply = 1;
+  r.error = 0;
+  ebur128_get_bytes(&r, magic, 8);
+  if (r.error || memcmp(magic, "EBUR128P", 8) != 0 ||
+      ebur128_get_uint(&r, 4) != EBUR128_SUMMARY_VERSION ||
+      (ebur128_get_uint(&r, 4) & (size_t)mode) != (size_t)mode) {
+    return EBUR128_ERROR_INVALID_MODE;
   }
-  st->d->audio_data =
-      (double*)malloc(st->d->audio_data_frames * st->channels * sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, EBUR128_ERROR_NOMEM, exit)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
+  ebur128_get_bytes(&r, &one, sizeof(double));
+  ebur128_get_bytes(&r, &peak, sizeof(double));
+  ebur128_get_bytes(&r, &true_peak_value, sizeof(double));
+  ebur128_read_distribution(&r, short_term ? NULL : dist);
+  ebur128_read_distribution(&r, short_term ? dist : NULL);
+  if (r.error || r.left != 0 || one != 1.0) {
+    return EBUR128_ERROR_INVALID_MODE;
   }
+  *sample_peak = EBUR128_MAX(*sample_peak, peak);
+  *true_peak = EBUR128_MAX(*true_peak, true_peak_value);
+  return EBUR128_SUCCESS;
+}
 
-  ebur128_destroy_resampler(st);
-  errcode = ebur128_init_resampler(st);
-  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+/* Sums the blocks of dist whose bin has a mean energy of at least
+ * `threshold`, from bin *begin on. *begin is set to the first such bin. */
+static void ebur128_distribution_sum_above(
+    const struct ebur128_distribution* dist, double threshold, size_t* begin,
+    double* count, double* sum) {
+  size_t b;
+
+  *count = 0.0;
+  *sum = 0.0;
+  while (*begin < EBUR128_BIN_COUNT &&
+         !(dist->count[*begin] > 0.0 &&
+           dist->sum[*begin] >= threshold * dist->count[*begin])) {
+    ++*begin;
+  }
+  for (b = *begin; b < EBUR128_BIN_COUNT; ++b) {
+    *count += dist->count[b];
+    *sum += dist->sum[b];
+  }
+}
 
-  /* the first block needs 400ms of audio data */
-  st->d->needed_frames = st->d->samples_in_100ms * 4;
-  /* start at the beginning of the buffer */
-  st->d->audio_data_index = 0;
-  /* reset short term frame counter */
-  st->d->short_term_frame_counter = 0;
+int ebur128_summary_loudness_global(const unsigned char* const* summaries,
+                                    const size_t* sizes, size_t size,
+                                    double* out) {
+  struct ebur128_distribution dist;
+  double sample_peak = 0.0, true_peak = 0.0, count, sum;
+  size_t i, begin = 0;
 
-exit:
-  return errcode;
+  memset(&dist, 0, sizeof(dist));
+  for (i = 0; i < size; ++i) {
+    if (ebur128_read_summary(summaries[i], sizes[i], EBUR128_MODE_I,
+                             &sample_peak, &true_peak, 0, &dist)) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
+  }
+  ebur128_distribution_sum_above(&dist, 0.0, &begin, &count, &sum);
+  if (count == 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  ebur128_distribution_sum_above(&dist, relative_gate_factor * sum / count,
+                                 &begin, &count, &sum);
+  if (count == 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  *out = ebur128_energy_to_loudness(sum / count);
+  return EBUR128_SUCCESS;
 }
 
-int ebur128_set_max_window(ebur128_state* st, unsigned long window) {
-  int errcode = EBUR128_SUCCESS;
-  size_t j;
+/* Returns the mean energy of the bin of the block at `rank` among the blocks
+ * from bin `begin` on. */
+static double ebur128_distribution_nth(const struct ebur128_distribution* dist,
+                                       size_t begin, double rank) {
+  double count = 0.0;
+  size_t b = begin;
 
-  if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S && window < 3000) {
-    window = 3000;
-  } else if ((st->mode & EBUR128_MODE_M) == EBUR128_MODE_M && window < 400) {
-    window = 400;
+  while (b + 1 < EBUR128_BIN_COUNT && count + dist->count[b] <= rank) {
+    count += dist->count[b++];
   }
+  return dist->sum[b] / dist->count[b];
+}
 
-  if (window == st->d->window) {
-    return EBUR128_ERROR_NO_CHANGE;
-  }
+int ebur128_summary_loudness_range(const unsigned char* const* summaries,
+                                   const size_t* sizes, size_t size,
+                                   double* out) {
+  struct ebur128_distribution dist;
+  double sample_peak = 0.0, true_peak = 0.0, count, sum;
+  double percentile_low, percentile_high;
+  size_t i, begin = 0;
 
-  size_t new_audio_data_frames;
-  if (safe_size_mul(st->samplerate, window, &new_audio_data_frames) != 0 ||
-      new_audio_data_frames > ((size_t)-1) - st->d->samples_in_100ms) {
-    return EBUR128_ERROR_NOMEM;
+  memset(&dist, 0, sizeof(dist));
+  for (i = 0; i < size; ++i) {
+    if (ebur128_read_summary(summaries[i], sizes[i], EBUR128_MODE_LRA,
+                             &sample_peak, &true_peak, 1, &dist)) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
   }
-  if (new_audio_data_frames % st->d->samples_in_100ms) {
-    /* round up to multiple of samples_in_100ms */
-    new_audio_data_frames = (new_audio_data_frames + st->d->samples_in_100ms) -
-                            (new_audio_data_frames % st->d->samples_in_100ms);
+  ebur128_distribution_sum_above(&dist, 0.0, &begin, &count, &sum);
+  if (count == 0.0) {
+    *out = 0.0;
+    return EBUR128_SUCCESS;
   }
-
-  size_t new_audio_data_size;
-  if (safe_size_mul(new_audio_data_frames, st->channels * sizeof(double),
-                    &new_audio_data_size) != 0) {
-    return EBUR128_ERROR_NOMEM;
+  ebur128_distribution_sum_above(&dist, minus_twenty_decibels * sum / count,
+                                 &begin, &count, &sum);
+  if (count == 0.0) {
+    *out = 0.0;
+    return EBUR128_SUCCESS;
   }
+  percentile_low = (double)(size_t)((count - 1) * 0.1 + 0.5);
+  percentile_high = (double)(size_t)((count - 1) * 0.95 + 0.5);
+  *out = ebur128_energy_to_loudness(
+             ebur128_distribution_nth(&dist, begin, percentile_high)) -
+         ebur128_energy_to_loudness(
+             ebur128_distribution_nth(&dist, begin, percentile_low));
+  return EBUR128_SUCCESS;
+}
 
-  double* new_audio_data = (double*)malloc(new_audio_data_size);
-  CHECK_ERROR(!new_audio_data, EBUR128_ERROR_NOMEM, exit)
+/* Returns the largest sample peak, or true peak if `true_peak` is set, of
+ * the summaries. */
+static int ebur128_summary_peak(const unsigned char* const* summaries,
+                                const size_t* sizes, size_t size,
+                                int true_peak, double* out) {
+  double sample_peaks = 0.0, true_peaks = 0.0;
+  size_t i;
 
-  st->d->window = window;
-  free(st->d->audio_data);
-  st->d->audio_data = new_audio_data;
-  st->d->audio_data_frames = new_audio_data_frames;
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
+  for (i = 0; i < size; ++i) {
+    if (ebur128_read_summary(summaries[i], sizes[i],
+                             true_peak ? EBUR128_MODE_TRUE_PEAK
+                                       : EBUR128_MODE_SAMPLE_PEAK,
+                             &sample_peaks, &true_peaks, 0, NULL)) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
   }
+  *out = true_peak ? true_peaks : sample_peaks;
+  return EBUR128_SUCCESS;
+}
 
-  /* the first block needs 400ms of audio data */
-  st->d->needed_frames = st->d->samples_in_100ms * 4;
-  /* start at the beginning of the buffer */
-  st->d->audio_data_index = 0;
-  /* reset short term frame counter */
-  st->d->short_term_frame_counter = 0;
+int ebur128_summary_sample_peak(const unsigned char* const* summaries,
+                                const size_t* sizes, size_t size,
+                                double* out) {
+  return ebur128_summary_peak(summaries, sizes, size, 0, out);
+}
 
-exit:
-  return errcode;
+int ebur128_summary_true_peak(const unsigned char* const* summaries,
+                              const size_t* sizes, size_t size, double* out) {
+  return ebur128_summary_peak(summaries, sizes, size, 1, out);
 }
 
-int ebur128_set_max_history(ebur128_state* st, unsigned long history) {
-  if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA && history < 3000) {
-    history = 3000;
-  } else if ((st->mode & EBUR128_MODE_M) == EBUR128_MODE_M && history < 400) {
-    history = 400;
+static int ebur128_energy_shortterm(ebur128_state* st, double* out);
+
+/* Publishes the measurement after a block for ebur128_published(). The
+ * values are computed first, so the sequence stays odd only while they are
+ * stored. Readers never block this thread. */
+static void ebur128_publish(ebur128_state* st) {
+  struct ebur128_state_internal* d = st->d;
+  double values[EBUR128_PUBLISHED_VALUES];
+  unsigned long sequence;
+  unsigned int c, i;
+
+  values[1] = values[2] = -HUGE_VAL;
+  values[3] = values[4] = values[5] = 0.0;
+  ebur128_loudness_momentary(st, &values[0]);
+  if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
+    ebur128_loudness_shortterm(st, &values[1]);
   }
-  if (history == st->d->history) {
-    return EBUR128_ERROR_NO_CHANGE;
+  if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I) {
+    ebur128_loudness_global(st, &values[2]);
   }
-  st->d->history = history;
-  st->d->block_list_max = st->d->history / 100;
-  st->d->st_block_list_max = st->d->history / 3000;
-  while (st->d->block_list_size > st->d->block_list_max) {
-    struct ebur128_dq_entry* block = STAILQ_FIRST(&st->d->block_list);
-    STAILQ_REMOVE_HEAD(&st->d->block_list, entries);
-    free(block);
-    st->d->block_list_size--;
-  }
-  while (st->d->st_block_list_size > st->d->st_block_list_max) {
-    struct ebur128_dq_entry* block =
-        STAILQ_FIRST(&st->d->short_term_block_list);
-    STAILQ_REMOVE_HEAD(&st->d->short_term_block_list, entries);
-    free(block);
-    st->d->st_block_list_size--;
+  if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+    /* The range only changes with the short-term blocks, once a second. */
+    if (d->published_range_stale) {
+      ebur128_loudness_range(st, &d->published_range);
+      d->published_range_stale = 0;
+    }
+    values[3] = d->published_range;
+  }
+  for (c = 0; c < st->channels; ++c) {
+    if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+      values[4] = EBUR128_MAX(values[4], d->sample_peak[c]);
+    }
+    if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+      values[5] = EBUR128_MAX(values[5], EBUR128_MAX(d->true_peak[c],
+                                                     d->sample_peak[c]));
+    }
+  }
+
+  sequence = atomic_load_explicit(&d->publish_sequence, memory_order_relaxed);
+  atomic_store_explicit(&d->publish_sequence, sequence + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (i = 0; i < EBUR128_PUBLISHED_VALUES; ++i) {
+    atomic_store_explicit(&d->published[i], values[i], memory_order_relaxed);
+  }
+  atomic_store_explicit(&d->publish_sequence, sequence + 2,
+                        memory_order_release);
+}
+
+int ebur128_published(ebur128_state* st, ebur128_measurement* out) {
+  struct ebur128_state_internal* d = st->d;
+  double values[EBUR128_PUBLISHED_VALUES];
+  unsigned long begin, end;
+  unsigned int i;
+
+  if (!(st->mode & EBUR128_MODE_PUBLISH)) {
+    return EBUR128_ERROR_INVALID_MODE;
   }
+  do {
+    begin = atomic_load_explicit(&d->publish_sequence, memory_order_acquire);
+    for (i = 0; i < EBUR128_PUBLISHED_VALUES; ++i) {
+      values[i] =
+          atomic_load_explicit(&d->published[i], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    end = atomic_load_explicit(&d->publish_sequence, memory_order_relaxed);
+  } while (begin != end || (begin & 1));
+
+  out->blocks = begin / 2;
+  out->momentary = values[0];
+  out->shortterm = values[1];
+  out->global = values[2];
+  out->range = values[3];
+  out->sample_peak = values[4];
+  out->true_peak = values[5];
   return EBUR128_SUCCESS;
 }
+/* Starts the previous peaks of a new add_frames call. The filter raises
+ * the peaks of the programme together with those of the call, so no loop
+ * over the channels is needed per call. */
+static void ebur128_reset_prev_peaks(ebur128_state* st) {
+  st->d->reset_prev_peaks = 1;
+}
 
-static int ebur128_energy_shortterm(ebur128_state* st, double* out);
-#define EBUR128_ADD_FRAMES(type)                                               \
-  int ebur128_add_frames_##type(ebur128_state* st, const type* src,            \
-                                size_t frames) {                               \
-    size_t src_index = 0;                                                      \
+/* Processes `frames` frames whose channel c starts at src[c], consecutive
+ * samples of a channel being `stride` elements apart. The pointers in src are
+ * advanced past the consumed frames. The caller resets the per-call peaks,
+ * so several runs can make up one add_frames call. Samples are `width`
+ * elements wide. */
+#define EBUR128_ADD_FRAMES(name, type, width)                                  \
+  static int ebur128_add_frames_channels_##name(                              \
+      ebur128_state* st, const type** src, size_t stride, size_t frames) {     \
     unsigned int c = 0;                                                        \
-    for (c = 0; c < st->channels; c++) {                                       \
-      st->d->prev_sample_peak[c] = 0.0;                                        \
-      st->d->prev_true_peak[c] = 0.0;                                          \
-    }                                                                          \
     while (frames > 0) {                                                       \
-      if (frames >= st->d->needed_frames) {                                    \
-        ebur128_filter_##type(st, src + src_index, st->d->needed_frames);      \
-        src_index += st->d->needed_frames * st->channels;                      \
-        frames -= st->d->needed_frames;                                        \
-        st->d->audio_data_index += st->d->needed_frames * st->channels;        \
+      /* Never filter across a 100ms sub-block boundary. */                    \
+      size_t position = st->d->audio_data_index / st->channels;                \
+      size_t chunk =                                                           \
+          st->d->samples_in_100ms - position % st->d->samples_in_100ms;        \
+      if (chunk > st->d->needed_frames) {                                      \
+        chunk = st->d->needed_frames;                                          \
+      }                                                                        \
+      if (chunk > frames) {                                                    \
+        chunk = frames;                                                        \
+      }                                                                        \
+      if (position % st->d->samples_in_100ms == 0) {                           \
+        st->d->sub_block_energy[st->d->sub_block_index] = 0.0;                \
+      }                                                                        \
+      ebur128_filter_##name(st, (const type* const*)src, stride, chunk);       \
+      for (c = 0; c < st->channels; c++) {                                     \
+        src[c] += chunk * stride;                                              \
+      }                                                                        \
+      frames -= chunk;                                                         \
+      st->d->audio_data_index += chunk * st->channels;                         \
+      if (st->d->audio_data_fill < position + chunk) {                         \
+        st->d->audio_data_fill = position + chunk;                             \
+      }                                                                        \
+      if (st->d->snapshot_frames < st->d->audio_data_frames) {                 \
+        st->d->snapshot_frames += chunk;                                       \
+      }                                                                        \
+      if ((position + chunk) % st->d->samples_in_100ms == 0 &&                 \
+          ++st->d->sub_block_index == st->d->sub_block_count) {               \
+        st->d->sub_block_index = 0;                                            \
+      }                                                                        \
+      if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {                 \
+        st->d->short_term_frame_counter += chunk;                              \
+      }                                                                        \
+      st->d->needed_frames -= (unsigned long)chunk;                            \
+      if (st->d->needed_frames == 0) {                                         \
         /* calculate the new gating block */                                   \
         if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I) {                   \
           if (ebur128_calc_gating_block(st, st->d->samples_in_100ms * 4,       \
@@ -1006,87 +4184,122 @@ static int ebur128_energy_shortterm(ebur128_state* st, double* out);
             return EBUR128_ERROR_NOMEM;                                        \
           }                                                                    \
         }                                                                      \
-        if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {               \
-          st->d->short_term_frame_counter += st->d->needed_frames;             \
-          if (st->d->short_term_frame_counter ==                               \
-              st->d->samples_in_100ms * 30) {                                  \
-            struct ebur128_dq_entry* block;                                    \
-            double st_energy;                                                  \
-            if (ebur128_energy_shortterm(st, &st_energy) == EBUR128_SUCCESS && \
-                st_energy >= histogram_energy_boundaries[0]) {                 \
-              if (st->d->use_histogram) {                                      \
-                ++st->d->short_term_block_energy_histogram                     \
-                      [find_histogram_index(st_energy)];                       \
-              } else {                                                         \
-                if (st->d->st_block_list_size == st->d->st_block_list_max) {   \
-                  block = STAILQ_FIRST(&st->d->short_term_block_list);         \
-                  STAILQ_REMOVE_HEAD(&st->d->short_term_block_list, entries);  \
-                } else {                                                       \
-                  block = (struct ebur128_dq_entry*)malloc(                    \
-                      sizeof(struct ebur128_dq_entry));                        \
-                  if (!block) {                                                \
-                    return EBUR128_ERROR_NOMEM;                                \
-                  }                                                            \
-                  st->d->st_block_list_size++;                                 \
-                }                                                              \
-                block->z = st_energy;                                          \
-                STAILQ_INSERT_TAIL(&st->d->short_term_block_list, block,       \
-                                   entries);                                   \
+        if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA &&               \
+            st->d->short_term_frame_counter ==                                 \
+                st->d->samples_in_100ms * 30) {                                \
+          double st_energy;                                                    \
+          if (ebur128_energy_shortterm(st, &st_energy) == EBUR128_SUCCESS &&   \
+              st_energy >= absolute_gate_energy) {                             \
+            if (st->d->use_histogram) {                                        \
+              if (ebur128_bin_ring_push(                                       \
+                      &st->d->short_term_block_bins,                           \
+                      st->d->short_term_block_energy_histogram,                \
+                      ebur128_histogram_index(st->d, st_energy))) {            \
+                return EBUR128_ERROR_NOMEM;                                    \
               }                                                                \
+            } else if (ebur128_ring_push(&st->d->short_term_blocks,            \
+                                         st_energy)) {                         \
+              return EBUR128_ERROR_NOMEM;                                      \
             }                                                                  \
-            st->d->short_term_frame_counter = st->d->samples_in_100ms * 20;    \
+            st->d->published_range_stale = 1;                                  \
           }                                                                    \
+          st->d->short_term_frame_counter = st->d->samples_in_100ms * 20;      \
         }                                                                      \
         /* 100ms are needed for all blocks besides the first one */            \
         st->d->needed_frames = st->d->samples_in_100ms;                        \
-        /* reset audio_data_index when buffer full */                          \
-        if (st->d->audio_data_index ==                                         \
-            st->d->audio_data_frames * st->channels) {                         \
-          st->d->audio_data_index = 0;                                         \
-        }                                                                      \
-      } else {                                                                 \
-        ebur128_filter_##type(st, src + src_index, frames);                    \
-        st->d->audio_data_index += frames * st->channels;                      \
-        if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {               \
-          st->d->short_term_frame_counter += frames;                           \
+        if (st->mode & EBUR128_MODE_PUBLISH) {                                 \
+          ebur128_publish(st);                                                 \
         }                                                                      \
-        st->d->needed_frames -= (unsigned long)frames;                         \
-        frames = 0;                                                            \
       }                                                                        \
+      /* reset audio_data_index when buffer full */                            \
+      if (st->d->audio_data_index == st->d->audio_data_frames * st->channels) { \
+        st->d->audio_data_index = 0;                                           \
+      }                                                                        \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }                                                                            \
+                                                                               \
+  int ebur128_add_frames_##name(ebur128_state* st, const type* src,            \
+                                size_t frames) {                               \
+    const type* channels[VALIDATE_MAX_CHANNELS];                               \
+    unsigned int c;                                                            \
+    for (c = 0; c < st->channels; c++) {                                       \
+      channels[c] = src + c * (width);                                         \
+    }                                                                          \
+    ebur128_reset_prev_peaks(st);                                              \
+    if (ebur128_add_frames_channels_##name(                                    \
+            st, channels, st->channels * (width), frames)) {                   \
+      return EBUR128_ERROR_NOMEM;                                              \
     }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }
+
+/* Planar and strided entry points, for the native sample types. */
+#define EBUR128_ADD_FRAMES_PLANAR(type)                                        \
+  int ebur128_add_frames_planar_##type(                                        \
+      ebur128_state* st, const type* const* src, size_t frames) {              \
+    const type* channels[VALIDATE_MAX_CHANNELS];                               \
+    unsigned int c;                                                            \
     for (c = 0; c < st->channels; c++) {                                       \
-      if (st->d->prev_sample_peak[c] > st->d->sample_peak[c]) {                \
-        st->d->sample_peak[c] = st->d->prev_sample_peak[c];                    \
+      channels[c] = src[c];                                                    \
+    }                                                                          \
+    ebur128_reset_prev_peaks(st);                                              \
+    if (ebur128_add_frames_channels_##type(st, channels, 1, frames)) {         \
+      return EBUR128_ERROR_NOMEM;                                              \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }                                                                            \
+                                                                               \
+  int ebur128_add_frames_iov_##type(                                           \
+      ebur128_state* st, const ebur128_iovec* segments, size_t segment_count,  \
+      size_t frame_stride, size_t channel_offset) {                            \
+    const type* channels[VALIDATE_MAX_CHANNELS];                               \
+    size_t s;                                                                  \
+    unsigned int c;                                                            \
+    if (channel_offset + st->channels > frame_stride) {                        \
+      return EBUR128_ERROR_INVALID_CHANNEL_INDEX;                              \
+    }                                                                          \
+    ebur128_reset_prev_peaks(st);                                              \
+    for (s = 0; s < segment_count; ++s) {                                      \
+      const type* base = (const type*)segments[s].base + channel_offset;       \
+      for (c = 0; c < st->channels; c++) {                                     \
+        channels[c] = base + c;                                                \
       }                                                                        \
-      if (st->d->prev_true_peak[c] > st->d->true_peak[c]) {                    \
-        st->d->true_peak[c] = st->d->prev_true_peak[c];                        \
+      if (ebur128_add_frames_channels_##type(st, channels, frame_stride,       \
+                                             segments[s].frames)) {            \
+        return EBUR128_ERROR_NOMEM;                                            \
       }                                                                        \
     }                                                                          \
     return EBUR128_SUCCESS;                                                    \
   }
 
-EBUR128_ADD_FRAMES(short)
-EBUR128_ADD_FRAMES(int)
-EBUR128_ADD_FRAMES(float)
-EBUR128_ADD_FRAMES(double)
+EBUR128_ADD_FRAMES(short, short, 1)
+EBUR128_ADD_FRAMES(int, int, 1)
+EBUR128_ADD_FRAMES(float, float, 1)
+EBUR128_ADD_FRAMES(double, double, 1)
+EBUR128_ADD_FRAMES(u8, unsigned char, 1)
+EBUR128_ADD_FRAMES(s16be, unsigned char, 2)
+EBUR128_ADD_FRAMES(s24le, unsigned char, 3)
+EBUR128_ADD_FRAMES(s24be, unsigned char, 3)
+EBUR128_ADD_FRAMES(s24in32, int, 1)
+EBUR128_ADD_FRAMES(s32be, unsigned char, 4)
+EBUR128_ADD_FRAMES_PLANAR(short)
+EBUR128_ADD_FRAMES_PLANAR(int)
+EBUR128_ADD_FRAMES_PLANAR(float)
+EBUR128_ADD_FRAMES_PLANAR(double)
 
 static int ebur128_calc_relative_threshold(ebur128_state* st,
                                            size_t* above_thresh_counter,
                                            double* relative_threshold) {
-  struct ebur128_dq_entry* it;
-  size_t i;
-
   if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
-      *relative_threshold +=
-          st->d->block_energy_histogram[i] * histogram_energies[i];
-      *above_thresh_counter += st->d->block_energy_histogram[i];
-    }
+    double count = 0.0;
+    ebur128_histogram_sum(st->d, st->d->block_energy_histogram, 0, &count,
+                          relative_threshold);
+    *above_thresh_counter += (size_t)count;
   } else {
-    STAILQ_FOREACH(it, &st->d->block_list, entries) {
-      ++*above_thresh_counter;
-      *relative_threshold += it->z;
-    }
+    /* All stored blocks are above the absolute gate. */
+    ebur128_ring_sum_above(&st->d->blocks, 0.0, above_thresh_counter,
+                           relative_threshold);
   }
 
   return EBUR128_SUCCESS;
@@ -1094,11 +4307,10 @@ static int ebur128_calc_relative_threshold(ebur128_state* st,
 
 static int ebur128_gated_loudness(ebur128_state** sts, size_t size,
                                   double* out) {
-  struct ebur128_dq_entry* it;
   double gated_loudness = 0.0;
   double relative_threshold = 0.0;
   size_t above_thresh_counter = 0;
-  size_t i, j, start_index;
+  size_t i;
 
   for (i = 0; i < size; i++) {
     if (sts[i] && (sts[i]->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
@@ -1122,31 +4334,20 @@ static int ebur128_gated_loudness(ebur128_state** sts, size_t size,
   relative_threshold *= relative_gate_factor;
 
   above_thresh_counter = 0;
-  if (relative_threshold < histogram_energy_boundaries[0]) {
-    start_index = 0;
-  } else {
-    start_index = find_histogram_index(relative_threshold);
-    if (relative_threshold > histogram_energies[start_index]) {
-      ++start_index;
-    }
-  }
   for (i = 0; i < size; i++) {
     if (!sts[i]) {
       continue;
     }
     if (sts[i]->d->use_histogram) {
-      for (j = start_index; j < 1000; ++j) {
-        gated_loudness +=
-            sts[i]->d->block_energy_histogram[j] * histogram_energies[j];
-        above_thresh_counter += sts[i]->d->block_energy_histogram[j];
-      }
+      double count = 0.0;
+      ebur128_histogram_sum(
+          sts[i]->d, sts[i]->d->block_energy_histogram,
+          ebur128_histogram_gate_index(sts[i]->d, relative_threshold), &count,
+          &gated_loudness);
+      above_thresh_counter += (size_t)count;
     } else {
-      STAILQ_FOREACH(it, &sts[i]->d->block_list, entries) {
-        if (it->z >= relative_threshold) {
-          ++above_thresh_counter;
-          gated_loudness += it->z;
-        }
-      }
+      ebur128_ring_sum_above(&sts[i]->d->blocks, relative_threshold,
+                             &above_thresh_counter, &gated_loudness);
     }
   }
   if (!above_thresh_counter) {
@@ -1264,22 +4465,13 @@ int ebur128_loudness_window(ebur128_state* st, unsigned long window,
   return EBUR128_SUCCESS;
 }
 
-static int ebur128_double_cmp(const void* p1, const void* p2) {
-  const double* d1 = (const double*)p1;
-  const double* d2 = (const double*)p2;
-  return (*d1 > *d2) - (*d1 < *d2);
-}
-
 /* EBU - TECH 3342 */
 int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
                                     double* out) {
   size_t i, j;
-  struct ebur128_dq_entry* it;
-  double* stl_vector;
-  size_t stl_size;
-  double* stl_relgated;
+  size_t stl_size, stl_below;
   size_t stl_relgated_size;
-  double stl_power, stl_integrated;
+  double stl_power, stl_relgated_power = 0.0, stl_integrated;
   /* High and low percentile energy */
   double h_en, l_en;
   int use_histogram = 0;
@@ -1298,116 +4490,112 @@ int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
   }
 
   if (use_histogram) {
-    unsigned long hist[1000] = {0};
-    size_t percentile_low, percentile_high;
+    const struct ebur128_state_internal* d = NULL;
+    double percentile_low, percentile_high, count = 0.0, relgated = 0.0;
     size_t index;
 
-    stl_size = 0;
-    stl_power = 0.0;
+    /* All states must share one histogram layout. */
     for (i = 0; i < size; ++i) {
       if (!sts[i]) {
         continue;
       }
-      for (j = 0; j < 1000; ++j) {
-        hist[j] += sts[i]->d->short_term_block_energy_histogram[j];
-        stl_size += sts[i]->d->short_term_block_energy_histogram[j];
-        stl_power += sts[i]->d->short_term_block_energy_histogram[j] *
-                     histogram_energies[j];
+      if (!d) {
+        d = sts[i]->d;
+      } else if (sts[i]->d->histogram_min != d->histogram_min ||
+                 sts[i]->d->histogram_step != d->histogram_step ||
+                 sts[i]->d->histogram_bins != d->histogram_bins) {
+        return EBUR128_ERROR_INVALID_MODE;
+      }
+    }
+
+    stl_power = 0.0;
+    for (i = 0; i < size; ++i) {
+      if (sts[i]) {
+        ebur128_histogram_sum(d, sts[i]->d->short_term_block_energy_histogram,
+                              0, &count, &stl_power);
       }
     }
-    if (!stl_size) {
+    if (count == 0.0) {
       *out = 0.0;
       return EBUR128_SUCCESS;
     }
 
-    stl_power /= stl_size;
+    stl_power /= count;
     stl_integrated = minus_twenty_decibels * stl_power;
 
-    if (stl_integrated < histogram_energy_boundaries[0]) {
-      index = 0;
-    } else {
-      index = find_histogram_index(stl_integrated);
-      if (stl_integrated > histogram_energies[index]) {
-        ++index;
+    index = ebur128_histogram_gate_index(d, stl_integrated);
+    for (i = 0; i < size; ++i) {
+      if (sts[i]) {
+        ebur128_histogram_sum(d, sts[i]->d->short_term_block_energy_histogram,
+                              index, &relgated, &stl_relgated_power);
       }
     }
-    stl_size = 0;
-    for (j = index; j < 1000; ++j) {
-      stl_size += hist[j];
-    }
-    if (!stl_size) {
+    if (relgated == 0.0) {
       *out = 0.0;
       return EBUR128_SUCCESS;
     }
 
-    percentile_low = (size_t)((stl_size - 1) * 0.1 + 0.5);
-    percentile_high = (size_t)((stl_size - 1) * 0.95 + 0.5);
+    percentile_low = (double)(size_t)((relgated - 1) * 0.1 + 0.5);
+    percentile_high = (double)(size_t)((relgated - 1) * 0.95 + 0.5);
 
-    stl_size = 0;
+    count = 0.0;
     j = index;
-    while (stl_size <= percentile_low) {
-      stl_size += hist[j++];
+    while (count <= percentile_low) {
+      for (i = 0; i < size; ++i) {
+        if (sts[i]) {
+          count += sts[i]->d->short_term_block_energy_histogram[j];
+        }
+      }
+      ++j;
     }
-    l_en = histogram_energies[j - 1];
-    while (stl_size <= percentile_high) {
-      stl_size += hist[j++];
+    l_en = d->histogram_energies[j - 1];
+    while (count <= percentile_high) {
+      for (i = 0; i < size; ++i) {
+        if (sts[i]) {
+          count += sts[i]->d->short_term_block_energy_histogram[j];
+        }
+      }
+      ++j;
     }
-    h_en = histogram_energies[j - 1];
+    h_en = d->histogram_energies[j - 1];
 
     *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
     return EBUR128_SUCCESS;
   }
 
   stl_size = 0;
+  stl_power = 0.0;
   for (i = 0; i < size; ++i) {
-    if (!sts[i]) {
-      continue;
-    }
-    STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
-      ++stl_size;
+    if (sts[i]) {
+      ebur128_ring_sum_above(&sts[i]->d->short_term_blocks, 0.0, &stl_size,
+                             &stl_power);
     }
   }
   if (!stl_size) {
     *out = 0.0;
     return EBUR128_SUCCESS;
   }
-  stl_vector = (double*)malloc(stl_size * sizeof(double));
-  if (!stl_vector) {
-    return EBUR128_ERROR_NOMEM;
-  }
-
-  j = 0;
-  for (i = 0; i < size; ++i) {
-    if (!sts[i]) {
-      continue;
-    }
-    STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
-      stl_vector[j] = it->z;
-      ++j;
-    }
-  }
-  qsort(stl_vector, stl_size, sizeof(double), ebur128_double_cmp);
-  stl_power = 0.0;
-  for (i = 0; i < stl_size; ++i) {
-    stl_power += stl_vector[i];
-  }
   stl_power /= (double)stl_size;
   stl_integrated = minus_twenty_decibels * stl_power;
 
-  stl_relgated = stl_vector;
-  stl_relgated_size = stl_size;
-  while (stl_relgated_size > 0 && *stl_relgated < stl_integrated) {
-    ++stl_relgated;
-    --stl_relgated_size;
+  /* The relative gate keeps the blocks from rank stl_below on. */
+  stl_relgated_size = 0;
+  for (i = 0; i < size; ++i) {
+    if (sts[i]) {
+      ebur128_ring_sum_above(&sts[i]->d->short_term_blocks, stl_integrated,
+                             &stl_relgated_size, &stl_relgated_power);
+    }
   }
+  stl_below = stl_size - stl_relgated_size;
 
   if (stl_relgated_size) {
-    h_en = stl_relgated[(size_t)((stl_relgated_size - 1) * 0.95 + 0.5)];
-    l_en = stl_relgated[(size_t)((stl_relgated_size - 1) * 0.1 + 0.5)];
-    free(stl_vector);
+    h_en = ebur128_select_short_term(
+        sts, size,
+        stl_below + (size_t)((stl_relgated_size - 1) * 0.95 + 0.5));
+    l_en = ebur128_select_short_term(
+        sts, size, stl_below + (size_t)((stl_relgated_size - 1) * 0.1 + 0.5));
     *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
   } else {
-    free(stl_vector);
     *out = 0.0;
   }
 
@@ -1442,7 +4630,8 @@ int ebur128_prev_sample_peak(ebur128_state* st, unsigned int channel_number,
     return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
   }
 
-  *out = st->d->prev_sample_peak[channel_number];
+  *out = st->d->reset_prev_peaks ? 0.0
+                                 : st->d->prev_sample_peak[channel_number];
   return EBUR128_SUCCESS;
 }
 
@@ -1471,7 +4660,9 @@ int ebur128_prev_true_peak(ebur128_state* st, unsigned int channel_number,
     return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
   }
 
-  *out = EBUR128_MAX(st->d->prev_true_peak[channel_number],
-                     st->d->prev_sample_peak[channel_number]);
+  *out = st->d->reset_prev_peaks
+             ? 0.0
+             : EBUR128_MAX(st->d->prev_true_peak[channel_number],
+                           st->d->prev_sample_peak[channel_number]);
   return EBUR128_SUCCESS;
 }
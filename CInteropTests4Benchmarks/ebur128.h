@@ -91,7 +91,13 @@ enum mode {
   /** can call ebur128_true_peak */
   EBUR128_MODE_TRUE_PEAK = (1 << 5) | EBUR128_MODE_M | EBUR128_MODE_SAMPLE_PEAK,
   /** uses histogram algorithm to calculate loudness */
-  EBUR128_MODE_HISTOGRAM = (1 << 6)
+  EBUR128_MODE_HISTOGRAM = (1 << 6),
+  /** keeps the energy of every 100ms instead of the filtered audio of the
+   *  whole window. Momentary, short-term and window loudness then end at the
+   *  last complete 100ms block, and windows are rounded to 100ms. */
+  EBUR128_MODE_LOW_MEMORY = (1 << 7),
+  /** publishes the measurement after every block, see ebur128_published */
+  EBUR128_MODE_PUBLISH = (1 << 8)
 };
 
 /** forward declaration of ebur128_state_internal */
@@ -108,6 +114,44 @@ typedef struct {
   struct ebur128_state_internal* d; /**< Internal state. */
 } ebur128_state;
 
+/** \brief Measurement published after a block, see ebur128_published().
+ *
+ *  Values of modes the state does not measure are -HUGE_VAL for loudness
+ *  and 0 for LRA and peaks.
+ */
+typedef struct {
+  unsigned long blocks; /**< Blocks published so far, one per 100ms. */
+  double momentary;     /**< Momentary loudness in LUFS. */
+  double shortterm;     /**< Short-term loudness in LUFS. */
+  double global;        /**< Integrated loudness in LUFS. */
+  double range;         /**< Loudness range (LRA) in LU. */
+  double sample_peak;   /**< Largest sample peak of all channels. */
+  double true_peak;     /**< Largest true peak of all channels. */
+} ebur128_measurement;
+
+/** \brief One contiguous segment of frames, e.g. one side of a wrapped ring
+ *  buffer. Used by ebur128_add_frames_iov_short() and friends.
+ */
+typedef struct {
+  const void* base; /**< First frame of the segment. */
+  size_t frames;    /**< Number of frames in the segment. */
+} ebur128_iovec;
+
+/** \brief Memory hooks of a state, see ebur128_init_with_allocator().
+ *
+ *  The functions behave like malloc(), realloc() and free(). `user` is
+ *  passed to each of them. deallocate is never called with NULL.
+ */
+typedef struct {
+  void* (*allocate)(size_t size, void* user);
+  void* (*reallocate)(void* ptr, size_t size, void* user);
+  void (*deallocate)(void* ptr, void* user);
+  void* user;
+} ebur128_allocator;
+
+/** \brief Meters kept for reuse, see ebur128_pool_create(). */
+typedef struct ebur128_pool ebur128_pool;
+
 /** \brief Get library version number. Do not pass null pointers here.
  *
  *  @param major major version number of library
@@ -126,12 +170,113 @@ void ebur128_get_version(int* major, int* minor, int* patch);
 ebur128_state* ebur128_init(unsigned int channels, unsigned long samplerate,
                             int mode);
 
+/** \brief Initialize library state with custom memory hooks.
+ *
+ *  Like ebur128_init(), but all memory of the state, including the state
+ *  itself, is allocated and freed through `allocator`, which is copied.
+ *  Every state has its own hooks, so states with different allocators can
+ *  be used concurrently.
+ *
+ *  @param channels the number of channels.
+ *  @param samplerate the sample rate.
+ *  @param mode see the mode enum for possible values.
+ *  @param allocator memory hooks, or NULL for malloc(), realloc() and
+ *                   free().
+ *  @return an initialized library state, or NULL on error.
+ */
+ebur128_state* ebur128_init_with_allocator(unsigned int channels,
+                                           unsigned long samplerate, int mode,
+                                           const ebur128_allocator* allocator);
+
 /** \brief Destroy library state.
  *
  *  @param st pointer to a library state.
  */
 void ebur128_destroy(ebur128_state** st);
 
+/** \brief Start a new measurement with the same state.
+ *
+ *  Forgets all audio, blocks and peaks, as if the state were destroyed and
+ *  created again with the same channels, samplerate and mode. The channel
+ *  map, window, history and histogram resolution are kept, and so is the
+ *  memory: resetting never allocates. Cheaper than ebur128_destroy() and
+ *  ebur128_init() when measuring many short files. Must not run while
+ *  another thread calls ebur128_published() on the state.
+ *
+ *  @param st library state.
+ */
+void ebur128_reset(ebur128_state* st);
+
+/** \brief Create a pool of meters for measuring many files.
+ *
+ *  A pool keeps up to `capacity` idle meters of any channels, samplerate
+ *  and mode, and hands them out again instead of creating new ones. All
+ *  pool functions may be called from several threads at once: for a batch
+ *  of N worker threads, a capacity of N keeps one idle meter per worker, or
+ *  give every worker a pool of its own.
+ *
+ *  @param capacity maximum number of idle meters.
+ *  @param allocator memory hooks of the pool and its meters, or NULL for
+ *                   malloc(), realloc() and free().
+ *  @return a new pool, or NULL on error.
+ */
+ebur128_pool* ebur128_pool_create(size_t capacity,
+                                  const ebur128_allocator* allocator);
+
+/** \brief Destroy a pool and its idle meters.
+ *
+ *  Meters not returned to the pool stay valid and are destroyed with
+ *  ebur128_destroy().
+ *
+ *  @param pool pointer to a pool.
+ */
+void ebur128_pool_destroy(ebur128_pool** pool);
+
+/** \brief Create idle meters up front.
+ *
+ *  Makes sure `count` idle meters of the given configuration are ready,
+ *  so that as many ebur128_pool_acquire() calls need no allocation.
+ *
+ *  @param pool the pool.
+ *  @param channels the number of channels.
+ *  @param samplerate the sample rate.
+ *  @param mode see the mode enum for possible values.
+ *  @param count number of meters.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM if a meter cannot be created or the pool is
+ *      full.
+ */
+int ebur128_pool_prepare(ebur128_pool* pool, unsigned int channels,
+                         unsigned long samplerate, int mode, size_t count);
+
+/** \brief Take a meter from a pool.
+ *
+ *  Returns an idle meter of the same configuration if there is one, or else
+ *  one of the same mode changed with ebur128_change_parameters(), or else a
+ *  new meter. Either way it measures like one from ebur128_init().
+ *
+ *  @param pool the pool.
+ *  @param channels the number of channels.
+ *  @param samplerate the sample rate.
+ *  @param mode see the mode enum for possible values.
+ *  @return a library state, or NULL on error.
+ */
+ebur128_state* ebur128_pool_acquire(ebur128_pool* pool, unsigned int channels,
+                                    unsigned long samplerate, int mode);
+
+/** \brief Return a meter to a pool.
+ *
+ *  Resets the meter with ebur128_reset() and restores the default channel
+ *  map, window, history and histogram resolution, then keeps it for the
+ *  next ebur128_pool_acquire(). If the pool is full the meter is destroyed.
+ *  Only restoring a changed window or histogram resolution allocates.
+ *
+ *  @param pool the pool.
+ *  @param st library state, from this pool or not; NULL is ignored.
+ */
+void ebur128_pool_release(ebur128_pool* pool, ebur128_state* st);
+
 /** \brief Set channel type.
  *
  *  The default is:
@@ -142,6 +287,9 @@ void ebur128_destroy(ebur128_state** st);
  *  - 4 -> EBUR128_LEFT_SURROUND
  *  - 5 -> EBUR128_RIGHT_SURROUND
  *
+ *  Channel energies are weighted while the audio is filtered, so a new
+ *  channel type applies to frames added after this call.
+ *
  *  @param st library state.
  *  @param channel_number zero based channel index.
  *  @param value channel type from the "channel" enum.
@@ -154,16 +302,33 @@ int ebur128_set_channel(ebur128_state* st, unsigned int channel_number,
 
 /** \brief Change library parameters.
  *
- *  Note that the channel map will be reset when setting a different number of
- *  channels. The current unfinished block will be lost.
+ *  Switches the layout mid-programme, e.g. between 2.0 and 5.1. The gating
+ *  and short-term block histories carry over, so integrated loudness and
+ *  LRA cover the programme on both sides of the switch. The channel map is
+ *  reset when setting a different number of channels.
+ *
+ *  The last 100ms sub-blocks of the window are kept with their mean square.
+ *  A partial sub-block at the switch is rescaled like the others: its frames
+ *  are mapped to the nearest number of frames at the new rate, at least one
+ *  and short of a whole sub-block, keeping its mean square over the mapped
+ *  frames. The gating block in flight and the next short-term block
+ *  therefore complete with the frames after the switch, as if both layouts
+ *  were one stream. Peaks and, at an unchanged rate, the filters of the
+ *  channels in both layouts carry over; the other filters and the true peak
+ *  oversampler start from silence. Loudness queried between two 100ms
+ *  boundaries, or over a window that is not a multiple of 100ms, is computed
+ *  from the filtered audio, which is silence before the switch.
+ *
+ *  Nothing is allocated if the parameters fit in those of the state or of
+ *  ebur128_reserve_parameters().
  *
  *  @param st library state.
  *  @param channels new number of channels.
  *  @param samplerate new sample rate.
  *  @return
  *    - EBUR128_SUCCESS on success.
- *    - EBUR128_ERROR_NOMEM on memory allocation error. The state will be
- *      invalid and must be destroyed.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. The state is not
+ *      changed.
  *    - EBUR128_ERROR_NO_CHANGE if channels and sample rate were not changed.
  */
 int ebur128_change_parameters(ebur128_state* st, unsigned int channels,
@@ -189,8 +354,12 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window);
  *  Set the maximum history that will be stored for loudness integration.
  *  More history provides more accurate results, but requires more resources.
  *
- *  Applies to ebur128_loudness_range() and ebur128_loudness_global() when
- *  EBUR128_MODE_HISTOGRAM is not set.
+ *  Applies to ebur128_loudness_range() and ebur128_loudness_global(). With
+ *  EBUR128_MODE_HISTOGRAM, a limited history keeps the histogram bin of
+ *  every block in it (4 bytes per 100ms) so that the oldest blocks can be
+ *  taken out of the histogram again. Blocks counted before the history was
+ *  first limited have no known age and are dropped, so set the history
+ *  before adding frames.
  *
  *  Default is ULONG_MAX (at least ~50 days).
  *  Minimum is 3000ms for EBUR128_MODE_LRA and 400ms for EBUR128_MODE_M.
@@ -203,6 +372,282 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window);
  */
 int ebur128_set_max_history(ebur128_state* st, unsigned long history);
 
+/** \brief Reserve the block history for a programme duration.
+ *
+ *  The only allocations after init are made by ebur128_add_frames_*() as
+ *  the block history grows. After reserving `duration` ms, adding up to
+ *  that much audio does not allocate, and neither does any query. If the
+ *  maximum history is no longer than the reservation, adding frames never
+ *  allocates. Changing parameters beyond ebur128_reserve_parameters(),
+ *  the window or the histogram, and restoring or merging states may still
+ *  allocate.
+ *
+ *  Reserving takes 16 bytes per 100ms (4 bytes with EBUR128_MODE_HISTOGRAM
+ *  and a limited history), up to the maximum history, plus 41 kB of bins
+ *  for the gating blocks and in EBUR128_MODE_LRA for the short-term blocks.
+ *
+ *  @param st library state.
+ *  @param duration duration of audio in ms.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. The measurement is
+ *      not affected.
+ */
+int ebur128_reserve(ebur128_state* st, unsigned long duration);
+
+/** \brief Reserve memory for switching parameters.
+ *
+ *  Sizes the parts of the state that depend on the channels and the sample
+ *  rate for up to `channels` channels at any rate up to `samplerate`, so that
+ *  ebur128_change_parameters() between such layouts does not allocate, e.g.
+ *  on an ingest thread. Call it after ebur128_set_max_window(), which sizes
+ *  the window for the current parameters again.
+ *
+ *  @param st library state.
+ *  @param channels maximum number of channels.
+ *  @param samplerate maximum sample rate.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error or invalid
+ *      parameters. The measurement is not affected.
+ */
+int ebur128_reserve_parameters(ebur128_state* st, unsigned int channels,
+                               unsigned long samplerate);
+
+/** \brief Start measuring a segment of a longer stream.
+ *
+ *  A long stream can be split into segments measured by separate states,
+ *  e.g. on separate threads. Feed each state a pre-roll first: the frames
+ *  before its segment, starting a multiple of 100ms into the stream. Then
+ *  call this function, which keeps the filter state and the loudness
+ *  window of the pre-roll but drops its blocks and peaks, and aligns the
+ *  short-term blocks with those of the whole stream. Finally add the
+ *  segment itself. A state that starts at the beginning of the stream
+ *  needs no pre-roll.
+ *
+ *  The blocks of all segments together are then those of one state fed the
+ *  whole stream. Combine them with ebur128_merge(), or with
+ *  ebur128_loudness_global_multiple(), ebur128_loudness_range_multiple()
+ *  and the largest peaks. A
+ *  pre-roll of at least 3s, or from the stream start, gives every
+ *  short-term block its full window; 400ms is enough for integrated
+ *  loudness. The filters settle within a few ms, so loudness differs from a
+ *  single state by floating point rounding only (less than 1e-9 LU in the
+ *  tests). Peaks are identical.
+ *
+ *  @param st library state.
+ *  @param position frames of the stream before the segment, a multiple of
+ *                  100ms.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if position is not on a 100ms boundary.
+ */
+int ebur128_start_segment(ebur128_state* st, size_t position);
+
+/** \brief Add the measurements of one state to another.
+ *
+ *  Appends the gating blocks and short-term blocks of src to those of dst,
+ *  as if the audio of src had followed that of dst, and raises the sample
+ *  and true peaks of dst to those of src. Afterwards src can be destroyed,
+ *  e.g. to reduce the states of segments or workers into one result, or to
+ *  add the tracks of an album one at a time. Blocks beyond the history of
+ *  dst are dropped, oldest first.
+ *
+ *  Blocks are merged for the modes both states have. A histogram dst bins
+ *  the blocks of src in its own layout. The states may have different
+ *  sample rates; they need the same number of channels if both measure
+ *  peaks. The filter state, window and previous peaks of dst are kept.
+ *
+ *  @param dst state that receives the measurements.
+ *  @param src state whose measurements are added, unchanged.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. dst then holds part
+ *      of the blocks of src.
+ *    - EBUR128_ERROR_INVALID_MODE if dst and src are the same state, if only
+ *      src is in EBUR128_MODE_HISTOGRAM, as its exact block energies are
+ *      unknown, or if the channel counts of peak measuring states differ.
+ */
+int ebur128_merge(ebur128_state* dst, const ebur128_state* src);
+
+/** \brief Write the complete state of a meter to a buffer.
+ *
+ *  The snapshot holds everything needed to continue the measurement in
+ *  another process with identical results: filter and oversampler state,
+ *  the loudness window, peaks, and the block history or histograms. It can
+ *  be restored into a state created with the same channels, sample rate
+ *  and mode by ebur128_restore().
+ *
+ *  An incremental snapshot only holds the blocks and the frames of filtered
+ *  audio added since the previous snapshot of st, so the history is stored
+ *  once: save a full snapshot, then append incremental ones, and restore
+ *  them in the same order. The rest of the state has a fixed size of about
+ *  0.5 KB for two channels. Without EBUR128_MODE_LOW_MEMORY the filtered
+ *  audio takes 8 bytes per sample, up to the whole window: 768 KB per
+ *  second of 48 kHz stereo. Histograms are always written in full.
+ *
+ *  Doubles are written in native byte order, so snapshots can only be
+ *  restored on machines with the same floating point format.
+ *
+ *  @param st library state.
+ *  @param incremental 0 for a full snapshot, nonzero for the changes since
+ *                     the previous one.
+ *  @param buffer buffer for the snapshot, or NULL to query its size.
+ *  @param size size of buffer in bytes; set to the size of the snapshot.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM if buffer is NULL or too small. *size is then
+ *      the required size, and st is unchanged.
+ */
+int ebur128_snapshot(ebur128_state* st, int incremental,
+                     unsigned char* buffer, size_t* size);
+
+/** \brief Continue a measurement from a snapshot.
+ *
+ *  Replaces the state of st by that saved with ebur128_snapshot(). A full
+ *  snapshot can be restored into any state of the same channels, sample
+ *  rate and mode; an incremental one only after the snapshot taken before
+ *  it. Later snapshots of st are incremental to the restored one.
+ *
+ *  @param st library state.
+ *  @param buffer snapshot.
+ *  @param size size of the snapshot in bytes.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. The state should be
+ *      destroyed then.
+ *    - EBUR128_ERROR_INVALID_MODE if the snapshot is damaged, was taken of a
+ *      state of different channels, sample rate or mode, or is incremental
+ *      to another snapshot. st is unchanged.
+ */
+int ebur128_restore(ebur128_state* st, const unsigned char* buffer,
+                    size_t size);
+
+/** \brief Write a summary of a programme's measurement.
+ *
+ *  A summary holds the distributions of the gating and short-term block
+ *  energies, in bins of 1/32 octave (about 0.09 LU) with the number and sum
+ *  of the energies per used bin, and the largest sample and true peak of
+ *  all channels. It takes 14 bytes per used bin, typically 2 to 6 KB per
+ *  track, and can be stored in place of the audio. The
+ *  ebur128_summary_* functions combine any number of summaries without an
+ *  ebur128_state, e.g. for album or playlist normalization.
+ *
+ *  Doubles are written in native byte order, like ebur128_snapshot().
+ *
+ *  @param st library state.
+ *  @param buffer buffer for the summary, or NULL to query its size.
+ *  @param size size of buffer in bytes; set to the size of the summary.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM if buffer is NULL or too small. *size is then
+ *      the required size.
+ */
+int ebur128_summary(ebur128_state* st, unsigned char* buffer, size_t* size);
+
+/** \brief Get the integrated loudness of summaries taken together.
+ *
+ *  Gates the blocks of all summaries as ebur128_loudness_global_multiple()
+ *  does, in time linear in the number of used bins. Blocks in the bin of
+ *  the relative threshold are kept or gated together, by their mean
+ *  energy; all other blocks are gated exactly.
+ *
+ *  @param summaries summaries written by ebur128_summary().
+ *  @param sizes sizes of the summaries in bytes.
+ *  @param size number of summaries.
+ *  @param out integrated loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if a summary is damaged or was not
+ *      measured with EBUR128_MODE_I.
+ */
+int ebur128_summary_loudness_global(const unsigned char* const* summaries,
+                                    const size_t* sizes,
+                                    size_t size,
+                                    double* out);
+
+/** \brief Get the loudness range (LRA) of summaries taken together.
+ *
+ *  Like ebur128_loudness_range_multiple(), with the percentiles taken as the
+ *  mean energy of their bin. The result is within a bin width, about
+ *  0.1 LU, of the exact one.
+ *
+ *  @param summaries summaries written by ebur128_summary().
+ *  @param sizes sizes of the summaries in bytes.
+ *  @param size number of summaries.
+ *  @param out loudness range (LRA) in LU.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if a summary is damaged or was not
+ *      measured with EBUR128_MODE_LRA.
+ */
+int ebur128_summary_loudness_range(const unsigned char* const* summaries,
+                                   const size_t* sizes,
+                                   size_t size,
+                                   double* out);
+
+/** \brief Get the largest sample peak of summaries.
+ *
+ *  @param summaries summaries written by ebur128_summary().
+ *  @param sizes sizes of the summaries in bytes.
+ *  @param size number of summaries.
+ *  @param out largest sample peak of all channels.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if a summary is damaged or was not
+ *      measured with EBUR128_MODE_SAMPLE_PEAK.
+ */
+int ebur128_summary_sample_peak(const unsigned char* const* summaries,
+                                const size_t* sizes,
+                                size_t size,
+                                double* out);
+
+/** \brief Get the largest true peak of summaries.
+ *
+ *  @param summaries summaries written by ebur128_summary().
+ *  @param sizes sizes of the summaries in bytes.
+ *  @param size number of summaries.
+ *  @param out largest true peak of all channels, as ebur128_true_peak()
+ *             reports it.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if a summary is damaged or was not
+ *      measured with EBUR128_MODE_TRUE_PEAK.
+ */
+int ebur128_summary_true_peak(const unsigned char* const* summaries,
+                              const size_t* sizes,
+                              size_t size,
+                              double* out);
+
+/** \brief Set the resolution and range of the histogram.
+ *
+ *  With EBUR128_MODE_HISTOGRAM, block loudnesses are counted in bins of
+ *  `resolution` LU from `min_loudness` to `max_loudness` LUFS, rounded up
+ *  to whole bins. Blocks outside the range are counted in the first or last
+ *  bin. Memory use is 32 bytes per bin; the default is 0.1 LU from -70 to
+ *  +30 LUFS.
+ *
+ *  Blocks measured before the change are moved to the new bin holding the
+ *  centre of their old bin, so set the resolution before adding frames to
+ *  keep its full accuracy. States combined by the *_multiple functions
+ *  must use the same resolution and range for ebur128_loudness_range.
+ *
+ *  @param st library state.
+ *  @param resolution bin width in LU, e.g. 0.01.
+ *  @param min_loudness lower end of the range in LUFS.
+ *  @param max_loudness upper end of the range in LUFS.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. The previous
+ *      histogram is kept.
+ *    - EBUR128_ERROR_INVALID_MODE if EBUR128_MODE_HISTOGRAM is not set, or
+ *      the resolution or range is invalid or needs more than 1000000 bins.
+ *    - EBUR128_ERROR_NO_CHANGE if resolution and range were not changed.
+ */
+int ebur128_set_histogram_resolution(ebur128_state* st, double resolution,
+                                     double min_loudness, double max_loudness);
+
 /** \brief Add frames to be processed.
  *
  *  @param st library state.
@@ -223,6 +668,120 @@ int ebur128_add_frames_float(ebur128_state* st, const float* src,
 int ebur128_add_frames_double(ebur128_state* st, const double* src,
                               size_t frames);
 
+/** \brief Add interleaved frames stored in a packed or foreign format.
+ *
+ *  The samples are decoded while filtering, so there is no need to convert
+ *  them to one of the native types first. Results are identical to
+ *  converting each sample to int and calling ebur128_add_frames_int() with
+ *  the value scaled to the full int range.
+ *
+ *  - ebur128_add_frames_u8(): unsigned 8 bit, 128 being silence.
+ *  - ebur128_add_frames_s16be(): signed 16 bit, big-endian.
+ *  - ebur128_add_frames_s24le(): signed 24 bit packed in 3 bytes,
+ *    little-endian.
+ *  - ebur128_add_frames_s24be(): signed 24 bit packed in 3 bytes,
+ *    big-endian.
+ *  - ebur128_add_frames_s24in32(): signed 24 bit in the low bits of a
+ *    native int; the upper 8 bits are ignored.
+ *  - ebur128_add_frames_s32be(): signed 32 bit, big-endian.
+ *
+ *  @param st library state.
+ *  @param src array of source frames. Channels must be interleaved.
+ *  @param frames number of frames. Not number of samples!
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ */
+int ebur128_add_frames_u8(ebur128_state* st, const unsigned char* src,
+                          size_t frames);
+/** \brief See \ref ebur128_add_frames_u8 */
+int ebur128_add_frames_s16be(ebur128_state* st, const unsigned char* src,
+                             size_t frames);
+/** \brief See \ref ebur128_add_frames_u8 */
+int ebur128_add_frames_s24le(ebur128_state* st, const unsigned char* src,
+                             size_t frames);
+/** \brief See \ref ebur128_add_frames_u8 */
+int ebur128_add_frames_s24be(ebur128_state* st, const unsigned char* src,
+                             size_t frames);
+/** \brief See \ref ebur128_add_frames_u8 */
+int ebur128_add_frames_s24in32(ebur128_state* st, const int* src,
+                               size_t frames);
+/** \brief See \ref ebur128_add_frames_u8 */
+int ebur128_add_frames_s32be(ebur128_state* st, const unsigned char* src,
+                             size_t frames);
+
+/** \brief Add frames to be processed, one buffer per channel.
+ *
+ *  Equivalent to the interleaved ebur128_add_frames_short(), but reads
+ *  every channel from its own contiguous buffer, so planar (non-interleaved)
+ *  audio does not need to be interleaved first.
+ *
+ *  @param st library state.
+ *  @param src array of st->channels pointers, each to `frames` samples.
+ *  @param frames number of frames. Not number of samples!
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ */
+int ebur128_add_frames_planar_short(ebur128_state* st,
+                                    const short* const* src,
+                                    size_t frames);
+/** \brief See \ref ebur128_add_frames_planar_short */
+int ebur128_add_frames_planar_int(ebur128_state* st,
+                                  const int* const* src,
+                                  size_t frames);
+/** \brief See \ref ebur128_add_frames_planar_short */
+int ebur128_add_frames_planar_float(ebur128_state* st,
+                                    const float* const* src,
+                                    size_t frames);
+/** \brief See \ref ebur128_add_frames_planar_short */
+int ebur128_add_frames_planar_double(ebur128_state* st,
+                                     const double* const* src,
+                                     size_t frames);
+
+/** \brief Add frames from a list of segments, without copying.
+ *
+ *  Frames in every segment are `frame_stride` samples apart and the
+ *  st->channels measured channels start `channel_offset` samples into each
+ *  frame. This measures a contiguous channel subset of a wider interleaved
+ *  stream, and the segments let a wrapped ring buffer be passed as is. The
+ *  segments are processed as one call, e.g. for ebur128_prev_sample_peak().
+ *
+ *  @param st library state.
+ *  @param segments array of segment_count segments, processed in order.
+ *  @param segment_count number of segments.
+ *  @param frame_stride number of samples from one frame to the next.
+ *  @param channel_offset index of the first measured channel in a frame.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if channel_offset + st->channels
+ *      exceeds frame_stride.
+ */
+int ebur128_add_frames_iov_short(ebur128_state* st,
+                                 const ebur128_iovec* segments,
+                                 size_t segment_count,
+                                 size_t frame_stride,
+                                 size_t channel_offset);
+/** \brief See \ref ebur128_add_frames_iov_short */
+int ebur128_add_frames_iov_int(ebur128_state* st,
+                               const ebur128_iovec* segments,
+                               size_t segment_count,
+                               size_t frame_stride,
+                               size_t channel_offset);
+/** \brief See \ref ebur128_add_frames_iov_short */
+int ebur128_add_frames_iov_float(ebur128_state* st,
+                                 const ebur128_iovec* segments,
+                                 size_t segment_count,
+                                 size_t frame_stride,
+                                 size_t channel_offset);
+/** \brief See \ref ebur128_add_frames_iov_short */
+int ebur128_add_frames_iov_double(ebur128_state* st,
+                                  const ebur128_iovec* segments,
+                                  size_t segment_count,
+                                  size_t frame_stride,
+                                  size_t channel_offset);
+
 /** \brief Get global integrated loudness in LUFS.
  *
  *  @param st library state.
@@ -392,6 +951,30 @@ int ebur128_true_peak(ebur128_state* st, unsigned int channel_number,
 int ebur128_prev_true_peak(ebur128_state* st, unsigned int channel_number,
                            double* out);
 
+/** \brief Read the measurement published after the last block.
+ *
+ *  With EBUR128_MODE_PUBLISH, the thread adding frames computes the
+ *  loudness and peaks after every 100ms block (from 400ms on) and publishes
+ *  them. Any number of other threads can read them with this function while
+ *  frames are added, without a lock: the publishing thread never waits, and
+ *  a reader only retries if a block is published while it copies the
+ *  values. All values read together belong to the same block. No other
+ *  function may be called on st concurrently with add_frames.
+ *
+ *  Publishing allocates nothing. The block history itself still grows as
+ *  blocks are added, except in EBUR128_MODE_HISTOGRAM without a maximum
+ *  history.
+ *
+ *  @param st library state.
+ *  @param out measurement of the last published block; before the first
+ *             block, blocks is 0.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_PUBLISH" has not
+ *      been set.
+ */
+int ebur128_published(ebur128_state* st, ebur128_measurement* out);
+
 /** \brief Get relative threshold in LUFS.
  *
  *  @param st library state
@@ -0,0 +1,735 @@
+// Batch loudness analyzer. Measures WAV, RF64 and AIFF files on a pool of
+// worker threads and streams one result per file, as JSON Lines or CSV, in
+// the order the files finish. Aggregate throughput is printed to stderr.
+//
+// Usage: ebur128_batch [options] path...
+//   -j N              number of worker threads (default: all cores)
+//   --csv             write CSV instead of JSON Lines
+//   --no-true-peak    skip true peak, which is the most expensive measurement
+//   --files-from F    also read paths from file F, one per line ("-": stdin)
+//   --segment S       split files into segments of S seconds measured in
+//                     parallel (default 600, 0 to never split)
+// Directories are searched recursively for .wav, .rf64, .aif and .aiff files.
+
+#include "ebur128.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Sample encodings, each fed to the matching ebur128_add_frames_* function
+enum class SampleFormat { U8, S8, S16LE, S16BE, S24LE, S24BE, S32LE, S32BE, F32LE, F32BE, F64LE, F64BE };
+
+struct AudioFile {
+    std::FILE* file = nullptr;
+    unsigned int channels = 0;
+    unsigned long sampleRate = 0;
+    SampleFormat format = SampleFormat::S16LE;
+    size_t bytesPerFrame = 0;
+    uint64_t dataOffset = 0;
+    uint64_t dataBytes = 0;
+    // Channel types from a WAVE_FORMAT_EXTENSIBLE mask, empty for the default map
+    std::vector<int> channelMap;
+
+    ~AudioFile() {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+};
+
+struct Result {
+    std::string path;
+    std::string error;
+    double duration = 0.0;
+    double integrated = 0.0;
+    double range = 0.0;
+    double samplePeak = 0.0;
+    double truePeak = 0.0;
+    uint64_t bytes = 0;
+};
+
+uint32_t readLe(const unsigned char* p, int bytes) {
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+uint32_t readBe(const unsigned char* p, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+uint64_t readLe64(const unsigned char* p) {
+    return static_cast<uint64_t>(readLe(p + 4, 4)) << 32 | readLe(p, 4);
+}
+
+// 80-bit IEEE extended, as used for the AIFF sample rate
+double readExtended(const unsigned char* p) {
+    int exponent = static_cast<int>(readBe(p, 2) & 0x7FFF);
+    uint64_t mantissa = static_cast<uint64_t>(readBe(p + 2, 4)) << 32 | readBe(p + 6, 4);
+    if (exponent == 0 && mantissa == 0) {
+        return 0.0;
+    }
+    return std::ldexp(static_cast<double>(mantissa), exponent - 16383 - 63);
+}
+
+bool readExact(std::FILE* file, unsigned char* buffer, size_t bytes) {
+    return std::fread(buffer, 1, bytes, file) == bytes;
+}
+
+bool skip(std::FILE* file, uint64_t bytes) {
+    return fseeko(file, static_cast<off_t>(bytes), SEEK_CUR) == 0;
+}
+
+// Channel types for the speaker positions of a WAVE_FORMAT_EXTENSIBLE mask,
+// in mask bit order
+std::vector<int> channelMapFromMask(uint32_t mask, unsigned int channels) {
+    static const int speakers[] = {
+        EBUR128_LEFT, EBUR128_RIGHT, EBUR128_CENTER, EBUR128_UNUSED,
+        EBUR128_LEFT_SURROUND, EBUR128_RIGHT_SURROUND, EBUR128_Mp030, EBUR128_Mm030,
+        EBUR128_Mp180, EBUR128_Mp090, EBUR128_Mm090, EBUR128_Tp000,
+        EBUR128_Up030, EBUR128_Up000, EBUR128_Um030, EBUR128_Up135,
+        EBUR128_Up180, EBUR128_Um135,
+    };
+    std::vector<int> map;
+    for (int bit = 0; bit < 18 && map.size() < channels; ++bit) {
+        if (mask & (1u << bit)) {
+            map.push_back(speakers[bit]);
+        }
+    }
+    if (map.size() != channels) {
+        map.clear();
+    }
+    return map;
+}
+
+std::string openWave(AudioFile& audio, bool rf64, uint64_t fileSize) {
+    unsigned char header[40];
+    uint64_t ds64DataBytes = 0;
+    bool haveFormat = false;
+    while (readExact(audio.file, header, 8)) {
+        uint32_t size = readLe(header + 4, 4);
+        if (std::memcmp(header, "ds64", 4) == 0 && size >= 24) {
+            if (!readExact(audio.file, header, 24) || !skip(audio.file, size - 24 + (size & 1))) {
+                return "truncated ds64 chunk";
+            }
+            ds64DataBytes = readLe64(header + 8);
+        } else if (std::memcmp(header, "fmt ", 4) == 0 && size >= 16) {
+            size_t used = std::min<size_t>(size, sizeof(header));
+            if (!readExact(audio.file, header, used) || !skip(audio.file, size - used + (size & 1))) {
+                return "truncated fmt chunk";
+            }
+            uint32_t tag = readLe(header, 2);
+            audio.channels = readLe(header + 2, 2);
+            audio.sampleRate = readLe(header + 4, 4);
+            audio.bytesPerFrame = readLe(header + 12, 2);
+            if (tag == 0xFFFE && used >= 40) {
+                audio.channelMap = channelMapFromMask(readLe(header + 20, 4), audio.channels);
+                tag = readLe(header + 24, 2);
+            }
+            if (audio.channels == 0 || audio.bytesPerFrame % audio.channels) {
+                return "invalid fmt chunk";
+            }
+            size_t sampleBytes = audio.bytesPerFrame / audio.channels;
+            if (tag == 1 && sampleBytes >= 1 && sampleBytes <= 4) {
+                const SampleFormat formats[] = {SampleFormat::U8, SampleFormat::S16LE,
+                                                SampleFormat::S24LE, SampleFormat::S32LE};
+                audio.format = formats[sampleBytes - 1];
+            } else if (tag == 3 && (sampleBytes == 4 || sampleBytes == 8)) {
+                audio.format = sampleBytes == 4 ? SampleFormat::F32LE : SampleFormat::F64LE;
+            } else {
+                return "unsupported WAV sample format";
+            }
+            haveFormat = true;
+        } else if (std::memcmp(header, "data", 4) == 0) {
+            if (!haveFormat) {
+                return "data chunk before fmt chunk";
+            }
+            audio.dataOffset = static_cast<uint64_t>(ftello(audio.file));
+            audio.dataBytes = rf64 && size == 0xFFFFFFFF ? ds64DataBytes : size;
+            // Streamed files may leave the size unset; read to the end then
+            audio.dataBytes = std::min(audio.dataBytes, fileSize - audio.dataOffset);
+            return std::string();
+        } else if (!skip(audio.file, static_cast<uint64_t>(size) + (size & 1))) {
+            break;
+        }
+    }
+    return "no data chunk";
+}
+
+std::string openAiff(AudioFile& audio, bool aifc, uint64_t fileSize) {
+    unsigned char header[26];
+    bool haveFormat = false;
+    unsigned int bits = 0;
+    while (readExact(audio.file, header, 8)) {
+        uint32_t size = readBe(header + 4, 4);
+        if (std::memcmp(header, "COMM", 4) == 0 && size >= 18) {
+            size_t used = std::min<size_t>(size, aifc ? 22 : 18);
+            if (!readExact(audio.file, header, used) || !skip(audio.file, size - used + (size & 1))) {
+                return "truncated COMM chunk";
+            }
+            audio.channels = readBe(header, 2);
+            bits = readBe(header + 6, 2);
+            audio.sampleRate = static_cast<unsigned long>(std::lround(readExtended(header + 8)));
+            char compression[5] = "NONE";
+            if (aifc && used >= 22) {
+                std::memcpy(compression, header + 18, 4);
+            }
+            size_t sampleBytes = (bits + 7) / 8;
+            std::string type(compression);
+            if (type == "NONE" && sampleBytes >= 1 && sampleBytes <= 4) {
+                const SampleFormat formats[] = {SampleFormat::S8, SampleFormat::S16BE,
+                                                SampleFormat::S24BE, SampleFormat::S32BE};
+                audio.format = formats[sampleBytes - 1];
+            } else if (type == "sowt" && sampleBytes >= 2 && sampleBytes <= 4) {
+                const SampleFormat formats[] = {SampleFormat::S16LE, SampleFormat::S24LE,
+                                                SampleFormat::S32LE};
+                audio.format = formats[sampleBytes - 2];
+            } else if (type == "fl32" || type == "FL32") {
+                audio.format = SampleFormat::F32BE;
+                sampleBytes = 4;
+            } else if (type == "fl64" || type == "FL64") {
+                audio.format = SampleFormat::F64BE;
+                sampleBytes = 8;
+            } else {
+                return "unsupported AIFF compression type " + type;
+            }
+            audio.bytesPerFrame = sampleBytes * audio.channels;
+            haveFormat = audio.channels > 0;
+        } else if (std::memcmp(header, "SSND", 4) == 0 && size >= 8) {
+            if (!haveFormat) {
+                return "SSND chunk before COMM chunk";
+            }
+            if (!readExact(audio.file, header, 8)) {
+                return "truncated SSND chunk";
+            }
+            uint32_t offset = readBe(header, 4);
+            if (offset > size - 8 || !skip(audio.file, offset)) {
+                return "invalid SSND chunk";
+            }
+            audio.dataOffset = static_cast<uint64_t>(ftello(audio.file));
+            audio.dataBytes = std::min<uint64_t>(size - 8 - offset, fileSize - audio.dataOffset);
+            return std::string();
+        } else if (!skip(audio.file, static_cast<uint64_t>(size) + (size & 1))) {
+            break;
+        }
+    }
+    return "no SSND chunk";
+}
+
+std::string openAudio(AudioFile& audio, const std::string& path) {
+    std::error_code error;
+    uint64_t fileSize = fs::file_size(path, error);
+    if (error) {
+        return error.message();
+    }
+    audio.file = std::fopen(path.c_str(), "rb");
+    if (!audio.file) {
+        return std::strerror(errno);
+    }
+    unsigned char header[12];
+    if (!readExact(audio.file, header, sizeof(header))) {
+        return "file too short";
+    }
+    std::string message;
+    if ((std::memcmp(header, "RIFF", 4) == 0 || std::memcmp(header, "RF64", 4) == 0) &&
+        std::memcmp(header + 8, "WAVE", 4) == 0) {
+        message = openWave(audio, header[1] == 'F', fileSize);
+    } else if (std::memcmp(header, "FORM", 4) == 0 &&
+               (std::memcmp(header + 8, "AIFF", 4) == 0 || std::memcmp(header + 8, "AIFC", 4) == 0)) {
+        message = openAiff(audio, header[11] == 'C', fileSize);
+    } else {
+        return "not a WAV, RF64 or AIFF file";
+    }
+    if (message.empty() && (audio.sampleRate < 16 || audio.sampleRate > 2822400)) {
+        message = "unsupported sample rate";
+    }
+    if (message.empty() && fseeko(audio.file, static_cast<off_t>(audio.dataOffset), SEEK_SET)) {
+        message = std::strerror(errno);
+    }
+    return message;
+}
+
+// Reverses the bytes of every sample of `size` bytes
+void swapBytes(unsigned char* data, size_t bytes, size_t size) {
+    for (size_t i = 0; i + size <= bytes; i += size) {
+        std::reverse(data + i, data + i + size);
+    }
+}
+
+// Feeds a buffer of whole frames. Native-endian types are read in place,
+// which assumes a little-endian host; big-endian floats are swapped first.
+int addFrames(ebur128_state* st, SampleFormat format, unsigned char* data, size_t frames,
+              size_t bytes) {
+    switch (format) {
+    case SampleFormat::U8:
+        return ebur128_add_frames_u8(st, data, frames);
+    case SampleFormat::S8:
+        for (size_t i = 0; i < bytes; ++i) {
+            data[i] ^= 0x80;
+        }
+        return ebur128_add_frames_u8(st, data, frames);
+    case SampleFormat::S16LE:
+        return ebur128_add_frames_short(st, reinterpret_cast<const short*>(data), frames);
+    case SampleFormat::S16BE:
+        return ebur128_add_frames_s16be(st, data, frames);
+    case SampleFormat::S24LE:
+        return ebur128_add_frames_s24le(st, data, frames);
+    case SampleFormat::S24BE:
+        return ebur128_add_frames_s24be(st, data, frames);
+    case SampleFormat::S32LE:
+        return ebur128_add_frames_int(st, reinterpret_cast<const int*>(data), frames);
+    case SampleFormat::S32BE:
+        return ebur128_add_frames_s32be(st, data, frames);
+    case SampleFormat::F32BE:
+        swapBytes(data, bytes, 4);
+        // fall through
+    case SampleFormat::F32LE:
+        return ebur128_add_frames_float(st, reinterpret_cast<const float*>(data), frames);
+    case SampleFormat::F64BE:
+        swapBytes(data, bytes, 8);
+        // fall through
+    case SampleFormat::F64LE:
+        return ebur128_add_frames_double(st, reinterpret_cast<const double*>(data), frames);
+    }
+    return EBUR128_ERROR_INVALID_MODE;
+}
+
+double toDecibels(double value) {
+    return value > 0.0 ? 20.0 * std::log10(value) : -HUGE_VAL;
+}
+
+// One file, measured as one or more segments of whole 100ms blocks
+struct Job {
+    std::string path;
+    std::string error;
+    unsigned long sampleRate = 0;
+    uint64_t frames = 0;
+    // Segment boundaries in frames, ending with the number of frames
+    std::vector<uint64_t> starts;
+    // Segments measured so far, merged into one state
+    ebur128_state* merged = nullptr;
+    std::mutex mutex;
+    size_t pending = 0;
+    uint64_t bytes = 0;
+};
+
+struct Task {
+    size_t job;
+    size_t segment;
+    uint64_t bytes;
+};
+
+// Reads the header and splits files longer than 1.5 segments
+void plan(Job& job, double segmentSeconds) {
+    AudioFile audio;
+    job.error = openAudio(audio, job.path);
+    job.starts.assign(1, 0);
+    if (job.error.empty()) {
+        job.sampleRate = audio.sampleRate;
+        job.frames = audio.dataBytes / audio.bytesPerFrame;
+        uint64_t block = (audio.sampleRate + 5) / 10;
+        uint64_t segment = static_cast<uint64_t>(std::llround(segmentSeconds * 10.0)) * block;
+        for (uint64_t start = segment; segment > 0 && start + segment / 2 < job.frames; start += segment) {
+            job.starts.push_back(start);
+        }
+    }
+    job.starts.push_back(job.frames);
+    job.pending = job.starts.size() - 1;
+}
+
+// Feeds the next `frames` frames of a file in chunks of about 1 MB
+std::string feed(AudioFile& audio, ebur128_state* st, uint64_t frames, uint64_t& bytes) {
+    // malloc keeps every sample type aligned
+    const size_t bufferFrames = std::max<size_t>(1, (1 << 20) / audio.bytesPerFrame);
+    unsigned char* buffer = static_cast<unsigned char*>(std::malloc(bufferFrames * audio.bytesPerFrame));
+    std::string error = buffer ? "" : "out of memory";
+    while (buffer && frames > 0) {
+        size_t chunkFrames = static_cast<size_t>(std::min<uint64_t>(frames, bufferFrames));
+        size_t chunkBytes = chunkFrames * audio.bytesPerFrame;
+        if (std::fread(buffer, 1, chunkBytes, audio.file) != chunkBytes) {
+            error = "read error";
+            break;
+        }
+        if (addFrames(st, audio.format, buffer, chunkFrames, chunkBytes) != EBUR128_SUCCESS) {
+            error = "out of memory";
+            break;
+        }
+        frames -= chunkFrames;
+        bytes += chunkBytes;
+    }
+    std::free(buffer);
+    return error;
+}
+
+// Measures one segment after a pre-roll of 3s, which gives its first
+// short-term blocks their full window, see ebur128_start_segment()
+std::string measureSegment(Job& job, size_t segment, bool truePeak, ebur128_pool* meters, ebur128_state** out,
+                           uint64_t& bytes) {
+    AudioFile audio;
+    std::string error = openAudio(audio, job.path);
+    if (!error.empty()) {
+        return error;
+    }
+    // Only 100ms block energies are needed, so keep no filtered audio
+    int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_LOW_MEMORY |
+               (truePeak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK);
+    ebur128_state* st = ebur128_pool_acquire(meters, audio.channels, audio.sampleRate, mode);
+    if (!st) {
+        return "cannot create loudness meter";
+    }
+    *out = st;
+    for (size_t i = 0; i < audio.channelMap.size(); ++i) {
+        ebur128_set_channel(st, static_cast<unsigned int>(i), audio.channelMap[i]);
+    }
+
+    uint64_t begin = job.starts[segment];
+    uint64_t preroll = 30 * static_cast<uint64_t>((audio.sampleRate + 5) / 10);
+    uint64_t from = begin > preroll ? begin - preroll : 0;
+    if (fseeko(audio.file, static_cast<off_t>(audio.dataOffset + from * audio.bytesPerFrame), SEEK_SET)) {
+        return std::strerror(errno);
+    }
+    uint64_t prerollBytes = 0;
+    error = feed(audio, st, begin - from, prerollBytes);
+    if (error.empty() && begin > 0) {
+        ebur128_start_segment(st, static_cast<size_t>(begin));
+    }
+    if (error.empty()) {
+        error = feed(audio, st, job.starts[segment + 1] - begin, bytes);
+    }
+    return error;
+}
+
+// Reports a file once all its segments are merged
+Result finish(Job& job, bool truePeak, ebur128_pool* meters) {
+    Result result;
+    result.path = job.path;
+    result.error = job.error;
+    result.bytes = job.bytes;
+    if (result.error.empty()) {
+        result.duration = static_cast<double>(job.frames) / static_cast<double>(job.sampleRate);
+        ebur128_state* st = job.merged;
+        ebur128_loudness_global(st, &result.integrated);
+        ebur128_loudness_range(st, &result.range);
+        double samplePeak = 0.0;
+        double truePeakValue = 0.0;
+        for (unsigned int ch = 0; ch < st->channels; ++ch) {
+            double peak;
+            if (ebur128_sample_peak(st, ch, &peak) == EBUR128_SUCCESS) {
+                samplePeak = std::max(samplePeak, peak);
+            }
+            if (truePeak && ebur128_true_peak(st, ch, &peak) == EBUR128_SUCCESS) {
+                truePeakValue = std::max(truePeakValue, peak);
+            }
+        }
+        result.samplePeak = toDecibels(samplePeak);
+        result.truePeak = truePeak ? toDecibels(truePeakValue) : NAN;
+    }
+    ebur128_pool_release(meters, job.merged);
+    job.merged = nullptr;
+    return result;
+}
+
+// Per-worker task queues. A worker takes its own tasks from the front and,
+// once they run out, steals from the back of the other queues.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned int workers) : queues_(workers) {}
+
+    void push(unsigned int worker, size_t task) {
+        queues_[worker].tasks.push_back(task);
+    }
+
+    template <typename Work>
+    void run(Work work) {
+        std::vector<std::thread> threads;
+        for (unsigned int w = 0; w < queues_.size(); ++w) {
+            threads.emplace_back([this, w, &work]() {
+                size_t task;
+                while (next(w, task)) {
+                    work(task);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    bool next(unsigned int worker, size_t& task) {
+        {
+            Queue& own = queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        // No tasks are added while running, so empty queues stay empty
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& victim = queues_[(worker + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Queue> queues_;
+};
+
+std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out + "\"";
+}
+
+std::string csvString(const std::string& text) {
+    if (text.find_first_of(",\"\r\n") == std::string::npos) {
+        return text;
+    }
+    std::string out = "\"";
+    for (char c : text) {
+        out += c;
+        if (c == '"') {
+            out += '"';
+        }
+    }
+    return out + "\"";
+}
+
+// Formats a measurement with three decimals. JSON has no infinities, so
+// silence and skipped values are null there and -inf or empty in CSV.
+std::string number(double value, bool json) {
+    if (std::isnan(value)) {
+        return json ? "null" : "";
+    }
+    if (std::isinf(value)) {
+        return json ? "null" : (value < 0 ? "-inf" : "inf");
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.3f", value);
+    return text;
+}
+
+std::string formatResult(const Result& result, bool csv) {
+    if (csv) {
+        if (!result.error.empty()) {
+            return csvString(result.path) + ",,,,,," + csvString(result.error) + "\n";
+        }
+        return csvString(result.path) + "," + number(result.duration, false) + "," +
+               number(result.integrated, false) + "," + number(result.range, false) + "," +
+               number(result.samplePeak, false) + "," + number(result.truePeak, false) + ",\n";
+    }
+    if (!result.error.empty()) {
+        return "{\"path\":" + jsonString(result.path) + ",\"error\":" + jsonString(result.error) + "}\n";
+    }
+    return "{\"path\":" + jsonString(result.path) + ",\"duration\":" + number(result.duration, true) +
+           ",\"integrated\":" + number(result.integrated, true) + ",\"lra\":" + number(result.range, true) +
+           ",\"sample_peak\":" + number(result.samplePeak, true) +
+           ",\"true_peak\":" + number(result.truePeak, true) + "}\n";
+}
+
+bool isAudioExtension(const fs::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return extension == ".wav" || extension == ".wave" || extension == ".rf64" || extension == ".aif" ||
+           extension == ".aiff" || extension == ".aifc";
+}
+
+void addPath(std::vector<std::string>& files, const std::string& path) {
+    std::error_code error;
+    if (!fs::is_directory(path, error)) {
+        files.push_back(path);
+        return;
+    }
+    for (fs::recursive_directory_iterator it(path, error), end; !error && it != end; it.increment(error)) {
+        if (it->is_regular_file(error) && isAudioExtension(it->path())) {
+            files.push_back(it->path().string());
+        }
+    }
+}
+
+int usage() {
+    std::cerr << "usage: ebur128_batch [-j threads] [--csv] [--no-true-peak] [--segment seconds]\n"
+                 "                     [--files-from list] path...\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    bool csv = false;
+    bool truePeak = true;
+    double segmentSeconds = 600.0;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) {
+            threads = static_cast<unsigned int>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--csv") {
+            csv = true;
+        } else if (arg == "--segment" && i + 1 < argc) {
+            segmentSeconds = std::max(0.0, std::atof(argv[++i]));
+        } else if (arg == "--no-true-peak") {
+            truePeak = false;
+        } else if (arg == "--files-from" && i + 1 < argc) {
+            std::string list = argv[++i];
+            std::ifstream listFile;
+            if (list != "-") {
+                listFile.open(list);
+                if (!listFile) {
+                    std::cerr << "ebur128_batch: cannot open " << list << "\n";
+                    return 1;
+                }
+            }
+            std::istream& in = list == "-" ? std::cin : listFile;
+            for (std::string line; std::getline(in, line);) {
+                if (!line.empty()) {
+                    addPath(files, line);
+                }
+            }
+        } else if (!arg.empty() && arg[0] == '-') {
+            return usage();
+        } else {
+            addPath(files, arg);
+        }
+    }
+    if (files.empty()) {
+        return usage();
+    }
+
+    WorkStealingPool pool(threads);
+    // Meters are reused across files: each worker holds at most the meter of
+    // its segment and, until the file is done, the one its segments merge into
+    ebur128_pool* meters = ebur128_pool_create(2 * threads, nullptr);
+    if (!meters) {
+        std::fputs("out of memory\n", stderr);
+        return 1;
+    }
+    std::vector<Job> jobs(files.size());
+    auto start = std::chrono::steady_clock::now();
+
+    // Read all headers first, so that long files can be split
+    for (size_t i = 0; i < files.size(); ++i) {
+        jobs[i].path = files[i];
+        pool.push(static_cast<unsigned int>(i % threads), i);
+    }
+    pool.run([&](size_t job) { plan(jobs[job], segmentSeconds); });
+
+    // Largest segments first, dealt round-robin, so the longest ones do not
+    // start last and stealing only has to balance the small ones
+    std::vector<Task> tasks;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        for (size_t s = 0; s + 1 < jobs[j].starts.size(); ++s) {
+            tasks.push_back({j, s, jobs[j].starts[s + 1] - jobs[j].starts[s]});
+        }
+    }
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const Task& a, const Task& b) { return a.bytes > b.bytes; });
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        pool.push(static_cast<unsigned int>(i % threads), i);
+    }
+
+    if (csv) {
+        std::fputs("path,duration_s,integrated_lufs,lra_lu,sample_peak_dbfs,true_peak_dbtp,error\n", stdout);
+    }
+    std::mutex outputMutex;
+    double audioSeconds = 0.0;
+    uint64_t audioBytes = 0;
+    size_t failed = 0;
+    pool.run([&](size_t index) {
+        Job& job = jobs[tasks[index].job];
+        size_t segment = tasks[index].segment;
+        ebur128_state* st = nullptr;
+        uint64_t bytes = 0;
+        std::string error = job.error.empty() ? measureSegment(job, segment, truePeak, meters, &st, bytes) : "";
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            if (st && !job.merged) {
+                job.merged = st;
+            } else if (st) {
+                if (ebur128_merge(job.merged, st) != EBUR128_SUCCESS && error.empty()) {
+                    error = "out of memory";
+                }
+                ebur128_pool_release(meters, st);
+            }
+            job.bytes += bytes;
+            if (job.error.empty()) {
+                job.error = error;
+            }
+            if (--job.pending > 0) {
+                return;
+            }
+        }
+        // The last segment of the file to finish reports it
+        Result result = finish(job, truePeak, meters);
+        std::string line = formatResult(result, csv);
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::fputs(line.c_str(), stdout);
+        std::fflush(stdout);
+        audioSeconds += result.duration;
+        audioBytes += result.bytes;
+        failed += !result.error.empty();
+    });
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ebur128_pool_destroy(&meters);
+
+    std::fprintf(stderr,
+                 "%zu files (%zu failed), %.1f s of audio in %.2f s on %u threads: "
+                 "%.1fx realtime, %.1f MB/s\n",
+                 files.size(), failed, audioSeconds, wallSeconds, threads,
+                 wallSeconds > 0.0 ? audioSeconds / wallSeconds : 0.0,
+                 wallSeconds > 0.0 ? static_cast<double>(audioBytes) / wallSeconds / 1e6 : 0.0);
+    return failed ? 1 : 0;
+}
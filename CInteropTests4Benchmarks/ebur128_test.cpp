@@ -2,7 +2,14 @@
 #include "gtest/gtest.h"
 #include <cmath>
 #include <vector>
+#include <algorithm>
 #include <chrono>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <atomic>
+#include <thread>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -42,6 +49,252 @@ protected:
         std::vector<float> samples(totalFrames * channels, 0.0f);
         return samples;
     }
+
+    // Helper function to generate interleaved audio with a different tone and
+    // level on every channel, scaled to the full range of the sample type
+    template <typename T>
+    std::vector<T> generateMultichannelSignal(int sampleRate, int channels, double duration,
+                                              double fullScale) {
+        int totalFrames = static_cast<int>(sampleRate * duration);
+        std::vector<T> samples(totalFrames * channels);
+
+        for (int frame = 0; frame < totalFrames; ++frame) {
+            double t = static_cast<double>(frame) / sampleRate;
+            for (int ch = 0; ch < channels; ++ch) {
+                double amplitude = 0.6 / (1.0 + 0.3 * ch) * (1.0 + 0.5 * sin(2.0 * M_PI * 0.7 * t));
+                double value = amplitude * sin(2.0 * M_PI * (220.0 + 370.0 * ch) * t);
+                samples[frame * channels + ch] = static_cast<T>(value * fullScale);
+            }
+        }
+
+        return samples;
+    }
+
+    // Allocator that counts the allocations and the blocks not yet freed,
+    // and fails the test if it is called while `forbidden` is set. New
+    // memory is filled with NaNs, so reading it before writing shows.
+    struct CountingAllocator {
+        size_t allocations = 0;
+        size_t live = 0;
+        bool forbidden = false;
+
+        static void* allocate(size_t size, void* user) {
+            CountingAllocator* counter = static_cast<CountingAllocator*>(user);
+            if (counter->forbidden) {
+                ADD_FAILURE() << "allocated " << size << " bytes";
+            }
+            ++counter->allocations;
+            ++counter->live;
+            void* ptr = malloc(size);
+            if (ptr) {
+                memset(ptr, 0xff, size);
+            }
+            return ptr;
+        }
+        static void* reallocate(void* ptr, size_t size, void* user) {
+            CountingAllocator* counter = static_cast<CountingAllocator*>(user);
+            if (counter->forbidden) {
+                ADD_FAILURE() << "reallocated to " << size << " bytes";
+            }
+            ++counter->allocations;
+            if (!ptr) {
+                ++counter->live;
+            }
+            return realloc(ptr, size);
+        }
+        static void deallocate(void* ptr, void* user) {
+            CountingAllocator* counter = static_cast<CountingAllocator*>(user);
+            if (counter->forbidden) {
+                ADD_FAILURE() << "freed memory";
+            }
+            --counter->live;
+            free(ptr);
+        }
+    };
+
+    // Straightforward polyphase oversampler with the library's 49-tap
+    // Hann-windowed sinc, keeping the whole input of every channel. Returns
+    // the largest absolute oversampled or input value per channel for each
+    // call, as ebur128_prev_true_peak() reports it.
+    class ReferenceOversampler {
+    public:
+        ReferenceOversampler(unsigned int factor, int channels)
+            : factor_(factor), history_(channels) {
+            const int taps = 49;
+            for (int j = 0; j < taps; ++j) {
+                double m = j - (taps - 1) / 2.0;
+                double c = 1.0;
+                if (std::fabs(m) > 0.000001) {
+                    c = sin(m * M_PI / factor) / (m * M_PI / factor);
+                }
+                c *= 0.5 * (1 - cos(2 * M_PI * j / (taps - 1)));
+                coeffs_.push_back(c);
+            }
+        }
+
+        std::vector<double> process(const double* interleaved, size_t frames) {
+            int channels = static_cast<int>(history_.size());
+            std::vector<double> peaks(channels, 0.0);
+            for (int ch = 0; ch < channels; ++ch) {
+                std::vector<float>& x = history_[ch];
+                for (size_t i = 0; i < frames; ++i) {
+                    double sample = interleaved[i * channels + ch];
+                    peaks[ch] = std::max(peaks[ch], std::fabs(sample));
+                    x.push_back(static_cast<float>(sample));
+                    long n = static_cast<long>(x.size()) - 1;
+                    for (unsigned int f = 0; f < factor_; ++f) {
+                        double acc = 0.0;
+                        for (size_t j = f; j < coeffs_.size(); j += factor_) {
+                            long k = n - static_cast<long>(j / factor_);
+                            if (std::fabs(coeffs_[j]) > 0.000001 && k >= 0) {
+                                acc += static_cast<double>(x[k]) * coeffs_[j];
+                            }
+                        }
+                        peaks[ch] = std::max(peaks[ch], std::fabs(static_cast<double>(
+                                                            static_cast<float>(acc))));
+                    }
+                }
+            }
+            return peaks;
+        }
+
+    private:
+        unsigned int factor_;
+        std::vector<double> coeffs_;
+        std::vector<std::vector<float>> history_;
+    };
+
+    // Type-dispatching wrappers around the ebur128_add_frames_* family
+    static int addFrames(ebur128_state* st, const short* src, size_t frames) {
+        return ebur128_add_frames_short(st, src, frames);
+    }
+    static int addFrames(ebur128_state* st, const int* src, size_t frames) {
+        return ebur128_add_frames_int(st, src, frames);
+    }
+    static int addFrames(ebur128_state* st, const float* src, size_t frames) {
+        return ebur128_add_frames_float(st, src, frames);
+    }
+    static int addFrames(ebur128_state* st, const double* src, size_t frames) {
+        return ebur128_add_frames_double(st, src, frames);
+    }
+    static int addFramesPlanar(ebur128_state* st, const short* const* src, size_t frames) {
+        return ebur128_add_frames_planar_short(st, src, frames);
+    }
+    static int addFramesPlanar(ebur128_state* st, const int* const* src, size_t frames) {
+        return ebur128_add_frames_planar_int(st, src, frames);
+    }
+    static int addFramesPlanar(ebur128_state* st, const float* const* src, size_t frames) {
+        return ebur128_add_frames_planar_float(st, src, frames);
+    }
+    static int addFramesPlanar(ebur128_state* st, const double* const* src, size_t frames) {
+        return ebur128_add_frames_planar_double(st, src, frames);
+    }
+
+    // Feeds the same signal interleaved to one state and planar to another,
+    // in chunks of varying size, and expects identical results.
+    template <typename T>
+    void expectPlanarMatchesInterleaved(int channels, double fullScale) {
+        const int sampleRate = 44100;
+        const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK |
+                         EBUR128_MODE_TRUE_PEAK;
+        auto signal = generateMultichannelSignal<T>(sampleRate, channels, 5.0, fullScale);
+        size_t totalFrames = signal.size() / channels;
+
+        std::vector<std::vector<T>> planes(channels, std::vector<T>(totalFrames));
+        for (size_t frame = 0; frame < totalFrames; ++frame) {
+            for (int ch = 0; ch < channels; ++ch) {
+                planes[ch][frame] = signal[frame * channels + ch];
+            }
+        }
+
+        ebur128_state* interleaved = ebur128_init(channels, sampleRate, mode);
+        ebur128_state* planar = ebur128_init(channels, sampleRate, mode);
+        ASSERT_NE(interleaved, nullptr);
+        ASSERT_NE(planar, nullptr);
+
+        std::vector<const T*> pointers(channels);
+        size_t offset = 0;
+        for (size_t chunk = 1; offset < totalFrames; chunk = chunk * 3 + 7) {
+            size_t frames = std::min(chunk % 20000, totalFrames - offset);
+            for (int ch = 0; ch < channels; ++ch) {
+                pointers[ch] = planes[ch].data() + offset;
+            }
+            ASSERT_EQ(addFrames(interleaved, signal.data() + offset * channels, frames),
+                      EBUR128_SUCCESS);
+            ASSERT_EQ(addFramesPlanar(planar, pointers.data(), frames), EBUR128_SUCCESS);
+            offset += frames;
+
+            double expected, actual;
+            ebur128_loudness_momentary(interleaved, &expected);
+            ebur128_loudness_momentary(planar, &actual);
+            EXPECT_EQ(expected, actual);
+            for (int ch = 0; ch < channels; ++ch) {
+                ebur128_prev_sample_peak(interleaved, ch, &expected);
+                ebur128_prev_sample_peak(planar, ch, &actual);
+                EXPECT_EQ(expected, actual);
+                ebur128_prev_true_peak(interleaved, ch, &expected);
+                ebur128_prev_true_peak(planar, ch, &actual);
+                EXPECT_EQ(expected, actual);
+            }
+        }
+
+        double expected, actual;
+        ebur128_loudness_global(interleaved, &expected);
+        ebur128_loudness_global(planar, &actual);
+        EXPECT_EQ(expected, actual);
+        ebur128_loudness_range(interleaved, &expected);
+        ebur128_loudness_range(planar, &actual);
+        EXPECT_EQ(expected, actual);
+        for (int ch = 0; ch < channels; ++ch) {
+            ebur128_true_peak(interleaved, ch, &expected);
+            ebur128_true_peak(planar, ch, &actual);
+            EXPECT_EQ(expected, actual);
+        }
+
+        ebur128_destroy(&interleaved);
+        ebur128_destroy(&planar);
+    }
+
+    // Feeds every channel of a multichannel state, with all but one channel
+    // unused, and a mono state with the same channel alone, then compares the
+    // momentary loudness after every chunk.
+    template <typename T>
+    void expectChannelsMatchMono(int channels, double fullScale) {
+        const int sampleRate = 48000;
+        const size_t chunk = 4410; // not a multiple of the 100ms block size
+        auto signal = generateMultichannelSignal<T>(sampleRate, channels, 2.0, fullScale);
+        size_t totalFrames = signal.size() / channels;
+
+        for (int used = 0; used < channels; ++used) {
+            ebur128_state* multi = ebur128_init(channels, sampleRate, EBUR128_MODE_M);
+            ebur128_state* mono = ebur128_init(1, sampleRate, EBUR128_MODE_M);
+            ASSERT_NE(multi, nullptr);
+            ASSERT_NE(mono, nullptr);
+            for (int ch = 0; ch < channels; ++ch) {
+                ebur128_set_channel(multi, ch, ch == used ? EBUR128_LEFT : EBUR128_UNUSED);
+            }
+
+            std::vector<T> monoSignal(totalFrames);
+            for (size_t frame = 0; frame < totalFrames; ++frame) {
+                monoSignal[frame] = signal[frame * channels + used];
+            }
+
+            for (size_t offset = 0; offset < totalFrames; offset += chunk) {
+                size_t frames = std::min(chunk, totalFrames - offset);
+                ASSERT_EQ(addFrames(multi, signal.data() + offset * channels, frames), EBUR128_SUCCESS);
+                ASSERT_EQ(addFrames(mono, monoSignal.data() + offset, frames), EBUR128_SUCCESS);
+
+                double multiLoudness, monoLoudness;
+                ebur128_loudness_momentary(multi, &multiLoudness);
+                ebur128_loudness_momentary(mono, &monoLoudness);
+                EXPECT_NEAR(multiLoudness, monoLoudness, 1e-9)
+                    << "channels: " << channels << ", used channel: " << used;
+            }
+
+            ebur128_destroy(&multi);
+            ebur128_destroy(&mono);
+        }
+    }
 };
 
 // Test basic library initialization and destruction
@@ -351,6 +604,76 @@ TEST_F(EBUR128Test, MultipleInstances) {
     }
 }
 
+// Test creating, feeding and destroying states from many threads at once.
+// Every thread must get exactly the results of a single-threaded run; build
+// with -DENABLE_TSAN=ON to also check for data races.
+TEST_F(EBUR128Test, ConcurrentInstances) {
+    const int numThreads = 8;
+    const int iterations = 6;
+    const int sampleRate = 44100;
+    const int modes[] = {
+        EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK,
+        EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_HISTOGRAM,
+        EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_LOW_MEMORY,
+    };
+    const int numModes = sizeof(modes) / sizeof(modes[0]);
+    auto signal = generateMultichannelSignal<short>(sampleRate, 2, 5.0, 32767.0);
+
+    auto measure = [&](int mode, double* results) {
+        ebur128_state* st = ebur128_init(2, sampleRate, mode);
+        if (st == nullptr) {
+            return false;
+        }
+        size_t frames = signal.size() / 2;
+        bool ok = true;
+        // Uneven chunks, so that blocks complete at different offsets
+        for (size_t offset = 0; ok && offset < frames; offset += 3001) {
+            size_t chunk = std::min<size_t>(3001, frames - offset);
+            ok = ebur128_add_frames_short(st, signal.data() + offset * 2, chunk) ==
+                 EBUR128_SUCCESS;
+        }
+        ok = ok && ebur128_loudness_global(st, &results[0]) == EBUR128_SUCCESS;
+        ok = ok && ebur128_loudness_range(st, &results[1]) == EBUR128_SUCCESS;
+        ok = ok && ebur128_sample_peak(st, 0, &results[2]) == EBUR128_SUCCESS;
+        results[3] = 0.0;
+        if ((mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+            ok = ok && ebur128_true_peak(st, 1, &results[3]) == EBUR128_SUCCESS;
+        }
+        ebur128_destroy(&st);
+        return ok;
+    };
+
+    double expected[numModes][4];
+    for (int m = 0; m < numModes; ++m) {
+        ASSERT_TRUE(measure(modes[m], expected[m]));
+    }
+
+    std::vector<std::vector<double>> results(numThreads,
+                                             std::vector<double>(iterations * 4));
+    std::vector<int> succeeded(numThreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < iterations; ++i) {
+                succeeded[t] += measure(modes[(t + i) % numModes], &results[t][i * 4]);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (int t = 0; t < numThreads; ++t) {
+        EXPECT_EQ(succeeded[t], iterations) << "thread " << t;
+        for (int i = 0; i < iterations; ++i) {
+            for (int k = 0; k < 4; ++k) {
+                EXPECT_EQ(results[t][i * 4 + k], expected[(t + i) % numModes][k])
+                    << "thread " << t << ", iteration " << i << ", value " << k;
+            }
+        }
+    }
+}
+
 // Test window-based loudness measurement
 TEST_F(EBUR128Test, WindowLoudness) {
     ebur128_state* st = ebur128_init(1, 48000, EBUR128_MODE_M);
@@ -571,3 +894,2172 @@ TEST_F(EBUR128Test, RealWorldAudioFilePerformance) {
     
     ebur128_destroy(&st);
 }
+
+// Test that the channel-parallel filter matches the scalar filter used for a
+// single channel, for every sample type and for layouts that leave a remainder
+TEST_F(EBUR128Test, VectorizedFilterMatchesScalar) {
+    for (int channels : {2, 5, 6, 8, 12, 16}) {
+        expectChannelsMatchMono<short>(channels, 32767.0);
+        expectChannelsMatchMono<int>(channels, 2147483647.0);
+        expectChannelsMatchMono<float>(channels, 1.0);
+        expectChannelsMatchMono<double>(channels, 1.0);
+    }
+}
+
+// Test momentary, integrated and LRA values, which are now summed from 100ms
+// sub-blocks, against a straightforward BS.1770 / TECH 3342 implementation
+TEST_F(EBUR128Test, SubBlockEnergiesMatchReference) {
+    const int sampleRate = 48000;
+    const size_t block = 4800;
+    auto signal = generateMultichannelSignal<double>(sampleRate, 1, 12.0, 1.0);
+    for (size_t i = 0; i < signal.size(); ++i) {
+        signal[i] *= (i / (sampleRate * 2)) % 2 ? 0.1 : 1.0; // 20 dB steps
+    }
+
+    // K-weighting coefficients for 48 kHz from ITU BS.1770
+    const double b1[3] = {1.53512485958697, -2.69169618940638, 1.19839281085285};
+    const double a1[3] = {1.0, -1.69065929318241, 0.73248077421585};
+    const double b2[3] = {1.0, -2.0, 1.0};
+    const double a2[3] = {1.0, -1.99004745483398, 0.99007225036621};
+    std::vector<double> subBlocks(signal.size() / block, 0.0);
+    std::vector<double> stage1(subBlocks.size() * block);
+    double x1 = 0, x2 = 0, y1 = 0, y2 = 0, z1 = 0, z2 = 0;
+    // High shelf stage
+    for (size_t i = 0; i < stage1.size(); ++i) {
+        double y = b1[0] * signal[i] + b1[1] * x1 + b1[2] * x2 - a1[1] * y1 - a1[2] * y2;
+        x2 = x1; x1 = signal[i]; y2 = y1; y1 = y;
+        stage1[i] = y;
+    }
+    // RLB high-pass stage, summed into 100ms sub-blocks
+    x1 = x2 = 0;
+    for (size_t i = 0; i < stage1.size(); ++i) {
+        double z = b2[0] * stage1[i] + b2[1] * x1 + b2[2] * x2 - a2[1] * z1 - a2[2] * z2;
+        x2 = x1; x1 = stage1[i]; z2 = z1; z1 = z;
+        subBlocks[i / block] += z * z;
+    }
+
+    auto loudness = [](double energy) { return 10.0 * log10(energy) - 0.691; };
+    auto windowEnergy = [&](size_t end, size_t count) {
+        double sum = 0.0;
+        for (size_t j = end - count; j < end; ++j) {
+            sum += subBlocks[j];
+        }
+        return sum / (count * block);
+    };
+
+    ebur128_state* st = ebur128_init(1, sampleRate, EBUR128_MODE_I | EBUR128_MODE_LRA);
+    ASSERT_NE(st, nullptr);
+    std::vector<double> gatingBlocks, shortTermBlocks;
+    for (size_t end = 1; end <= subBlocks.size(); ++end) {
+        ASSERT_EQ(ebur128_add_frames_double(st, signal.data() + (end - 1) * block, block),
+                  EBUR128_SUCCESS);
+        double momentary;
+        ebur128_loudness_momentary(st, &momentary);
+        if (end >= 4) {
+            gatingBlocks.push_back(windowEnergy(end, 4));
+            EXPECT_NEAR(momentary, loudness(gatingBlocks.back()), 1e-6);
+        }
+        if (end >= 30 && end % 10 == 0) {
+            shortTermBlocks.push_back(windowEnergy(end, 30));
+        }
+    }
+
+    // Integrated loudness with absolute and relative gating
+    double sum = 0.0;
+    size_t count = 0;
+    for (double e : gatingBlocks) {
+        if (loudness(e) >= -70.0) { sum += e; ++count; }
+    }
+    double relativeGate = sum / count * 0.1;
+    sum = 0.0;
+    count = 0;
+    for (double e : gatingBlocks) {
+        if (loudness(e) >= -70.0 && e >= relativeGate) { sum += e; ++count; }
+    }
+    double integrated;
+    ASSERT_EQ(ebur128_loudness_global(st, &integrated), EBUR128_SUCCESS);
+    EXPECT_NEAR(integrated, loudness(sum / count), 1e-6);
+
+    // Loudness range
+    std::vector<double> gated;
+    sum = 0.0;
+    for (double e : shortTermBlocks) sum += e;
+    for (double e : shortTermBlocks) {
+        if (e >= sum / shortTermBlocks.size() * 0.01) gated.push_back(e);
+    }
+    std::sort(gated.begin(), gated.end());
+    double expectedRange = loudness(gated[(size_t)((gated.size() - 1) * 0.95 + 0.5)]) -
+                           loudness(gated[(size_t)((gated.size() - 1) * 0.1 + 0.5)]);
+    double range;
+    ASSERT_EQ(ebur128_loudness_range(st, &range), EBUR128_SUCCESS);
+    EXPECT_NEAR(range, expectedRange, 1e-6);
+    EXPECT_GT(range, 3.0);
+
+    ebur128_destroy(&st);
+}
+
+// Test that the low-memory mode, which keeps no filtered audio, gives the same
+// results as the default mode on 100ms boundaries and rounds other queries
+// down to the last complete 100ms block
+TEST_F(EBUR128Test, LowMemoryMode) {
+    const int sampleRate = 48000;
+    const int channels = 6;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK;
+    ebur128_state* full = ebur128_init(channels, sampleRate, mode);
+    ebur128_state* low = ebur128_init(channels, sampleRate, mode | EBUR128_MODE_LOW_MEMORY);
+    ASSERT_NE(full, nullptr);
+    ASSERT_NE(low, nullptr);
+    ASSERT_EQ(ebur128_set_max_window(full, 5000), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_set_max_window(low, 5000), EBUR128_SUCCESS);
+
+    auto signal = generateMultichannelSignal<float>(sampleRate, channels, 10.0, 1.0);
+    const size_t chunk = sampleRate / 10;
+    for (size_t offset = 0; offset + chunk <= signal.size() / channels; offset += chunk) {
+        ASSERT_EQ(ebur128_add_frames_float(full, signal.data() + offset * channels, chunk),
+                  EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_add_frames_float(low, signal.data() + offset * channels, chunk),
+                  EBUR128_SUCCESS);
+
+        double fullValue, lowValue;
+        ebur128_loudness_momentary(full, &fullValue);
+        ebur128_loudness_momentary(low, &lowValue);
+        EXPECT_EQ(fullValue, lowValue);
+        ebur128_loudness_shortterm(full, &fullValue);
+        ebur128_loudness_shortterm(low, &lowValue);
+        EXPECT_EQ(fullValue, lowValue);
+        ebur128_loudness_window(full, 4500, &fullValue);
+        ebur128_loudness_window(low, 4500, &lowValue);
+        EXPECT_EQ(fullValue, lowValue);
+    }
+
+    double fullValue, lowValue;
+    ebur128_loudness_global(full, &fullValue);
+    ebur128_loudness_global(low, &lowValue);
+    EXPECT_EQ(fullValue, lowValue);
+    ebur128_loudness_range(full, &fullValue);
+    ebur128_loudness_range(low, &lowValue);
+    EXPECT_EQ(fullValue, lowValue);
+    ebur128_sample_peak(full, 0, &fullValue);
+    ebur128_sample_peak(low, 0, &lowValue);
+    EXPECT_EQ(fullValue, lowValue);
+
+    // Between 100ms boundaries the low-memory state reports the last block
+    double momentaryAtBoundary;
+    ebur128_loudness_momentary(low, &momentaryAtBoundary);
+    ASSERT_EQ(ebur128_add_frames_float(low, signal.data(), chunk / 2), EBUR128_SUCCESS);
+    ebur128_loudness_momentary(low, &lowValue);
+    EXPECT_EQ(lowValue, momentaryAtBoundary);
+
+    ebur128_destroy(&full);
+    ebur128_destroy(&low);
+}
+
+// Test that planar input gives exactly the results of the same audio
+// interleaved, for every sample type
+TEST_F(EBUR128Test, PlanarMatchesInterleaved) {
+    for (int channels : {1, 2, 6}) {
+        expectPlanarMatchesInterleaved<short>(channels, 32767.0);
+        expectPlanarMatchesInterleaved<int>(channels, 2147483647.0);
+        expectPlanarMatchesInterleaved<float>(channels, 1.0);
+        expectPlanarMatchesInterleaved<double>(channels, 1.0);
+    }
+}
+
+// Test that the block history keeps only the newest blocks, both when it is
+// limited from the start and when it is shortened after growing past its
+// initial capacity
+TEST_F(EBUR128Test, MaxHistoryKeepsNewestBlocks) {
+    const int sampleRate = 8000;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA;
+    auto loudPart = generateSineWave(1000.0, pow(10.0, -10.0 / 20.0), sampleRate, 1, 80.0);
+    auto quietPart = generateSineWave(1000.0, pow(10.0, -30.0 / 20.0), sampleRate, 1, 70.0);
+
+    ebur128_state* limited = ebur128_init(1, sampleRate, mode);
+    ebur128_state* unlimited = ebur128_init(1, sampleRate, mode);
+    ebur128_state* quiet = ebur128_init(1, sampleRate, mode);
+    ASSERT_NE(limited, nullptr);
+    ASSERT_NE(unlimited, nullptr);
+    ASSERT_NE(quiet, nullptr);
+    EXPECT_EQ(ebur128_set_max_history(limited, 60000), EBUR128_SUCCESS);
+
+    for (ebur128_state* st : {limited, unlimited}) {
+        ASSERT_EQ(ebur128_add_frames_float(st, loudPart.data(), loudPart.size()),
+                  EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_add_frames_float(st, quietPart.data(), quietPart.size()),
+                  EBUR128_SUCCESS);
+    }
+    ASSERT_EQ(ebur128_add_frames_float(quiet, quietPart.data(), quietPart.size()),
+              EBUR128_SUCCESS);
+
+    double expected, actual, range;
+    ebur128_loudness_global(quiet, &expected);
+    ebur128_loudness_global(limited, &actual);
+    EXPECT_NEAR(actual, expected, 0.01);
+    ebur128_loudness_range(limited, &range);
+    EXPECT_NEAR(range, 0.0, 0.01);
+
+    // The full history still contains the loud part
+    ebur128_loudness_global(unlimited, &actual);
+    EXPECT_GT(actual, expected + 5.0);
+    ebur128_loudness_range(unlimited, &range);
+    EXPECT_GT(range, 10.0);
+
+    // Shortening the history drops the oldest blocks, and lengthening it
+    // again does not bring them back
+    EXPECT_EQ(ebur128_set_max_history(unlimited, 20000), EBUR128_SUCCESS);
+    ebur128_loudness_global(unlimited, &actual);
+    EXPECT_NEAR(actual, expected, 0.01);
+    EXPECT_EQ(ebur128_set_max_history(unlimited, 200000), EBUR128_SUCCESS);
+    ebur128_loudness_global(unlimited, &actual);
+    EXPECT_NEAR(actual, expected, 0.01);
+    ebur128_loudness_range(unlimited, &range);
+    EXPECT_NEAR(range, 0.0, 0.01);
+
+    ebur128_destroy(&limited);
+    ebur128_destroy(&unlimited);
+    ebur128_destroy(&quiet);
+}
+
+// Test integrated loudness and the relative threshold after every 100ms
+// against gating recomputed from scratch. At 100ms boundaries the momentary
+// loudness is the loudness of the newest gating block, so the block
+// energies can be read back from it.
+TEST_F(EBUR128Test, IncrementalGatingMatchesRecomputation) {
+    const int sampleRate = 8000;
+    const size_t chunk = sampleRate / 10;
+    const double absoluteGate = pow(10.0, (-70.0 + 0.691) / 10.0);
+    ebur128_state* st = ebur128_init(1, sampleRate, EBUR128_MODE_I);
+    ASSERT_NE(st, nullptr);
+
+    std::vector<double> blocks;
+    size_t maxBlocks = blocks.max_size();
+    std::vector<float> buffer(chunk);
+    unsigned int seed = 12345;
+    for (int step = 0; step < 3000; ++step) {
+        if (step == 1500) {
+            // From now on only the last minute counts
+            EXPECT_EQ(ebur128_set_max_history(st, 60000), EBUR128_SUCCESS);
+            maxBlocks = 600;
+        }
+        // A new level between 0 and -40 dB every 300ms, or silence
+        if (step % 3 == 0) {
+            seed = seed * 1103515245u + 12345u;
+        }
+        double gain = -static_cast<double>((seed >> 8) % 4000) / 100.0;
+        double level = (seed >> 16) % 5 == 0 ? 0.0 : pow(10.0, gain / 20.0);
+        for (size_t i = 0; i < chunk; ++i) {
+            buffer[i] = static_cast<float>(level * sin(2.0 * M_PI * 997.0 * i / sampleRate));
+        }
+        ASSERT_EQ(ebur128_add_frames_float(st, buffer.data(), chunk), EBUR128_SUCCESS);
+        if (step < 3) {
+            continue;
+        }
+
+        double momentary;
+        ebur128_loudness_momentary(st, &momentary);
+        double energy = pow(10.0, (momentary + 0.691) / 10.0);
+        if (energy >= absoluteGate) {
+            blocks.push_back(energy);
+        }
+        if (blocks.size() > maxBlocks) {
+            blocks.erase(blocks.begin(), blocks.end() - maxBlocks);
+        }
+
+        double sum = 0.0;
+        for (double block : blocks) {
+            sum += block;
+        }
+        double threshold = sum / blocks.size() * pow(10.0, -10.0 / 10.0);
+        double gatedSum = 0.0;
+        size_t gatedCount = 0;
+        for (double block : blocks) {
+            if (block >= threshold) {
+                gatedSum += block;
+                ++gatedCount;
+            }
+        }
+
+        double global, relative;
+        ebur128_loudness_global(st, &global);
+        ebur128_relative_threshold(st, &relative);
+        if (blocks.empty()) {
+            EXPECT_EQ(global, -HUGE_VAL);
+            EXPECT_EQ(relative, -70.0);
+            continue;
+        }
+        EXPECT_NEAR(global, 10.0 * log10(gatedSum / gatedCount) - 0.691, 1e-6)
+            << "step " << step;
+        EXPECT_NEAR(relative, 10.0 * log10(threshold) - 0.691, 1e-6) << "step " << step;
+    }
+
+    ebur128_destroy(&st);
+}
+
+// Test the loudness range of one and of two states, polled every second,
+// against percentiles of the sorted short-term energies. At 1s boundaries the
+// short-term loudness is the loudness of the newest short-term block, so the
+// block energies can be read back from it.
+TEST_F(EBUR128Test, IncrementalLoudnessRangeMatchesSorting) {
+    const int sampleRate = 8000;
+    const double absoluteGate = pow(10.0, (-70.0 + 0.691) / 10.0);
+    ebur128_state* sts[2];
+    std::vector<double> blocks[2];
+    std::vector<float> buffer(sampleRate);
+    unsigned int seed = 777;
+    for (ebur128_state*& st : sts) {
+        st = ebur128_init(1, sampleRate, EBUR128_MODE_LRA);
+        ASSERT_NE(st, nullptr);
+    }
+
+    auto range = [](std::vector<double> energies) {
+        std::sort(energies.begin(), energies.end());
+        double sum = 0.0;
+        for (double energy : energies) {
+            sum += energy;
+        }
+        double gate = sum / energies.size() * pow(10.0, -20.0 / 10.0);
+        auto gated = std::lower_bound(energies.begin(), energies.end(), gate);
+        size_t count = energies.end() - gated;
+        if (count == 0) {
+            return 0.0;
+        }
+        double low = gated[static_cast<size_t>((count - 1) * 0.1 + 0.5)];
+        double high = gated[static_cast<size_t>((count - 1) * 0.95 + 0.5)];
+        return 10.0 * log10(high) - 10.0 * log10(low);
+    };
+
+    for (int second = 0; second < 900; ++second) {
+        for (int s = 0; s < 2; ++s) {
+            // Levels between 0 and -50 dB, some held for several seconds
+            if (second % (2 + s) == 0) {
+                seed = seed * 1103515245u + 12345u;
+            }
+            double gain = -static_cast<double>((seed >> 8) % 5000) / 100.0;
+            double level = (seed >> 20) % 7 == 0 ? 0.0 : pow(10.0, gain / 20.0);
+            for (int i = 0; i < sampleRate; ++i) {
+                buffer[i] = static_cast<float>(level * sin(2.0 * M_PI * 440.0 * i / sampleRate));
+            }
+            ASSERT_EQ(ebur128_add_frames_float(sts[s], buffer.data(), sampleRate),
+                      EBUR128_SUCCESS);
+            if (second < 2) {
+                continue;
+            }
+            double shortTerm;
+            ebur128_loudness_shortterm(sts[s], &shortTerm);
+            double energy = pow(10.0, (shortTerm + 0.691) / 10.0);
+            if (energy >= absoluteGate) {
+                blocks[s].push_back(energy);
+            }
+        }
+        if (blocks[0].empty() || blocks[1].empty()) {
+            continue;
+        }
+
+        double actual;
+        ebur128_loudness_range(sts[0], &actual);
+        EXPECT_NEAR(actual, range(blocks[0]), 1e-6) << "second " << second;
+        std::vector<double> all(blocks[0]);
+        all.insert(all.end(), blocks[1].begin(), blocks[1].end());
+        ebur128_loudness_range_multiple(sts, 2, &actual);
+        EXPECT_NEAR(actual, range(all), 1e-6) << "second " << second;
+    }
+
+    for (ebur128_state*& st : sts) {
+        ebur128_destroy(&st);
+    }
+}
+
+// Test loudness range and integrated loudness of long programmes of nearly
+// constant loudness, where almost every block has the same energy to within
+// 0.2%, against sorting, and time the queries. Selecting within a crowded
+// range of energies must not take longer than for spread loudness.
+TEST_F(EBUR128Test, SteadyLoudnessQueriesAreFast) {
+    const int sampleRate = 8000;
+    const int seconds[2] = {4 * 3600, 3600};
+    const double absoluteGate = pow(10.0, (-70.0 + 0.691) / 10.0);
+    ebur128_state* sts[2];
+    std::vector<double> blocks[2];
+    std::vector<float> tone(sampleRate);
+    std::vector<float> buffer(sampleRate);
+    unsigned int seed = 4242;
+    for (int i = 0; i < sampleRate; ++i) {
+        tone[i] = static_cast<float>(sin(2.0 * M_PI * 997.0 * i / sampleRate));
+    }
+
+    for (int s = 0; s < 2; ++s) {
+        sts[s] = ebur128_init(1, sampleRate, EBUR128_MODE_I | EBUR128_MODE_LRA);
+        ASSERT_NE(sts[s], nullptr);
+        for (int second = 0; second < seconds[s]; ++second) {
+            seed = seed * 1103515245u + 12345u;
+            double jitter = static_cast<int>((seed >> 8) % 2001) - 1000;
+            double level = 0.25 * (1.0 + 0.002 * jitter / 1000.0);
+            for (int i = 0; i < sampleRate; ++i) {
+                buffer[i] = static_cast<float>(level * tone[i]);
+            }
+            ASSERT_EQ(ebur128_add_frames_float(sts[s], buffer.data(), sampleRate),
+                      EBUR128_SUCCESS);
+            if (second < 2) {
+                continue;
+            }
+            double shortTerm;
+            ebur128_loudness_shortterm(sts[s], &shortTerm);
+            double energy = pow(10.0, (shortTerm + 0.691) / 10.0);
+            if (energy >= absoluteGate) {
+                blocks[s].push_back(energy);
+            }
+        }
+    }
+
+    auto range = [](std::vector<double> energies) {
+        std::sort(energies.begin(), energies.end());
+        double sum = 0.0;
+        for (double energy : energies) {
+            sum += energy;
+        }
+        double gate = sum / energies.size() * pow(10.0, -20.0 / 10.0);
+        auto gated = std::lower_bound(energies.begin(), energies.end(), gate);
+        size_t count = energies.end() - gated;
+        double low = gated[static_cast<size_t>((count - 1) * 0.1 + 0.5)];
+        double high = gated[static_cast<size_t>((count - 1) * 0.95 + 0.5)];
+        return 10.0 * log10(high) - 10.0 * log10(low);
+    };
+    std::vector<double> all(blocks[0]);
+    all.insert(all.end(), blocks[1].begin(), blocks[1].end());
+
+    // Average microseconds per call of query
+    auto time = [](int calls, const std::function<void()>& query) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < calls; ++i) {
+            query();
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::micro>(end - start).count() / calls;
+    };
+    double single, multiple, global;
+    double singleTime = time(1000, [&] { ebur128_loudness_range(sts[0], &single); });
+    double multipleTime =
+        time(100, [&] { ebur128_loudness_range_multiple(sts, 2, &multiple); });
+    double globalTime = time(1000, [&] { ebur128_loudness_global(sts[0], &global); });
+
+    EXPECT_NEAR(single, range(blocks[0]), 1e-6);
+    EXPECT_NEAR(multiple, range(all), 1e-6);
+    EXPECT_NEAR(global, -15.04, 0.01);
+    std::cout << "4 h steady programme: LRA " << singleTime << " us, LRA of 4 h + 1 h "
+              << multipleTime << " us, integrated " << globalTime << " us per call"
+              << std::endl;
+    // Sorting the 14,000 short-term blocks alone takes milliseconds.
+    EXPECT_LT(singleTime, 100.0);
+    EXPECT_LT(multipleTime, 500.0);
+    EXPECT_LT(globalTime, 100.0);
+
+    for (ebur128_state*& st : sts) {
+        ebur128_destroy(&st);
+    }
+}
+
+// Test that a fine histogram matches the exact list mode
+TEST_F(EBUR128Test, HistogramResolutionMatchesListMode) {
+    const int sampleRate = 8000;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA;
+    ebur128_state* list = ebur128_init(1, sampleRate, mode);
+    ebur128_state* fine = ebur128_init(1, sampleRate, mode | EBUR128_MODE_HISTOGRAM);
+    ebur128_state* coarse = ebur128_init(1, sampleRate, mode | EBUR128_MODE_HISTOGRAM);
+    ASSERT_NE(list, nullptr);
+    ASSERT_NE(fine, nullptr);
+    ASSERT_NE(coarse, nullptr);
+
+    EXPECT_EQ(ebur128_set_histogram_resolution(list, 0.01, -70.0, 30.0),
+              EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_set_histogram_resolution(fine, 0.0, -70.0, 30.0),
+              EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_set_histogram_resolution(fine, 0.01, 30.0, -70.0),
+              EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_set_histogram_resolution(fine, 1e-6, -70.0, 30.0),
+              EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_set_histogram_resolution(fine, 0.1, -70.0, 30.0),
+              EBUR128_ERROR_NO_CHANGE);
+    EXPECT_EQ(ebur128_set_histogram_resolution(fine, 0.01, -70.0, 10.0),
+              EBUR128_SUCCESS);
+
+    std::vector<float> buffer(sampleRate);
+    unsigned int seed = 4242;
+    for (int second = 0; second < 600; ++second) {
+        if (second % 3 == 0) {
+            seed = seed * 1103515245u + 12345u;
+        }
+        double gain = -static_cast<double>((seed >> 8) % 4000) / 100.0;
+        double level = pow(10.0, gain / 20.0);
+        for (int i = 0; i < sampleRate; ++i) {
+            buffer[i] = static_cast<float>(level * sin(2.0 * M_PI * 440.0 * i / sampleRate));
+        }
+        ASSERT_EQ(ebur128_add_frames_float(list, buffer.data(), sampleRate), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_add_frames_float(fine, buffer.data(), sampleRate), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_add_frames_float(coarse, buffer.data(), sampleRate), EBUR128_SUCCESS);
+    }
+
+    double expected, actual, expectedRange, actualRange;
+    ASSERT_EQ(ebur128_loudness_global(list, &expected), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_range(list, &expectedRange), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_global(fine, &actual), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_range(fine, &actualRange), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expected, 0.01);
+    EXPECT_NEAR(actualRange, expectedRange, 0.02);
+
+    // Blocks measured at 0.1 LU keep that accuracy when moved to finer bins
+    EXPECT_EQ(ebur128_set_histogram_resolution(coarse, 0.01, -70.0, 30.0),
+              EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_global(coarse, &actual), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_range(coarse, &actualRange), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expected, 0.1);
+    EXPECT_NEAR(actualRange, expectedRange, 0.2);
+
+    // LRA over histograms of different layouts is refused
+    ebur128_state* sts[2] = {fine, coarse};
+    EXPECT_EQ(ebur128_loudness_range_multiple(sts, 2, &actualRange),
+              EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_set_histogram_resolution(fine, 0.01, -70.0, 30.0),
+              EBUR128_SUCCESS);
+    EXPECT_EQ(ebur128_loudness_range_multiple(sts, 2, &actualRange),
+              EBUR128_SUCCESS);
+
+    ebur128_destroy(&list);
+    ebur128_destroy(&fine);
+    ebur128_destroy(&coarse);
+}
+
+// Test that a histogram with limited history matches the list mode
+TEST_F(EBUR128Test, HistogramMaxHistoryMatchesListMode) {
+    const int sampleRate = 8000;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA;
+    ebur128_state* list = ebur128_init(1, sampleRate, mode);
+    ebur128_state* histogram = ebur128_init(1, sampleRate, mode | EBUR128_MODE_HISTOGRAM);
+    ASSERT_NE(list, nullptr);
+    ASSERT_NE(histogram, nullptr);
+    ASSERT_EQ(ebur128_set_histogram_resolution(histogram, 0.01, -70.0, 30.0),
+              EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_set_max_history(list, 60000), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_set_max_history(histogram, 60000), EBUR128_SUCCESS);
+
+    std::vector<float> buffer(sampleRate);
+    unsigned int seed = 99;
+    for (int second = 0; second < 400; ++second) {
+        if (second % 4 == 0) {
+            seed = seed * 1103515245u + 12345u;
+        }
+        // Louder at the start, so that it must be evicted to match
+        double gain = -static_cast<double>((seed >> 8) % 3000) / 100.0 -
+                      (second < 100 ? 0.0 : 15.0);
+        double level = pow(10.0, gain / 20.0);
+        for (int i = 0; i < sampleRate; ++i) {
+            buffer[i] = static_cast<float>(level * sin(2.0 * M_PI * 440.0 * i / sampleRate));
+        }
+        ASSERT_EQ(ebur128_add_frames_float(list, buffer.data(), sampleRate), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_add_frames_float(histogram, buffer.data(), sampleRate),
+                  EBUR128_SUCCESS);
+        if (second == 250) {
+            // Shrinking the history evicts the oldest blocks of both
+            ASSERT_EQ(ebur128_set_max_history(list, 30000), EBUR128_SUCCESS);
+            ASSERT_EQ(ebur128_set_max_history(histogram, 30000), EBUR128_SUCCESS);
+        }
+        if (second % 10 != 9) {
+            continue;
+        }
+        double expected, actual;
+        ASSERT_EQ(ebur128_loudness_global(list, &expected), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_loudness_global(histogram, &actual), EBUR128_SUCCESS);
+        EXPECT_NEAR(actual, expected, 0.01) << "second " << second;
+        ASSERT_EQ(ebur128_loudness_range(list, &expected), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_loudness_range(histogram, &actual), EBUR128_SUCCESS);
+        EXPECT_NEAR(actual, expected, 0.02) << "second " << second;
+    }
+
+    // Blocks counted before the history was limited have no known age
+    ebur128_state* late = ebur128_init(1, sampleRate, mode | EBUR128_MODE_HISTOGRAM);
+    ASSERT_NE(late, nullptr);
+    ASSERT_EQ(ebur128_add_frames_float(late, buffer.data(), sampleRate), EBUR128_SUCCESS);
+    double loudness;
+    ASSERT_EQ(ebur128_loudness_global(late, &loudness), EBUR128_SUCCESS);
+    EXPECT_TRUE(std::isfinite(loudness));
+    ASSERT_EQ(ebur128_set_max_history(late, 60000), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_global(late, &loudness), EBUR128_SUCCESS);
+    EXPECT_EQ(loudness, -HUGE_VAL);
+
+    ebur128_destroy(&list);
+    ebur128_destroy(&histogram);
+    ebur128_destroy(&late);
+}
+
+// Test measuring a programme in segments on separate threads, each after a
+// 3s pre-roll, against one state fed the whole programme
+TEST_F(EBUR128Test, SegmentedMeasurementMatchesSequential) {
+    const int sampleRate = 48000;
+    const int channels = 2;
+    auto signal = generateMultichannelSignal<float>(sampleRate, channels, 120.0, 1.0);
+    const size_t frames = signal.size() / channels;
+    // Sections of different level, so that the LRA is not trivial
+    for (size_t frame = 0; frame < frames; ++frame) {
+        double gain = pow(10.0, -static_cast<double>((frame / (7 * sampleRate)) % 5) * 4.0 / 20.0);
+        for (int ch = 0; ch < channels; ++ch) {
+            signal[frame * channels + ch] *= static_cast<float>(gain);
+        }
+    }
+    // Segment starts on 100ms boundaries, including one in the first 3s
+    const size_t starts[] = {0, 2 * sampleRate + 4800, 29 * sampleRate + 14400,
+                             61 * sampleRate + 33600, 90 * sampleRate, frames};
+    const size_t numSegments = sizeof(starts) / sizeof(starts[0]) - 1;
+    const size_t preroll = 3 * sampleRate;
+
+    for (int mode : {EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK,
+                     EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK |
+                         EBUR128_MODE_LOW_MEMORY}) {
+        ebur128_state* whole = ebur128_init(channels, sampleRate, mode);
+        ASSERT_NE(whole, nullptr);
+        ASSERT_EQ(ebur128_add_frames_float(whole, signal.data(), frames), EBUR128_SUCCESS);
+
+        std::vector<ebur128_state*> segments(numSegments);
+        std::vector<int> errors(numSegments, 0);
+        std::vector<std::thread> threads;
+        for (size_t s = 0; s < numSegments; ++s) {
+            segments[s] = ebur128_init(channels, sampleRate, mode);
+            ASSERT_NE(segments[s], nullptr);
+            threads.emplace_back([&, s]() {
+                size_t begin = starts[s] > preroll ? starts[s] - preroll : 0;
+                errors[s] |= ebur128_add_frames_float(segments[s], signal.data() + begin * channels,
+                                                      starts[s] - begin);
+                errors[s] |= ebur128_start_segment(segments[s], starts[s]);
+                errors[s] |= ebur128_add_frames_float(segments[s],
+                                                      signal.data() + starts[s] * channels,
+                                                      starts[s + 1] - starts[s]);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (size_t s = 0; s < numSegments; ++s) {
+            EXPECT_EQ(errors[s], EBUR128_SUCCESS) << "segment " << s;
+        }
+
+        double expected, actual;
+        ASSERT_EQ(ebur128_loudness_global(whole, &expected), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_loudness_global_multiple(segments.data(), numSegments, &actual),
+                  EBUR128_SUCCESS);
+        EXPECT_NEAR(actual, expected, 1e-9);
+        ASSERT_EQ(ebur128_loudness_range(whole, &expected), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_loudness_range_multiple(segments.data(), numSegments, &actual),
+                  EBUR128_SUCCESS);
+        EXPECT_GT(expected, 5.0);
+        EXPECT_NEAR(actual, expected, 1e-9);
+        for (int ch = 0; ch < channels; ++ch) {
+            double peak, truePeak, segmentPeak = 0.0, segmentTruePeak = 0.0;
+            for (ebur128_state* segment : segments) {
+                ebur128_sample_peak(segment, ch, &peak);
+                segmentPeak = std::max(segmentPeak, peak);
+                ebur128_true_peak(segment, ch, &peak);
+                segmentTruePeak = std::max(segmentTruePeak, peak);
+            }
+            ebur128_sample_peak(whole, ch, &peak);
+            ebur128_true_peak(whole, ch, &truePeak);
+            EXPECT_EQ(segmentPeak, peak);
+            EXPECT_EQ(segmentTruePeak, truePeak);
+        }
+
+        EXPECT_EQ(ebur128_start_segment(whole, 100), EBUR128_ERROR_INVALID_MODE);
+        ebur128_destroy(&whole);
+        for (ebur128_state*& segment : segments) {
+            ebur128_destroy(&segment);
+        }
+    }
+}
+
+// Test that merging states gives the results of measuring them together,
+// for list and histogram states and with a limited history
+TEST_F(EBUR128Test, MergeMatchesMultiple) {
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+    const int sampleRates[] = {48000, 44100, 48000};
+    const double durations[] = {30.0, 12.0, 20.0};
+    ebur128_state* sources[3];
+    std::vector<std::vector<float>> signals;
+    for (int i = 0; i < 3; ++i) {
+        sources[i] = ebur128_init(2, sampleRates[i], mode);
+        ASSERT_NE(sources[i], nullptr);
+        signals.push_back(generateMultichannelSignal<float>(sampleRates[i], 2, durations[i],
+                                                            pow(10.0, -6.0 * i / 20.0)));
+        ASSERT_EQ(ebur128_add_frames_float(sources[i], signals[i].data(), signals[i].size() / 2),
+                  EBUR128_SUCCESS);
+    }
+    double expectedGlobal, expectedRange, actual;
+    ASSERT_EQ(ebur128_loudness_global_multiple(sources, 3, &expectedGlobal), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_range_multiple(sources, 3, &expectedRange), EBUR128_SUCCESS);
+
+    ebur128_state* merged = ebur128_init(2, 48000, mode);
+    ebur128_state* histogram = ebur128_init(2, 48000, mode | EBUR128_MODE_HISTOGRAM);
+    ASSERT_NE(merged, nullptr);
+    ASSERT_NE(histogram, nullptr);
+    ASSERT_EQ(ebur128_set_histogram_resolution(histogram, 0.01, -70.0, 30.0), EBUR128_SUCCESS);
+    for (ebur128_state* source : sources) {
+        ASSERT_EQ(ebur128_merge(merged, source), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_merge(histogram, source), EBUR128_SUCCESS);
+    }
+    ASSERT_EQ(ebur128_loudness_global(merged, &actual), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expectedGlobal, 1e-9);
+    ASSERT_EQ(ebur128_loudness_range(merged, &actual), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expectedRange, 1e-9);
+    ASSERT_EQ(ebur128_loudness_global(histogram, &actual), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expectedGlobal, 0.01);
+    ASSERT_EQ(ebur128_loudness_range(histogram, &actual), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expectedRange, 0.02);
+    for (unsigned int ch = 0; ch < 2; ++ch) {
+        double expectedPeak = 0.0, expectedTruePeak = 0.0, peak;
+        for (ebur128_state* source : sources) {
+            ebur128_sample_peak(source, ch, &peak);
+            expectedPeak = std::max(expectedPeak, peak);
+            ebur128_true_peak(source, ch, &peak);
+            expectedTruePeak = std::max(expectedTruePeak, peak);
+        }
+        ebur128_sample_peak(merged, ch, &peak);
+        EXPECT_EQ(peak, expectedPeak);
+        ebur128_true_peak(merged, ch, &peak);
+        EXPECT_EQ(peak, expectedTruePeak);
+    }
+
+    // Histograms of the same layout merge exactly, also into a limited history
+    ebur128_state* histogramCopy = ebur128_init(2, 48000, mode | EBUR128_MODE_HISTOGRAM);
+    ASSERT_NE(histogramCopy, nullptr);
+    ASSERT_EQ(ebur128_set_histogram_resolution(histogramCopy, 0.01, -70.0, 30.0), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_set_max_history(histogramCopy, 600000), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_merge(histogramCopy, histogram), EBUR128_SUCCESS);
+    double copied;
+    ASSERT_EQ(ebur128_loudness_global(histogram, &actual), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_global(histogramCopy, &copied), EBUR128_SUCCESS);
+    EXPECT_EQ(copied, actual);
+
+    // A limited history keeps the newest merged blocks
+    ebur128_state* limited = ebur128_init(2, 48000, mode);
+    ebur128_state* reference = ebur128_init(2, 48000, mode);
+    ASSERT_NE(limited, nullptr);
+    ASSERT_NE(reference, nullptr);
+    ASSERT_EQ(ebur128_set_max_history(limited, 10000), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_set_max_history(reference, 10000), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_add_frames_float(reference, signals[0].data(), signals[0].size() / 2),
+              EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_merge(limited, sources[0]), EBUR128_SUCCESS);
+    double expected;
+    ASSERT_EQ(ebur128_loudness_global(reference, &expected), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_global(limited, &actual), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expected, 1e-9);
+    ASSERT_EQ(ebur128_loudness_range(reference, &expected), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_loudness_range(limited, &actual), EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expected, 1e-9);
+
+    ebur128_state* mono = ebur128_init(1, 48000, mode);
+    ASSERT_NE(mono, nullptr);
+    EXPECT_EQ(ebur128_merge(merged, merged), EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_merge(merged, histogram), EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_merge(mono, merged), EBUR128_ERROR_INVALID_MODE);
+
+    for (ebur128_state* st : {merged, histogram, histogramCopy, limited, reference, mono,
+                              sources[0], sources[1], sources[2]}) {
+        ebur128_destroy(&st);
+    }
+}
+
+// Test that a meter restored from a full snapshot and the incremental ones
+// taken after it continues with bit-identical results
+TEST_F(EBUR128Test, SnapshotRestoreIsBitIdentical) {
+    const unsigned long sampleRate = 44100;
+    const int base = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_S;
+    struct Config {
+        int mode;
+        unsigned long history;
+        unsigned long window;
+    };
+    const Config configs[] = {
+        {base | EBUR128_MODE_TRUE_PEAK, ULONG_MAX, 10000},
+        {base | EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_LOW_MEMORY, 20000, 3000},
+        {base | EBUR128_MODE_HISTOGRAM | EBUR128_MODE_LOW_MEMORY, 20000, 3000},
+        {base | EBUR128_MODE_HISTOGRAM | EBUR128_MODE_TRUE_PEAK, ULONG_MAX, 3000},
+    };
+    // 700ms chunks, so that snapshots fall inside blocks
+    const size_t chunk = sampleRate * 7 / 10;
+    std::vector<float> buffer(chunk * 2);
+    for (const Config& config : configs) {
+        SCOPED_TRACE(config.mode);
+        ebur128_state* original = ebur128_init(2, sampleRate, config.mode);
+        ASSERT_NE(original, nullptr);
+        ebur128_set_max_history(original, config.history);
+        ebur128_set_max_window(original, config.window);
+
+        std::vector<std::vector<unsigned char>> snapshots;
+        unsigned int seed = 7;
+        double phase = 0.0;
+        auto feed = [&](std::initializer_list<ebur128_state*> states, size_t frames) {
+            seed = seed * 1103515245u + 12345u;
+            double level = pow(10.0, -static_cast<double>((seed >> 8) % 3000) / 2000.0);
+            for (size_t i = 0; i < frames; ++i) {
+                phase += 2.0 * M_PI * 997.0 / sampleRate;
+                buffer[2 * i] = static_cast<float>(level * sin(phase));
+                buffer[2 * i + 1] = static_cast<float>(0.5 * level * sin(3.0 * phase));
+            }
+            for (ebur128_state* st : states) {
+                ASSERT_EQ(ebur128_add_frames_float(st, buffer.data(), frames), EBUR128_SUCCESS);
+            }
+        };
+        for (int i = 1; i <= 100; ++i) {
+            feed({original}, chunk);
+            if (i % 7 != 0) {
+                continue;
+            }
+            int incremental = snapshots.empty() ? 0 : 1;
+            size_t size = 0;
+            ASSERT_EQ(ebur128_snapshot(original, incremental, nullptr, &size),
+                      EBUR128_ERROR_NOMEM);
+            std::vector<unsigned char> snapshot(size);
+            ASSERT_EQ(ebur128_snapshot(original, incremental, snapshot.data(), &size),
+                      EBUR128_SUCCESS);
+            ASSERT_EQ(size, snapshot.size());
+            if (incremental && (config.mode & EBUR128_MODE_HISTOGRAM) == 0) {
+                // The history before the last snapshot is not written again
+                size_t full = 0;
+                ebur128_snapshot(original, 0, nullptr, &full);
+                EXPECT_LT(size, full);
+            }
+            // Nor are the frames of the window written before it
+            const size_t windowFrames = config.window * sampleRate / 1000;
+            if (incremental && (config.mode & EBUR128_MODE_LOW_MEMORY) == 0 &&
+                windowFrames > 7 * chunk) {
+                size_t full = 0;
+                ebur128_snapshot(original, 0, nullptr, &full);
+                EXPECT_LE(size + (windowFrames - 7 * chunk) * 2 * sizeof(double), full);
+            }
+            snapshots.push_back(snapshot);
+        }
+        // Blocks measured after the last snapshot are lost with the process
+        feed({original}, chunk);
+
+        // A used state is replaced entirely
+        ebur128_state* resumed = ebur128_init(2, sampleRate, config.mode);
+        ASSERT_NE(resumed, nullptr);
+        feed({resumed}, chunk);
+        // Histograms are written in full; an incremental block list only
+        // continues its previous snapshot
+        const bool list = (config.mode & EBUR128_MODE_HISTOGRAM) == 0;
+        if (list) {
+            EXPECT_EQ(ebur128_restore(resumed, snapshots[1].data(), snapshots[1].size()),
+                      EBUR128_ERROR_INVALID_MODE);
+        }
+        for (const std::vector<unsigned char>& snapshot : snapshots) {
+            ASSERT_EQ(ebur128_restore(resumed, snapshot.data(), snapshot.size()),
+                      EBUR128_SUCCESS);
+        }
+        ebur128_state* replay = ebur128_init(2, sampleRate, config.mode);
+        ASSERT_NE(replay, nullptr);
+        if (list) {
+            EXPECT_EQ(ebur128_restore(replay, snapshots.back().data(), snapshots.back().size()),
+                      EBUR128_ERROR_INVALID_MODE);
+        }
+        EXPECT_EQ(ebur128_restore(replay, snapshots[0].data(), snapshots[0].size()),
+                  EBUR128_SUCCESS);
+        ebur128_destroy(&replay);
+
+        // A fresh state restores the same measurement
+        ebur128_state* fresh = ebur128_init(2, sampleRate, config.mode);
+        ASSERT_NE(fresh, nullptr);
+        for (const std::vector<unsigned char>& snapshot : snapshots) {
+            ASSERT_EQ(ebur128_restore(fresh, snapshot.data(), snapshot.size()),
+                      EBUR128_SUCCESS);
+        }
+        ebur128_state* reference = ebur128_init(2, sampleRate, config.mode);
+        ASSERT_NE(reference, nullptr);
+        ebur128_set_max_history(reference, config.history);
+        ebur128_set_max_window(reference, config.window);
+        seed = 7;
+        phase = 0.0;
+        for (int i = 1; i <= 98; ++i) {
+            feed({reference}, chunk);
+        }
+        // The peaks of the first frames depend on the oversampler's delay line
+        feed({reference, resumed, fresh}, 5);
+        if ((config.mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+            for (unsigned int ch = 0; ch < 2; ++ch) {
+                double expected, actual;
+                ebur128_prev_true_peak(reference, ch, &expected);
+                ebur128_prev_true_peak(fresh, ch, &actual);
+                EXPECT_EQ(actual, expected);
+            }
+        }
+        for (int i = 0; i < 60; ++i) {
+            feed({reference, resumed, fresh}, chunk);
+            for (ebur128_state* st : {resumed, fresh}) {
+                double expected, actual;
+                ASSERT_EQ(ebur128_loudness_momentary(reference, &expected), EBUR128_SUCCESS);
+                ASSERT_EQ(ebur128_loudness_momentary(st, &actual), EBUR128_SUCCESS);
+                EXPECT_EQ(actual, expected);
+                ASSERT_EQ(ebur128_loudness_window(reference, config.window, &expected),
+                          EBUR128_SUCCESS);
+                ASSERT_EQ(ebur128_loudness_window(st, config.window, &actual),
+                          EBUR128_SUCCESS);
+                EXPECT_EQ(actual, expected);
+                ASSERT_EQ(ebur128_loudness_global(reference, &expected), EBUR128_SUCCESS);
+                ASSERT_EQ(ebur128_loudness_global(st, &actual), EBUR128_SUCCESS);
+                EXPECT_EQ(actual, expected);
+                ASSERT_EQ(ebur128_loudness_range(reference, &expected), EBUR128_SUCCESS);
+                ASSERT_EQ(ebur128_loudness_range(st, &actual), EBUR128_SUCCESS);
+                EXPECT_EQ(actual, expected);
+            }
+        }
+        for (unsigned int ch = 0; ch < 2; ++ch) {
+            double expected, actual;
+            if ((config.mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+                ebur128_sample_peak(reference, ch, &expected);
+                ebur128_sample_peak(resumed, ch, &actual);
+                EXPECT_EQ(actual, expected);
+            }
+            if ((config.mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+                ebur128_true_peak(reference, ch, &expected);
+                ebur128_true_peak(resumed, ch, &actual);
+                EXPECT_EQ(actual, expected);
+            }
+        }
+
+        // Damaged snapshots and other layouts are refused
+        std::vector<unsigned char> damaged = snapshots[0];
+        EXPECT_EQ(ebur128_restore(resumed, damaged.data(), damaged.size() - 1),
+                  EBUR128_ERROR_INVALID_MODE);
+        damaged[0] = 'X';
+        EXPECT_EQ(ebur128_restore(resumed, damaged.data(), damaged.size()),
+                  EBUR128_ERROR_INVALID_MODE);
+        ebur128_state* mono = ebur128_init(1, sampleRate, config.mode);
+        ASSERT_NE(mono, nullptr);
+        EXPECT_EQ(ebur128_restore(mono, snapshots[0].data(), snapshots[0].size()),
+                  EBUR128_ERROR_INVALID_MODE);
+
+        for (ebur128_state* st : {original, resumed, fresh, reference, mono}) {
+            ebur128_destroy(&st);
+        }
+    }
+}
+
+// Test album loudness, LRA and peaks from track summaries against the same
+// values of the live states
+TEST_F(EBUR128Test, SummariesMatchMultiple) {
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+    const int sampleRates[] = {44100, 48000, 96000, 48000};
+    ebur128_state* tracks[4];
+    std::vector<std::vector<unsigned char>> summaries;
+    unsigned int seed = 3;
+    for (int t = 0; t < 4; ++t) {
+        tracks[t] = ebur128_init(2, sampleRates[t], mode);
+        ASSERT_NE(tracks[t], nullptr);
+        std::vector<float> buffer(sampleRates[t] * 2);
+        for (int second = 0; second < 40 + 20 * t; ++second) {
+            seed = seed * 1103515245u + 12345u;
+            double level = pow(10.0, -static_cast<double>((seed >> 8) % 2500) / 2000.0 - t / 4.0);
+            for (int i = 0; i < sampleRates[t]; ++i) {
+                double x = level * sin(2.0 * M_PI * (200.0 + 300.0 * t) * i / sampleRates[t]);
+                buffer[2 * i] = static_cast<float>(x);
+                buffer[2 * i + 1] = static_cast<float>(0.7 * x);
+            }
+            ASSERT_EQ(ebur128_add_frames_float(tracks[t], buffer.data(), sampleRates[t]),
+                      EBUR128_SUCCESS);
+        }
+        size_t size = 0;
+        ASSERT_EQ(ebur128_summary(tracks[t], nullptr, &size), EBUR128_ERROR_NOMEM);
+        std::vector<unsigned char> summary(size);
+        ASSERT_EQ(ebur128_summary(tracks[t], summary.data(), &size), EBUR128_SUCCESS);
+        EXPECT_LT(size, 8192u);
+        summaries.push_back(summary);
+    }
+    std::vector<const unsigned char*> data;
+    std::vector<size_t> sizes;
+    for (const std::vector<unsigned char>& summary : summaries) {
+        data.push_back(summary.data());
+        sizes.push_back(summary.size());
+    }
+
+    for (size_t count : {size_t(1), size_t(4)}) {
+        double expected, actual;
+        ASSERT_EQ(ebur128_loudness_global_multiple(tracks, count, &expected), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_summary_loudness_global(data.data(), sizes.data(), count, &actual),
+                  EBUR128_SUCCESS);
+        // The blocks in the bin of the relative gate are gated together
+        EXPECT_NEAR(actual, expected, 0.02);
+        ASSERT_EQ(ebur128_loudness_range_multiple(tracks, count, &expected), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_summary_loudness_range(data.data(), sizes.data(), count, &actual),
+                  EBUR128_SUCCESS);
+        EXPECT_NEAR(actual, expected, 0.1);
+
+        double expectedPeak = 0.0, expectedTruePeak = 0.0, peak;
+        for (size_t t = 0; t < count; ++t) {
+            for (unsigned int ch = 0; ch < 2; ++ch) {
+                ebur128_sample_peak(tracks[t], ch, &peak);
+                expectedPeak = std::max(expectedPeak, peak);
+                ebur128_true_peak(tracks[t], ch, &peak);
+                expectedTruePeak = std::max(expectedTruePeak, peak);
+            }
+        }
+        ASSERT_EQ(ebur128_summary_sample_peak(data.data(), sizes.data(), count, &peak),
+                  EBUR128_SUCCESS);
+        EXPECT_EQ(peak, expectedPeak);
+        ASSERT_EQ(ebur128_summary_true_peak(data.data(), sizes.data(), count, &peak),
+                  EBUR128_SUCCESS);
+        EXPECT_EQ(peak, expectedTruePeak);
+    }
+
+    // Without oversampling at 192 kHz, the true peak is the sample peak
+    ebur128_state* highRate = ebur128_init(2, 192000, mode);
+    ASSERT_NE(highRate, nullptr);
+    std::vector<float> sine = generateSineWave(1000.0, 0.5, 192000, 2, 1.0);
+    ASSERT_EQ(ebur128_add_frames_float(highRate, sine.data(), sine.size() / 2), EBUR128_SUCCESS);
+    size_t highRateSize = 0;
+    ebur128_summary(highRate, nullptr, &highRateSize);
+    std::vector<unsigned char> highRateSummary(highRateSize);
+    ASSERT_EQ(ebur128_summary(highRate, highRateSummary.data(), &highRateSize), EBUR128_SUCCESS);
+    const unsigned char* highRateData = highRateSummary.data();
+    double highRatePeak, expectedHighRatePeak;
+    ebur128_true_peak(highRate, 0, &expectedHighRatePeak);
+    EXPECT_GT(expectedHighRatePeak, 0.49);
+    ASSERT_EQ(ebur128_summary_true_peak(&highRateData, &highRateSize, 1, &highRatePeak),
+              EBUR128_SUCCESS);
+    EXPECT_EQ(highRatePeak, expectedHighRatePeak);
+    ebur128_destroy(&highRate);
+
+    // Histogram states are summarized from their bins
+    ebur128_state* histogram = ebur128_init(2, 48000, mode | EBUR128_MODE_HISTOGRAM);
+    ASSERT_NE(histogram, nullptr);
+    ASSERT_EQ(ebur128_set_histogram_resolution(histogram, 0.01, -70.0, 30.0), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_merge(histogram, tracks[1]), EBUR128_SUCCESS);
+    size_t size = 0;
+    ebur128_summary(histogram, nullptr, &size);
+    std::vector<unsigned char> summary(size);
+    ASSERT_EQ(ebur128_summary(histogram, summary.data(), &size), EBUR128_SUCCESS);
+    const unsigned char* histogramData = summary.data();
+    double expected, actual;
+    ASSERT_EQ(ebur128_loudness_global(tracks[1], &expected), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_summary_loudness_global(&histogramData, &size, 1, &actual),
+              EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expected, 0.01);
+    ASSERT_EQ(ebur128_loudness_range(tracks[1], &expected), EBUR128_SUCCESS);
+    ASSERT_EQ(ebur128_summary_loudness_range(&histogramData, &size, 1, &actual),
+              EBUR128_SUCCESS);
+    EXPECT_NEAR(actual, expected, 0.1);
+
+    // Empty sets, damaged summaries and missing modes
+    ASSERT_EQ(ebur128_summary_loudness_global(data.data(), sizes.data(), 0, &actual),
+              EBUR128_SUCCESS);
+    EXPECT_EQ(actual, -HUGE_VAL);
+    size_t shortened = sizes[0] - 1;
+    EXPECT_EQ(ebur128_summary_loudness_global(data.data(), &shortened, 1, &actual),
+              EBUR128_ERROR_INVALID_MODE);
+    ebur128_state* momentary = ebur128_init(2, 48000, EBUR128_MODE_M);
+    ASSERT_NE(momentary, nullptr);
+    ebur128_summary(momentary, nullptr, &size);
+    summary.resize(size);
+    ASSERT_EQ(ebur128_summary(momentary, summary.data(), &size), EBUR128_SUCCESS);
+    const unsigned char* momentaryData = summary.data();
+    EXPECT_EQ(ebur128_summary_loudness_global(&momentaryData, &size, 1, &actual),
+              EBUR128_ERROR_INVALID_MODE);
+    EXPECT_EQ(ebur128_summary_true_peak(&momentaryData, &size, 1, &actual),
+              EBUR128_ERROR_INVALID_MODE);
+
+    for (ebur128_state* st : {tracks[0], tracks[1], tracks[2], tracks[3], histogram, momentary}) {
+        ebur128_destroy(&st);
+    }
+}
+
+// Test that a reader thread always sees the measurement of one whole block
+// while an audio thread adds 64-frame buffers
+TEST_F(EBUR128Test, PublishedMeasurementIsConsistent) {
+    const unsigned long sampleRate = 48000;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK |
+                     EBUR128_MODE_LOW_MEMORY | EBUR128_MODE_PUBLISH;
+    const size_t frames = 64;
+    std::vector<float> signal(sampleRate * 2 * 12);
+    unsigned int seed = 11;
+    for (size_t i = 0; i < signal.size() / 2; ++i) {
+        if (i % (sampleRate / 2) == 0) {
+            seed = seed * 1103515245u + 12345u;
+        }
+        double level = pow(10.0, -static_cast<double>((seed >> 8) % 2000) / 1000.0);
+        signal[2 * i] = static_cast<float>(level * sin(2.0 * M_PI * 1000.0 * i / sampleRate));
+        signal[2 * i + 1] = static_cast<float>(level * cos(2.0 * M_PI * 500.0 * i / sampleRate));
+    }
+
+    // Every buffer completes at most one block, so a single thread sees them all
+    ebur128_state* reference = ebur128_init(2, sampleRate, mode);
+    ASSERT_NE(reference, nullptr);
+    std::vector<ebur128_measurement> blocks;
+    ebur128_measurement m;
+    ASSERT_EQ(ebur128_published(reference, &m), EBUR128_SUCCESS);
+    EXPECT_EQ(m.blocks, 0u);
+    EXPECT_EQ(m.global, -HUGE_VAL);
+    blocks.push_back(m);
+    for (size_t pos = 0; pos + frames <= signal.size() / 2; pos += frames) {
+        ASSERT_EQ(ebur128_add_frames_float(reference, &signal[2 * pos], frames), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_published(reference, &m), EBUR128_SUCCESS);
+        if (m.blocks == blocks.size()) {
+            blocks.push_back(m);
+            double value;
+            ebur128_loudness_momentary(reference, &value);
+            EXPECT_EQ(m.momentary, value);
+            ebur128_loudness_shortterm(reference, &value);
+            EXPECT_EQ(m.shortterm, value);
+            ebur128_loudness_global(reference, &value);
+            EXPECT_EQ(m.global, value);
+            ebur128_loudness_range(reference, &value);
+            EXPECT_EQ(m.range, value);
+        }
+        ASSERT_EQ(m.blocks + 1, blocks.size());
+    }
+    // The first block is published after 400ms
+    EXPECT_EQ(blocks.size(), 1 + 12 * 10 - 3u);
+    double peak, peak1;
+    ebur128_true_peak(reference, 0, &peak);
+    ebur128_true_peak(reference, 1, &peak1);
+    EXPECT_LE(blocks.back().true_peak, std::max(peak, peak1));
+    EXPECT_GT(blocks.back().true_peak, 0.0);
+
+    ebur128_state* meter = ebur128_init(2, sampleRate, mode);
+    ASSERT_NE(meter, nullptr);
+    std::atomic<bool> done(false);
+    std::vector<ebur128_measurement> seen;
+    std::thread reader([&] {
+        ebur128_measurement r;
+        while (!done.load()) {
+            ebur128_published(meter, &r);
+            if (seen.empty() || r.blocks != seen.back().blocks) {
+                seen.push_back(r);
+            }
+        }
+        ebur128_published(meter, &r);
+        seen.push_back(r);
+    });
+    for (size_t pos = 0; pos + frames <= signal.size() / 2; pos += frames) {
+        ASSERT_EQ(ebur128_add_frames_float(meter, &signal[2 * pos], frames), EBUR128_SUCCESS);
+    }
+    done.store(true);
+    reader.join();
+    ASSERT_FALSE(seen.empty());
+    EXPECT_EQ(seen.back().blocks + 1, blocks.size());
+    for (size_t i = 0; i < seen.size(); ++i) {
+        const ebur128_measurement& r = seen[i];
+        ASSERT_LT(r.blocks, blocks.size());
+        const ebur128_measurement& expected = blocks[r.blocks];
+        EXPECT_EQ(r.momentary, expected.momentary);
+        EXPECT_EQ(r.shortterm, expected.shortterm);
+        EXPECT_EQ(r.global, expected.global);
+        EXPECT_EQ(r.range, expected.range);
+        EXPECT_EQ(r.sample_peak, expected.sample_peak);
+        EXPECT_EQ(r.true_peak, expected.true_peak);
+        if (i > 0) {
+            EXPECT_GE(r.blocks, seen[i - 1].blocks);
+        }
+    }
+
+    // The peaks of a call replace those of the previous one
+    ebur128_prev_sample_peak(meter, 0, &peak);
+    EXPECT_GT(peak, 0.0);
+    ASSERT_EQ(ebur128_add_frames_float(meter, signal.data(), 0), EBUR128_SUCCESS);
+    ebur128_prev_sample_peak(meter, 0, &peak);
+    EXPECT_EQ(peak, 0.0);
+    ebur128_prev_true_peak(meter, 0, &peak);
+    EXPECT_EQ(peak, 0.0);
+
+    ebur128_state* unpublished = ebur128_init(2, sampleRate, EBUR128_MODE_I);
+    ASSERT_NE(unpublished, nullptr);
+    EXPECT_EQ(ebur128_published(unpublished, &m), EBUR128_ERROR_INVALID_MODE);
+
+    // Over a 4 hour programme of near-constant loudness the calls that
+    // complete a block stay cheap, and the range is still exact
+    const int steadyRate = 8000;
+    ebur128_state* steady = ebur128_init(1, steadyRate,
+                                         EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_PUBLISH);
+    ASSERT_NE(steady, nullptr);
+    std::vector<float> tone(steadyRate);
+    std::vector<double> blockMicroseconds;
+    for (int second = 0; second < 4 * 3600; ++second) {
+        seed = seed * 1103515245u + 12345u;
+        double jitter = static_cast<int>((seed >> 8) % 2001) - 1000;
+        double level = 0.25 * (1.0 + 0.002 * jitter / 1000.0);
+        for (int i = 0; i < steadyRate; ++i) {
+            tone[i] = static_cast<float>(level * sin(2.0 * M_PI * 997.0 * i / steadyRate));
+        }
+        for (int pos = 0; pos + static_cast<int>(frames) <= steadyRate; pos += frames) {
+            auto start = std::chrono::high_resolution_clock::now();
+            ASSERT_EQ(ebur128_add_frames_float(steady, &tone[pos], frames), EBUR128_SUCCESS);
+            auto end = std::chrono::high_resolution_clock::now();
+            ebur128_published(steady, &m);
+            if (m.blocks == blockMicroseconds.size() + 1) {
+                blockMicroseconds.push_back(
+                    std::chrono::duration<double, std::micro>(end - start).count());
+            }
+        }
+        if (second % 60 == 59) {
+            double value;
+            ebur128_loudness_global(steady, &value);
+            EXPECT_EQ(m.global, value);
+            ebur128_loudness_range(steady, &value);
+            EXPECT_EQ(m.range, value);
+        }
+    }
+    EXPECT_EQ(blockMicroseconds.size(), 4 * 3600 * 10 - 3u);
+    std::sort(blockMicroseconds.begin(), blockMicroseconds.end());
+    EXPECT_LT(blockMicroseconds[blockMicroseconds.size() * 99 / 100], 100.0);
+
+    for (ebur128_state* st : {reference, meter, unpublished, steady}) {
+        ebur128_destroy(&st);
+    }
+}
+
+// Test that no memory is allocated while adding frames or querying once the
+// programme duration is reserved, and that every allocation goes through the
+// allocator of the state and is freed with it
+TEST_F(EBUR128Test, ReservedStateDoesNotAllocate) {
+    const unsigned long sampleRate = 48000;
+    const unsigned long duration = 150000;
+    std::vector<float> signal(sampleRate * 2 * 10);
+    for (size_t i = 0; i < signal.size() / 2; ++i) {
+        double level = pow(10.0, -static_cast<double>(i / (sampleRate / 2) % 7) * 0.4);
+        signal[2 * i] = static_cast<float>(level * sin(2.0 * M_PI * 1000.0 * i / sampleRate));
+        signal[2 * i + 1] = static_cast<float>(level * sin(2.0 * M_PI * 300.0 * i / sampleRate));
+    }
+
+    struct Config {
+        int mode;
+        unsigned long history;
+        unsigned long reserve;
+    };
+    const int all = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+    const Config configs[] = {
+        {all | EBUR128_MODE_PUBLISH, ULONG_MAX, duration},
+        {all | EBUR128_MODE_LOW_MEMORY, ULONG_MAX, duration},
+        // The history is no longer than the reservation
+        {all, 60000, 60000},
+        {all | EBUR128_MODE_HISTOGRAM, ULONG_MAX, 0},
+        {all | EBUR128_MODE_HISTOGRAM, 120000, duration},
+    };
+    for (const Config& config : configs) {
+        SCOPED_TRACE(config.mode);
+        CountingAllocator counter;
+        ebur128_allocator allocator = {CountingAllocator::allocate, CountingAllocator::reallocate,
+                                       CountingAllocator::deallocate, &counter};
+        ebur128_state* st = ebur128_init_with_allocator(2, sampleRate, config.mode, &allocator);
+        ASSERT_NE(st, nullptr);
+        ASSERT_GT(counter.allocations, 0u);
+        if (config.history != ULONG_MAX) {
+            ASSERT_EQ(ebur128_set_max_history(st, config.history), EBUR128_SUCCESS);
+        }
+        ASSERT_EQ(ebur128_reserve(st, config.reserve), EBUR128_SUCCESS);
+        std::vector<unsigned char> summary;
+
+        counter.forbidden = true;
+        size_t added = 0;
+        for (size_t call = 0; added < sampleRate * duration / 1000; ++call) {
+            size_t frames = 1 + (call * 7919) % 9600;
+            size_t pos = added % (signal.size() / 2);
+            frames = std::min(frames, signal.size() / 2 - pos);
+            ASSERT_EQ(ebur128_add_frames_float(st, &signal[2 * pos], frames), EBUR128_SUCCESS);
+            added += frames;
+            if (call % 16 != 0) {
+                continue;
+            }
+            double value;
+            ebur128_loudness_momentary(st, &value);
+            ebur128_loudness_shortterm(st, &value);
+            ebur128_loudness_window(st, 1000, &value);
+            ebur128_loudness_global(st, &value);
+            ebur128_loudness_global_multiple(&st, 1, &value);
+            ebur128_relative_threshold(st, &value);
+            ebur128_loudness_range(st, &value);
+            ebur128_loudness_range_multiple(&st, 1, &value);
+            ebur128_sample_peak(st, 1, &value);
+            ebur128_prev_sample_peak(st, 1, &value);
+            ebur128_true_peak(st, 1, &value);
+            ebur128_prev_true_peak(st, 1, &value);
+            if (config.mode & EBUR128_MODE_PUBLISH) {
+                ebur128_measurement m;
+                EXPECT_EQ(ebur128_published(st, &m), EBUR128_SUCCESS);
+            }
+            size_t size = 0;
+            ebur128_summary(st, nullptr, &size);
+            summary.resize(size);
+            EXPECT_EQ(ebur128_summary(st, summary.data(), &size), EBUR128_SUCCESS);
+        }
+        counter.forbidden = false;
+
+        // The reserved state measures like one that grows its history
+        ebur128_state* reference = ebur128_init(2, sampleRate, config.mode);
+        ASSERT_NE(reference, nullptr);
+        if (config.history != ULONG_MAX) {
+            ebur128_set_max_history(reference, config.history);
+        }
+        added = 0;
+        for (size_t call = 0; added < sampleRate * duration / 1000; ++call) {
+            size_t frames = 1 + (call * 7919) % 9600;
+            size_t pos = added % (signal.size() / 2);
+            frames = std::min(frames, signal.size() / 2 - pos);
+            ebur128_add_frames_float(reference, &signal[2 * pos], frames);
+            added += frames;
+        }
+        double global, expectedGlobal, range, expectedRange;
+        ebur128_loudness_global(st, &global);
+        ebur128_loudness_global(reference, &expectedGlobal);
+        ebur128_loudness_range(st, &range);
+        ebur128_loudness_range(reference, &expectedRange);
+        EXPECT_EQ(global, expectedGlobal);
+        EXPECT_EQ(range, expectedRange);
+        ebur128_destroy(&reference);
+
+        ebur128_destroy(&st);
+        EXPECT_EQ(counter.live, 0u);
+    }
+
+    // Without a reservation the block history grows while frames are added
+    CountingAllocator counter;
+    ebur128_allocator allocator = {CountingAllocator::allocate, CountingAllocator::reallocate,
+                                   CountingAllocator::deallocate, &counter};
+    ebur128_state* st = ebur128_init_with_allocator(2, sampleRate, EBUR128_MODE_I, &allocator);
+    ASSERT_NE(st, nullptr);
+    size_t allocations = counter.allocations;
+    for (int i = 0; i < 11; ++i) {
+        ASSERT_EQ(ebur128_add_frames_float(st, signal.data(), signal.size() / 2), EBUR128_SUCCESS);
+    }
+    EXPECT_GT(counter.allocations, allocations);
+    ebur128_destroy(&st);
+    EXPECT_EQ(counter.live, 0u);
+}
+
+// Test that a state reset after one file measures the next one exactly like a
+// new state, without allocating, and that a state without true peak is a
+// single allocation
+TEST_F(EBUR128Test, ResetMatchesFreshState) {
+    const unsigned long sampleRate = 44100;
+    std::vector<float> first = generateMultichannelSignal<float>(sampleRate, 3, 4.3, 1.0);
+    std::vector<float> second = generateMultichannelSignal<float>(sampleRate, 3, 2.7, 0.5);
+
+    const int all = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+    const int modes[] = {
+        all,
+        all | EBUR128_MODE_LOW_MEMORY,
+        all | EBUR128_MODE_HISTOGRAM,
+        EBUR128_MODE_S | EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_PUBLISH,
+        EBUR128_MODE_M,
+    };
+    for (int mode : modes) {
+        SCOPED_TRACE(mode);
+        CountingAllocator counter;
+        ebur128_allocator allocator = {CountingAllocator::allocate, CountingAllocator::reallocate,
+                                       CountingAllocator::deallocate, &counter};
+        ebur128_state* st = ebur128_init_with_allocator(3, sampleRate, mode, &allocator);
+        ASSERT_NE(st, nullptr);
+        if ((mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
+            EXPECT_EQ(counter.allocations, 1u);
+        }
+        // An unused channel is not filtered, but its window is read when
+        // the channel is used later
+        ebur128_set_channel(st, 2, EBUR128_UNUSED);
+        ebur128_set_max_history(st, 3000);
+        ebur128_add_frames_float(st, first.data(), first.size() / 3);
+
+        counter.forbidden = true;
+        ebur128_reset(st);
+        counter.forbidden = false;
+        // A partial block and a part of the window that is never written
+        ebur128_add_frames_float(st, second.data(), second.size() / 3);
+
+        ebur128_state* fresh = ebur128_init(3, sampleRate, mode);
+        ASSERT_NE(fresh, nullptr);
+        ebur128_set_channel(fresh, 2, EBUR128_UNUSED);
+        ebur128_set_max_history(fresh, 3000);
+        ebur128_add_frames_float(fresh, second.data(), second.size() / 3);
+
+        size_t size = 0, expectedSize = 0;
+        ebur128_snapshot(st, 0, nullptr, &size);
+        ebur128_snapshot(fresh, 0, nullptr, &expectedSize);
+        std::vector<unsigned char> snapshot(size), expected(expectedSize);
+        ASSERT_EQ(ebur128_snapshot(st, 0, snapshot.data(), &size), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_snapshot(fresh, 0, expected.data(), &expectedSize), EBUR128_SUCCESS);
+        EXPECT_EQ(snapshot, expected);
+
+        double value, expectedValue;
+        ebur128_loudness_window(st, 400, &value);
+        ebur128_loudness_window(fresh, 400, &expectedValue);
+        EXPECT_EQ(value, expectedValue);
+        ebur128_loudness_momentary(st, &value);
+        ebur128_loudness_momentary(fresh, &expectedValue);
+        EXPECT_EQ(value, expectedValue);
+        if (mode & EBUR128_MODE_PUBLISH) {
+            ebur128_measurement m, expectedM;
+            ebur128_published(st, &m);
+            ebur128_published(fresh, &expectedM);
+            EXPECT_EQ(m.blocks, expectedM.blocks);
+            EXPECT_EQ(m.shortterm, expectedM.shortterm);
+            EXPECT_EQ(m.sample_peak, expectedM.sample_peak);
+        }
+        ebur128_destroy(&fresh);
+
+        ebur128_destroy(&st);
+        EXPECT_EQ(counter.live, 0u);
+    }
+}
+
+// Test that meters from a pool measure like new ones whatever they were used
+// for before, that a prepared pool hands out meters without allocating, and
+// that several threads can share a pool
+TEST_F(EBUR128Test, PoolReusesMeters) {
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+    std::vector<float> stereo = generateMultichannelSignal<float>(48000, 2, 3.3, 1.0);
+    std::vector<float> surround = generateMultichannelSignal<float>(44100, 6, 2.1, 0.7);
+
+    auto snapshotOf = [](ebur128_state* st) {
+        size_t size = 0;
+        ebur128_snapshot(st, 0, nullptr, &size);
+        std::vector<unsigned char> snapshot(size);
+        EXPECT_EQ(ebur128_snapshot(st, 0, snapshot.data(), &size), EBUR128_SUCCESS);
+        return snapshot;
+    };
+    // Snapshot of a new meter after the same audio
+    auto expectedSnapshot = [&](unsigned int channels, unsigned long sampleRate, int mode,
+                                const std::vector<float>& audio, unsigned long history) {
+        ebur128_state* st = ebur128_init(channels, sampleRate, mode);
+        ebur128_set_max_history(st, history);
+        ebur128_add_frames_float(st, audio.data(), audio.size() / channels);
+        std::vector<unsigned char> snapshot = snapshotOf(st);
+        ebur128_destroy(&st);
+        return snapshot;
+    };
+    const std::vector<unsigned char> expectedStereo =
+        expectedSnapshot(2, 48000, mode, stereo, ULONG_MAX);
+    const std::vector<unsigned char> expectedShortHistory =
+        expectedSnapshot(2, 48000, mode, stereo, 3000);
+    const std::vector<unsigned char> expectedSurround =
+        expectedSnapshot(6, 44100, mode, surround, ULONG_MAX);
+
+    CountingAllocator counter;
+    ebur128_allocator allocator = {CountingAllocator::allocate, CountingAllocator::reallocate,
+                                   CountingAllocator::deallocate, &counter};
+    ebur128_pool* pool = ebur128_pool_create(2, &allocator);
+    ASSERT_NE(pool, nullptr);
+    ASSERT_EQ(ebur128_pool_prepare(pool, 2, 48000, mode, 2), EBUR128_SUCCESS);
+    EXPECT_EQ(ebur128_pool_prepare(pool, 2, 48000, mode, 2), EBUR128_SUCCESS);
+    EXPECT_EQ(ebur128_pool_prepare(pool, 6, 44100, mode, 1), EBUR128_ERROR_NOMEM);
+
+    // Once the block histories have grown, files cycle without allocating,
+    // and settings of one file do not carry over to the next
+    for (int file = 0; file < 4; ++file) {
+        SCOPED_TRACE(file);
+        counter.forbidden = file > 0;
+        ebur128_state* a = ebur128_pool_acquire(pool, 2, 48000, mode);
+        ebur128_state* b = ebur128_pool_acquire(pool, 2, 48000, mode);
+        ASSERT_NE(a, nullptr);
+        ASSERT_NE(b, nullptr);
+        ebur128_add_frames_float(a, stereo.data(), stereo.size() / 2);
+        ebur128_set_max_history(b, 3000);
+        ebur128_add_frames_float(b, stereo.data(), stereo.size() / 2);
+        EXPECT_EQ(snapshotOf(a), expectedStereo);
+        EXPECT_EQ(snapshotOf(b), expectedShortHistory);
+        ebur128_set_channel(a, 1, EBUR128_CENTER);
+        ebur128_pool_release(pool, a);
+        ebur128_pool_release(pool, b);
+        counter.forbidden = false;
+    }
+
+    // A meter of another layout and rate is changed from an idle one
+    ebur128_state* st = ebur128_pool_acquire(pool, 6, 44100, mode);
+    ASSERT_NE(st, nullptr);
+    ebur128_add_frames_float(st, surround.data(), surround.size() / 6);
+    EXPECT_EQ(snapshotOf(st), expectedSurround);
+    ebur128_set_max_window(st, 10000);
+    ebur128_pool_release(pool, st);
+    st = ebur128_pool_acquire(pool, 6, 44100, mode);
+    ASSERT_NE(st, nullptr);
+    ebur128_add_frames_float(st, surround.data(), surround.size() / 6);
+    EXPECT_EQ(snapshotOf(st), expectedSurround);
+
+    // Meters beyond the capacity are destroyed when returned
+    ebur128_state* more[3];
+    for (ebur128_state*& meter : more) {
+        meter = ebur128_pool_acquire(pool, 2, 48000, EBUR128_MODE_HISTOGRAM | mode);
+        ASSERT_NE(meter, nullptr);
+        ebur128_set_histogram_resolution(meter, 0.01, -80.0, 10.0);
+    }
+    for (ebur128_state* meter : more) {
+        ebur128_pool_release(pool, meter);
+    }
+    ebur128_pool_release(pool, st);
+    st = ebur128_pool_acquire(pool, 2, 48000, EBUR128_MODE_HISTOGRAM | mode);
+    ASSERT_NE(st, nullptr);
+    ebur128_add_frames_float(st, stereo.data(), stereo.size() / 2);
+    EXPECT_EQ(snapshotOf(st),
+              expectedSnapshot(2, 48000, EBUR128_MODE_HISTOGRAM | mode, stereo, ULONG_MAX));
+    ebur128_pool_release(pool, st);
+    ebur128_pool_destroy(&pool);
+    EXPECT_EQ(pool, nullptr);
+    EXPECT_EQ(counter.live, 0u);
+
+    // Workers sharing a pool, each file with either layout
+    pool = ebur128_pool_create(4, nullptr);
+    ASSERT_NE(pool, nullptr);
+    double expectedGlobal[2];
+    ebur128_state* reference = ebur128_init(2, 48000, mode);
+    ebur128_add_frames_float(reference, stereo.data(), stereo.size() / 2);
+    ebur128_loudness_global(reference, &expectedGlobal[0]);
+    ebur128_destroy(&reference);
+    reference = ebur128_init(6, 44100, mode);
+    ebur128_add_frames_float(reference, surround.data(), surround.size() / 6);
+    ebur128_loudness_global(reference, &expectedGlobal[1]);
+    ebur128_destroy(&reference);
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < 4; ++w) {
+        workers.emplace_back([&, w]() {
+            for (int file = 0; file < 12; ++file) {
+                int layout = (file + w) % 3 == 0;
+                ebur128_state* meter = layout
+                    ? ebur128_pool_acquire(pool, 6, 44100, mode)
+                    : ebur128_pool_acquire(pool, 2, 48000, mode);
+                if (!meter) {
+                    ++mismatches;
+                    continue;
+                }
+                const std::vector<float>& audio = layout ? surround : stereo;
+                ebur128_add_frames_float(meter, audio.data(), audio.size() / meter->channels);
+                double global;
+                ebur128_loudness_global(meter, &global);
+                if (global != expectedGlobal[layout]) {
+                    ++mismatches;
+                }
+                ebur128_pool_release(pool, meter);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    EXPECT_EQ(mismatches.load(), 0);
+    ebur128_pool_destroy(&pool);
+}
+
+// Test that switching between 2.0 and 5.1 mid-programme within reserved
+// parameters does not allocate and measures like one stream, and that the
+// partial block at a switch of the sample rate is completed after it
+TEST_F(EBUR128Test, ParameterSwitchKeepsProgramme) {
+    const unsigned long sampleRate = 48000;
+    std::vector<float> stereo = generateMultichannelSignal<float>(sampleRate, 2, 9.5, 1.0);
+    const size_t frames = stereo.size() / 2;
+    // Switches between 100ms boundaries, the 5.1 part carrying the same
+    // front pair with silent centre and surrounds
+    const size_t switches[] = {112800, 312960};
+    std::vector<float> surround((switches[1] - switches[0]) * 6, 0.0f);
+    for (size_t i = 0; i < switches[1] - switches[0]; ++i) {
+        surround[6 * i] = stereo[2 * (switches[0] + i)];
+        surround[6 * i + 1] = stereo[2 * (switches[0] + i) + 1];
+    }
+
+    const int all = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+    const int modes[] = {all, all | EBUR128_MODE_LOW_MEMORY, all | EBUR128_MODE_HISTOGRAM};
+    for (int mode : modes) {
+        SCOPED_TRACE(mode);
+        CountingAllocator counter;
+        ebur128_allocator allocator = {CountingAllocator::allocate, CountingAllocator::reallocate,
+                                       CountingAllocator::deallocate, &counter};
+        ebur128_state* st = ebur128_init_with_allocator(2, sampleRate, mode, &allocator);
+        ASSERT_NE(st, nullptr);
+        ASSERT_EQ(ebur128_reserve(st, 10000), EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_reserve_parameters(st, 6, sampleRate), EBUR128_SUCCESS);
+
+        counter.forbidden = true;
+        ebur128_add_frames_float(st, stereo.data(), switches[0]);
+        EXPECT_EQ(ebur128_change_parameters(st, 6, sampleRate), EBUR128_SUCCESS);
+        ebur128_add_frames_float(st, surround.data(), surround.size() / 6);
+        EXPECT_EQ(ebur128_change_parameters(st, 2, sampleRate), EBUR128_SUCCESS);
+        ebur128_add_frames_float(st, &stereo[2 * switches[1]], frames - switches[1]);
+        double global, range, momentary, shortterm, peak;
+        EXPECT_EQ(ebur128_loudness_global(st, &global), EBUR128_SUCCESS);
+        EXPECT_EQ(ebur128_loudness_range(st, &range), EBUR128_SUCCESS);
+        ebur128_loudness_momentary(st, &momentary);
+        ebur128_loudness_shortterm(st, &shortterm);
+        counter.forbidden = false;
+
+        ebur128_state* reference = ebur128_init(2, sampleRate, mode);
+        ASSERT_NE(reference, nullptr);
+        ebur128_add_frames_float(reference, stereo.data(), frames);
+        double expected;
+        ebur128_loudness_global(reference, &expected);
+        EXPECT_NEAR(global, expected, 1e-9);
+        ebur128_loudness_range(reference, &expected);
+        EXPECT_NEAR(range, expected, 1e-9);
+        ebur128_loudness_momentary(reference, &expected);
+        EXPECT_NEAR(momentary, expected, 1e-9);
+        ebur128_loudness_shortterm(reference, &expected);
+        EXPECT_NEAR(shortterm, expected, 1e-9);
+        for (unsigned int c = 0; c < 2; ++c) {
+            ebur128_sample_peak(st, c, &peak);
+            ebur128_sample_peak(reference, c, &expected);
+            EXPECT_EQ(peak, expected);
+        }
+        ebur128_destroy(&reference);
+
+        ebur128_destroy(&st);
+        EXPECT_EQ(counter.live, 0u);
+    }
+
+    // 48 kHz to 22051 Hz to 44.1 kHz, each switch half way or less into a
+    // 100ms sub-block: 2400 of 4800 frames are 1103 of 2205 (rounded), and
+    // 500 of 2205 are 1000 of 4410. The block in flight carries over, so
+    // blocks follow from the 47 sub-blocks as in one stream.
+    const int mode = all | EBUR128_MODE_PUBLISH;
+    const unsigned long rates[] = {48000, 22051, 44100};
+    const size_t legs[] = {23 * 4800 + 2400, 1102 + 10 * 2205 + 500, 3410 + 12 * 4410};
+    ebur128_state* st = ebur128_init(2, rates[0], mode);
+    ASSERT_NE(st, nullptr);
+    ebur128_measurement m;
+    for (int leg = 0; leg < 3; ++leg) {
+        if (leg > 0) {
+            ASSERT_EQ(ebur128_change_parameters(st, 2, rates[leg]), EBUR128_SUCCESS);
+        }
+        std::vector<float> tone = generateSineWave(1000.0, 0.1, static_cast<int>(rates[leg]), 2,
+                                                   static_cast<double>(legs[leg]) / rates[leg] + 0.01);
+        ebur128_add_frames_float(st, tone.data(), legs[leg]);
+        ebur128_published(st, &m);
+        EXPECT_EQ(m.blocks, leg == 0 ? 20u : leg == 1 ? 31u : 44u);
+    }
+    double global, expected;
+    ebur128_loudness_global(st, &global);
+    ebur128_destroy(&st);
+    ebur128_state* reference = ebur128_init(2, rates[0], mode);
+    std::vector<float> tone = generateSineWave(1000.0, 0.1, static_cast<int>(rates[0]), 2, 4.7);
+    ebur128_add_frames_float(reference, tone.data(), tone.size() / 2);
+    ebur128_loudness_global(reference, &expected);
+    ebur128_destroy(&reference);
+    EXPECT_NEAR(global, expected, 0.05);
+}
+
+// Test measuring a channel subset of a wider stream, split into segments like
+// a wrapped ring buffer, against the same channels copied into a dense buffer.
+// Both are split at the same frames, as the sub-block sums depend on where
+// the input is split.
+TEST_F(EBUR128Test, SegmentedStridedInput) {
+    const int sampleRate = 48000;
+    const int streamChannels = 16;
+    const int firstChannel = 4;
+    const int channels = 6;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK |
+                     EBUR128_MODE_TRUE_PEAK;
+    auto stream = generateMultichannelSignal<float>(sampleRate, streamChannels, 4.0, 1.0);
+    size_t totalFrames = stream.size() / streamChannels;
+
+    std::vector<float> dense(totalFrames * channels);
+    for (size_t frame = 0; frame < totalFrames; ++frame) {
+        for (int ch = 0; ch < channels; ++ch) {
+            dense[frame * channels + ch] = stream[frame * streamChannels + firstChannel + ch];
+        }
+    }
+
+    ebur128_state* reference = ebur128_init(channels, sampleRate, mode);
+    ebur128_state* segmented = ebur128_init(channels, sampleRate, mode);
+    ASSERT_NE(reference, nullptr);
+    ASSERT_NE(segmented, nullptr);
+
+    // Hand the stream over in periods of 3000 frames, each wrapping around
+    // the end of a ring buffer after 1234 frames
+    const size_t period = 3000;
+    for (size_t offset = 0; offset < totalFrames; offset += period) {
+        size_t frames = std::min(period, totalFrames - offset);
+        size_t head = std::min<size_t>(1234, frames);
+        ebur128_iovec segments[2] = {
+            {stream.data() + offset * streamChannels, head},
+            {stream.data() + (offset + head) * streamChannels, frames - head},
+        };
+        ebur128_iovec denseSegments[2] = {
+            {dense.data() + offset * channels, head},
+            {dense.data() + (offset + head) * channels, frames - head},
+        };
+        ASSERT_EQ(ebur128_add_frames_iov_float(reference, denseSegments, 2, channels, 0),
+                  EBUR128_SUCCESS);
+        ASSERT_EQ(ebur128_add_frames_iov_float(segmented, segments, 2, streamChannels,
+                                               firstChannel),
+                  EBUR128_SUCCESS);
+
+        double expected, actual;
+        ebur128_loudness_momentary(reference, &expected);
+        ebur128_loudness_momentary(segmented, &actual);
+        EXPECT_EQ(expected, actual);
+        for (int ch = 0; ch < channels; ++ch) {
+            ebur128_prev_sample_peak(reference, ch, &expected);
+            ebur128_prev_sample_peak(segmented, ch, &actual);
+            EXPECT_EQ(expected, actual);
+            ebur128_prev_true_peak(reference, ch, &expected);
+            ebur128_prev_true_peak(segmented, ch, &actual);
+            EXPECT_EQ(expected, actual);
+        }
+    }
+
+    double expected, actual;
+    ebur128_loudness_global(reference, &expected);
+    ebur128_loudness_global(segmented, &actual);
+    EXPECT_EQ(expected, actual);
+    ebur128_loudness_range(reference, &expected);
+    ebur128_loudness_range(segmented, &actual);
+    EXPECT_EQ(expected, actual);
+
+    // The measured channels must fit inside a frame
+    ebur128_iovec segment = {stream.data(), 1};
+    EXPECT_EQ(ebur128_add_frames_iov_float(segmented, &segment, 1, streamChannels, 11),
+              EBUR128_ERROR_INVALID_CHANNEL_INDEX);
+
+    ebur128_destroy(&reference);
+    ebur128_destroy(&segmented);
+}
+
+// Test the packed and byte-swapped formats against the same samples passed as
+// native ints. Every format keeps the top bits of the int signal, so both
+// states must agree exactly, including full-scale samples.
+TEST_F(EBUR128Test, PackedFormatsMatchNativeInt) {
+    const int sampleRate = 48000;
+    const int channels = 3;
+    const int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK |
+                     EBUR128_MODE_TRUE_PEAK;
+    auto signal = generateMultichannelSignal<int>(sampleRate, channels, 3.0, 2147483647.0);
+    size_t totalFrames = signal.size() / channels;
+    signal[300 * channels] = INT_MIN;
+    signal[301 * channels + 1] = INT_MAX;
+
+    struct Format {
+        const char* name;
+        int bits;
+        int bytes;
+    };
+    for (const Format& format : {Format{"u8", 8, 1}, Format{"s16be", 16, 2},
+                                 Format{"s24le", 24, 3}, Format{"s24be", 24, 3},
+                                 Format{"s24in32", 24, 4}, Format{"s32be", 32, 4}}) {
+        std::string name = format.name;
+        std::vector<int> truncated(signal.size());
+        std::vector<unsigned char> packed(signal.size() * format.bytes);
+        std::vector<int> in32(signal.size());
+        for (size_t i = 0; i < signal.size(); ++i) {
+            unsigned int value = static_cast<unsigned int>(signal[i]) >> (32 - format.bits);
+            unsigned char* out = packed.data() + i * format.bytes;
+            truncated[i] = static_cast<int>(value << (32 - format.bits));
+            for (int b = 0; b < format.bytes; ++b) {
+                // Big-endian unless little-endian is asked for
+                int shift = name == "s24le" ? 8 * b : 8 * (format.bytes - 1 - b);
+                out[b] = static_cast<unsigned char>(value >> shift);
+            }
+            // u8 is offset binary, and s24in32 ignores the upper 8 bits
+            if (name == "u8") {
+                out[0] ^= 0x80;
+            }
+            in32[i] = static_cast<int>(value | (i % 7 == 0 ? 0xA5000000u : 0u));
+        }
+
+        ebur128_state* reference = ebur128_init(channels, sampleRate, mode);
+        ebur128_state* decoded = ebur128_init(channels, sampleRate, mode);
+        ASSERT_NE(reference, nullptr);
+        ASSERT_NE(decoded, nullptr);
+
+        size_t offset = 0;
+        for (size_t chunk = 1; offset < totalFrames; chunk = chunk * 3 + 7) {
+            size_t frames = std::min(chunk % 20000, totalFrames - offset);
+            const unsigned char* bytes = packed.data() + offset * channels * format.bytes;
+            int result = EBUR128_SUCCESS;
+            ASSERT_EQ(ebur128_add_frames_int(reference, truncated.data() + offset * channels,
+                                             frames),
+                      EBUR128_SUCCESS);
+            if (name == "u8") {
+                result = ebur128_add_frames_u8(decoded, bytes, frames);
+            } else if (name == "s16be") {
+                result = ebur128_add_frames_s16be(decoded, bytes, frames);
+            } else if (name == "s24le") {
+                result = ebur128_add_frames_s24le(decoded, bytes, frames);
+            } else if (name == "s24be") {
+                result = ebur128_add_frames_s24be(decoded, bytes, frames);
+            } else if (name == "s24in32") {
+                result = ebur128_add_frames_s24in32(decoded, in32.data() + offset * channels,
+                                                    frames);
+            } else {
+                result = ebur128_add_frames_s32be(decoded, bytes, frames);
+            }
+            ASSERT_EQ(result, EBUR128_SUCCESS) << name;
+            offset += frames;
+
+            double expected, actual;
+            ebur128_loudness_momentary(reference, &expected);
+            ebur128_loudness_momentary(decoded, &actual);
+            EXPECT_EQ(expected, actual) << name;
+            for (int ch = 0; ch < channels; ++ch) {
+                ebur128_prev_sample_peak(reference, ch, &expected);
+                ebur128_prev_sample_peak(decoded, ch, &actual);
+                EXPECT_EQ(expected, actual) << name;
+                ebur128_prev_true_peak(reference, ch, &expected);
+                ebur128_prev_true_peak(decoded, ch, &actual);
+                EXPECT_EQ(expected, actual) << name;
+            }
+        }
+
+        double expected, actual;
+        ebur128_loudness_global(reference, &expected);
+        ebur128_loudness_global(decoded, &actual);
+        EXPECT_EQ(expected, actual) << name;
+        ebur128_loudness_range(reference, &expected);
+        ebur128_loudness_range(decoded, &actual);
+        EXPECT_EQ(expected, actual) << name;
+        ebur128_sample_peak(decoded, 0, &actual);
+        EXPECT_EQ(actual, 1.0) << name;
+
+        ebur128_destroy(&reference);
+        ebur128_destroy(&decoded);
+    }
+}
+
+#ifdef EBUR128_BATCH_PATH
+// Test the batch analyzer on WAV, extensible float WAV and AIFF files written
+// from the same signal, against the library fed with the same samples, with
+// whole files and with files split into segments
+TEST_F(EBUR128Test, BatchAnalyzerMatchesLibrary) {
+    const int sampleRate = 48000;
+    const int channels = 2;
+    auto signal = generateMultichannelSignal<float>(sampleRate, channels, 6.0, 1.0);
+    const uint32_t frames = static_cast<uint32_t>(signal.size() / channels);
+
+    auto put = [](std::string& out, uint32_t value, int bytes, bool bigEndian) {
+        for (int i = 0; i < bytes; ++i) {
+            int shift = bigEndian ? 8 * (bytes - 1 - i) : 8 * i;
+            out += static_cast<char>((value >> shift) & 0xFF);
+        }
+    };
+    auto toInt = [](float sample, int bits) {
+        double scale = std::ldexp(1.0, bits - 1);
+        return static_cast<int32_t>(std::max(-scale, std::min(scale - 1.0, std::floor(sample * scale))));
+    };
+
+    // 24-bit PCM WAV
+    std::string wav24 = "RIFF";
+    put(wav24, 36 + frames * channels * 3, 4, false);
+    wav24 += "WAVEfmt ";
+    put(wav24, 16, 4, false);
+    put(wav24, 1, 2, false);
+    put(wav24, channels, 2, false);
+    put(wav24, sampleRate, 4, false);
+    put(wav24, sampleRate * channels * 3, 4, false);
+    put(wav24, channels * 3, 2, false);
+    put(wav24, 24, 2, false);
+    wav24 += "data";
+    put(wav24, frames * channels * 3, 4, false);
+    for (float sample : signal) {
+        put(wav24, static_cast<uint32_t>(toInt(sample, 24)), 3, false);
+    }
+
+    // WAVE_FORMAT_EXTENSIBLE float WAV, with the LFE in the second channel
+    std::string wavFloat = "RIFF";
+    put(wavFloat, 60 + frames * channels * 4, 4, false);
+    wavFloat += "WAVEfmt ";
+    put(wavFloat, 40, 4, false);
+    put(wavFloat, 0xFFFE, 2, false);
+    put(wavFloat, channels, 2, false);
+    put(wavFloat, sampleRate, 4, false);
+    put(wavFloat, sampleRate * channels * 4, 4, false);
+    put(wavFloat, channels * 4, 2, false);
+    put(wavFloat, 32, 2, false);
+    put(wavFloat, 22, 2, false);
+    put(wavFloat, 32, 2, false);
+    put(wavFloat, 0x1 | 0x8, 4, false);
+    put(wavFloat, 3, 2, false);
+    wavFloat += std::string("\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71", 14);
+    wavFloat += "data";
+    put(wavFloat, frames * channels * 4, 4, false);
+    for (float sample : signal) {
+        uint32_t bits;
+        memcpy(&bits, &sample, sizeof(bits));
+        put(wavFloat, bits, 4, false);
+    }
+
+    // 16-bit AIFF at 48 kHz (0x400E BB80 in 80-bit extended)
+    std::string aiff = "FORM";
+    put(aiff, 4 + 26 + 16 + frames * channels * 2, 4, true);
+    aiff += "AIFFCOMM";
+    put(aiff, 18, 4, true);
+    put(aiff, channels, 2, true);
+    put(aiff, frames, 4, true);
+    put(aiff, 16, 2, true);
+    aiff += std::string("\x40\x0E\xBB\x80\x00\x00\x00\x00\x00\x00", 10);
+    aiff += "SSND";
+    put(aiff, 8 + frames * channels * 2, 4, true);
+    put(aiff, 0, 4, true);
+    put(aiff, 0, 4, true);
+    for (float sample : signal) {
+        put(aiff, static_cast<uint32_t>(toInt(sample, 16)), 2, true);
+    }
+
+    // Expected values from the same samples
+    std::vector<int> samples24(signal.size());
+    std::vector<short> samples16(signal.size());
+    for (size_t i = 0; i < signal.size(); ++i) {
+        samples24[i] = toInt(signal[i], 24) * 256;
+        samples16[i] = static_cast<short>(toInt(signal[i], 16));
+    }
+    auto measure = [&](auto add, bool leftOnly, double* values) {
+        ebur128_state* st = ebur128_init(channels, sampleRate,
+                                         EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK);
+        ASSERT_NE(st, nullptr);
+        if (leftOnly) {
+            ebur128_set_channel(st, 1, EBUR128_UNUSED);
+        }
+        ASSERT_EQ(add(st), EBUR128_SUCCESS);
+        ebur128_loudness_global(st, &values[0]);
+        ebur128_loudness_range(st, &values[1]);
+        double samplePeak = 0.0, truePeak = 0.0;
+        for (int ch = 0; ch < channels; ++ch) {
+            double peak;
+            ebur128_sample_peak(st, ch, &peak);
+            samplePeak = std::max(samplePeak, peak);
+            ebur128_true_peak(st, ch, &peak);
+            truePeak = std::max(truePeak, peak);
+        }
+        values[2] = 20.0 * log10(samplePeak);
+        values[3] = 20.0 * log10(truePeak);
+        ebur128_destroy(&st);
+    };
+    double expected[3][4];
+    measure([&](ebur128_state* st) { return ebur128_add_frames_int(st, samples24.data(), frames); },
+            false, expected[0]);
+    measure([&](ebur128_state* st) { return ebur128_add_frames_float(st, signal.data(), frames); },
+            true, expected[1]);
+    measure([&](ebur128_state* st) { return ebur128_add_frames_short(st, samples16.data(), frames); },
+            false, expected[2]);
+
+    const std::string directory = ::testing::TempDir();
+    const std::string names[] = {"batch_s24.wav", "batch_float.wav", "batch_s16.aiff"};
+    const std::string* contents[] = {&wav24, &wavFloat, &aiff};
+    std::string paths;
+    for (int f = 0; f < 3; ++f) {
+        FILE* file = fopen((directory + names[f]).c_str(), "wb");
+        ASSERT_NE(file, nullptr);
+        fwrite(contents[f]->data(), 1, contents[f]->size(), file);
+        fclose(file);
+        paths += " " + directory + names[f];
+    }
+    paths += " " + directory + "batch_missing.wav 2>/dev/null";
+
+    // Whole files, and files split into segments measured in parallel
+    for (const char* options : {" --csv -j 2", " --csv -j 3 --segment 1.3"}) {
+        FILE* pipe = popen((std::string(EBUR128_BATCH_PATH) + options + paths).c_str(), "r");
+        ASSERT_NE(pipe, nullptr);
+        std::vector<std::string> lines;
+        char line[4096];
+        while (fgets(line, sizeof(line), pipe)) {
+            lines.push_back(line);
+        }
+        EXPECT_NE(pclose(pipe), 0); // one file is missing
+        ASSERT_EQ(lines.size(), 5u) << options;
+        EXPECT_EQ(lines[0], "path,duration_s,integrated_lufs,lra_lu,sample_peak_dbfs,true_peak_dbtp,error\n");
+
+        int found = 0;
+        for (size_t l = 1; l < lines.size(); ++l) {
+            std::vector<std::string> fields;
+            size_t begin = 0;
+            for (size_t comma; (comma = lines[l].find(',', begin)) != std::string::npos; begin = comma + 1) {
+                fields.push_back(lines[l].substr(begin, comma - begin));
+            }
+            fields.push_back(lines[l].substr(begin));
+            ASSERT_EQ(fields.size(), 7u) << lines[l];
+            if (fields[0] == directory + "batch_missing.wav") {
+                EXPECT_NE(fields[6], "\n");
+                continue;
+            }
+            for (int f = 0; f < 3; ++f) {
+                if (fields[0] != directory + names[f]) {
+                    continue;
+                }
+                ++found;
+                EXPECT_EQ(fields[6], "\n") << names[f];
+                EXPECT_NEAR(atof(fields[1].c_str()), 6.0, 0.0005) << names[f];
+                for (int k = 0; k < 4; ++k) {
+                    EXPECT_NEAR(atof(fields[2 + k].c_str()), expected[f][k], 0.0006)
+                        << names[f] << ", value " << k << options;
+                }
+            }
+        }
+        EXPECT_EQ(found, 3) << options;
+    }
+    for (const std::string& name : names) {
+        remove((directory + name).c_str());
+    }
+}
+#endif
+
+// Test the true-peak engine against a direct polyphase oversampler, with the
+// 4x (below 96 kHz) and 2x filters and chunks shorter than the filter delay
+TEST_F(EBUR128Test, TruePeakMatchesReferenceOversampler) {
+    for (int sampleRate : {44100, 96000}) {
+        for (int channels : {1, 3, 8}) {
+            unsigned int factor = sampleRate < 96000 ? 4 : 2;
+            auto signal = generateMultichannelSignal<double>(sampleRate, channels, 1.0, 1.0);
+            size_t totalFrames = signal.size() / channels;
+            ReferenceOversampler reference(factor, channels);
+            ebur128_state* st = ebur128_init(channels, sampleRate, EBUR128_MODE_TRUE_PEAK);
+            ASSERT_NE(st, nullptr);
+
+            size_t offset = 0;
+            for (size_t chunk = 1; offset < totalFrames; chunk = chunk * 5 % 2311 + 1) {
+                size_t frames = std::min(chunk, totalFrames - offset);
+                ASSERT_EQ(ebur128_add_frames_double(st, signal.data() + offset * channels, frames),
+                          EBUR128_SUCCESS);
+                auto peaks = reference.process(signal.data() + offset * channels, frames);
+                offset += frames;
+                for (int ch = 0; ch < channels; ++ch) {
+                    double peak;
+                    ebur128_prev_true_peak(st, ch, &peak);
+                    EXPECT_EQ(peak, peaks[ch])
+                        << "rate: " << sampleRate << ", channel: " << ch << ", offset: " << offset;
+                }
+            }
+
+            ebur128_destroy(&st);
+        }
+    }
+}
+
+// Test that skipping oversampling where the peak bound cannot exceed the
+// current maximum leaves every reported true peak unchanged, with quiet
+// passages between decaying bursts so that most of the signal is skipped
+TEST_F(EBUR128Test, TruePeakEarlyExitIsExact) {
+    for (int sampleRate : {48000, 96000}) {
+        const int channels = 2;
+        unsigned int factor = sampleRate < 96000 ? 4 : 2;
+        size_t totalFrames = static_cast<size_t>(sampleRate) * 4;
+        std::vector<double> signal(totalFrames * channels);
+        for (size_t frame = 0; frame < totalFrames; ++frame) {
+            double t = static_cast<double>(frame) / sampleRate;
+            double burst = exp(-30.0 * fmod(t, 0.3));
+            for (int ch = 0; ch < channels; ++ch) {
+                signal[frame * channels + ch] =
+                    0.05 * sin(2.0 * M_PI * 440.0 * (ch + 1) * t) +
+                    0.9 * burst * sin(2.0 * M_PI * (sampleRate / 4.1) * t + ch);
+            }
+        }
+
+        ReferenceOversampler reference(factor, channels);
+        ebur128_state* st = ebur128_init(channels, sampleRate, EBUR128_MODE_TRUE_PEAK);
+        ASSERT_NE(st, nullptr);
+        std::vector<double> expectedPeaks(channels, 0.0);
+        for (size_t offset = 0, chunk = 1000; offset < totalFrames; chunk = chunk * 7 % 40000) {
+            size_t frames = std::min(chunk, totalFrames - offset);
+            ASSERT_EQ(ebur128_add_frames_double(st, signal.data() + offset * channels, frames),
+                      EBUR128_SUCCESS);
+            auto peaks = reference.process(signal.data() + offset * channels, frames);
+            offset += frames;
+            for (int ch = 0; ch < channels; ++ch) {
+                double peak;
+                ebur128_prev_true_peak(st, ch, &peak);
+                EXPECT_EQ(peak, peaks[ch]) << "rate: " << sampleRate << ", offset: " << offset;
+                expectedPeaks[ch] = std::max(expectedPeaks[ch], peaks[ch]);
+            }
+        }
+        for (int ch = 0; ch < channels; ++ch) {
+            double peak;
+            ebur128_true_peak(st, ch, &peak);
+            EXPECT_EQ(peak, expectedPeaks[ch]);
+        }
+
+        ebur128_destroy(&st);
+    }
+}
+
+// Benchmark files per second for short clips, each measured by a new meter
+// or by one from a pool
+TEST_F(EBUR128Test, PoolThroughputBenchmark) {
+    const int sampleRate = 48000;
+    const double duration = 0.1;
+    const int files = 200;
+    const struct {
+        const char* name;
+        int mode;
+    } modes[] = {
+        {"I + LRA + SAMPLE_PEAK", EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK},
+        {"I + LRA + TRUE_PEAK", EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK},
+        {"I + LRA + HISTOGRAM",
+         EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_HISTOGRAM},
+    };
+
+    auto clip = generateMultichannelSignal<short>(sampleRate, 2, duration, 32767.0);
+    for (const auto& mode : modes) {
+        double elapsed[2];
+        double global[2];
+        ebur128_pool* pool = ebur128_pool_create(1, nullptr);
+        ASSERT_NE(pool, nullptr);
+        for (int pooled = 0; pooled < 2; ++pooled) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int file = 0; file < files; ++file) {
+                ebur128_state* st = pooled
+                    ? ebur128_pool_acquire(pool, 2, sampleRate, mode.mode)
+                    : ebur128_init(2, sampleRate, mode.mode);
+                ASSERT_NE(st, nullptr);
+                ASSERT_EQ(ebur128_add_frames_short(st, clip.data(), clip.size() / 2),
+                          EBUR128_SUCCESS);
+                ebur128_loudness_global(st, &global[pooled]);
+                if (pooled) {
+                    ebur128_pool_release(pool, st);
+                } else {
+                    ebur128_destroy(&st);
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            elapsed[pooled] = std::chrono::duration<double>(end - start).count();
+        }
+        ebur128_pool_destroy(&pool);
+        EXPECT_EQ(global[0], global[1]);
+
+        std::cout << duration << " s clips, " << mode.name << ": init/destroy "
+                  << files / elapsed[0] << " files/s, pool " << files / elapsed[1]
+                  << " files/s (" << elapsed[0] / elapsed[1] << "x)" << std::endl;
+    }
+}
+
+// Measure ingestion throughput per sample type and peak mode. Every source
+// sample is read once per add_frames call: sample peak, true-peak staging
+// and the K-weighting filter consume each tile while it is in cache.
+TEST_F(EBUR128Test, IngestionThroughputBenchmark) {
+    const int sampleRate = 48000;
+    const double duration = 10.0;
+    const size_t chunk = 4096;
+    const struct {
+        const char* name;
+        int mode;
+    } modes[] = {
+        {"I", EBUR128_MODE_I},
+        {"I + SAMPLE_PEAK", EBUR128_MODE_I | EBUR128_MODE_SAMPLE_PEAK},
+        {"I + TRUE_PEAK", EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK},
+    };
+
+    for (int channels : {2, 6}) {
+        auto shorts = generateMultichannelSignal<short>(sampleRate, channels, duration, 32767.0);
+        auto floats = generateMultichannelSignal<float>(sampleRate, channels, duration, 1.0);
+        size_t totalFrames = shorts.size() / channels;
+
+        for (const auto& mode : modes) {
+            double elapsed[2];
+            for (int type = 0; type < 2; ++type) {
+                ebur128_state* st = ebur128_init(channels, sampleRate, mode.mode);
+                ASSERT_NE(st, nullptr);
+                auto start = std::chrono::high_resolution_clock::now();
+                for (size_t offset = 0; offset < totalFrames; offset += chunk) {
+                    size_t frames = std::min(chunk, totalFrames - offset);
+                    int result = type == 0
+                        ? addFrames(st, shorts.data() + offset * channels, frames)
+                        : addFrames(st, floats.data() + offset * channels, frames);
+                    ASSERT_EQ(result, EBUR128_SUCCESS);
+                }
+                auto end = std::chrono::high_resolution_clock::now();
+                elapsed[type] = std::chrono::duration<double>(end - start).count();
+                ebur128_destroy(&st);
+            }
+
+            double samples = static_cast<double>(totalFrames) * channels;
+            std::cout << channels << " ch, " << mode.name << ": short "
+                      << samples * sizeof(short) / elapsed[0] / 1e6 << " MB/s ("
+                      << duration / elapsed[0] << "x real-time), float "
+                      << samples * sizeof(float) / elapsed[1] / 1e6 << " MB/s ("
+                      << duration / elapsed[1] << "x real-time)" << std::endl;
+        }
+    }
+}